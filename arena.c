@@ -0,0 +1,109 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN		16
+#define UPDATE_ARENA_CHUNK	(64 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[] __attribute__ ((aligned(ARENA_ALIGN)));
+};
+
+static struct arena update_arena = {
+	.chunks = NULL,
+	.chunk_size = UPDATE_ARENA_CHUNK,
+};
+static pthread_mutex_t update_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void arena_init(struct arena *a, size_t chunk_size)
+{
+	a->chunks = NULL;
+	a->chunk_size = chunk_size;
+}
+
+/*
+ * Return zeroed memory, NULL if there is no memory
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *chunk = a->chunks;
+	size_t csize;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		/* a large object gets its own chunk */
+		csize = size > a->chunk_size ? size : a->chunk_size;
+		chunk = malloc(sizeof(*chunk) + csize);
+		if (!chunk)
+			return NULL;
+		chunk->size = csize;
+		chunk->used = 0;
+		if (csize == size && a->chunks) {
+			/* keep filling the current chunk */
+			chunk->next = a->chunks->next;
+			a->chunks->next = chunk;
+		} else {
+			chunk->next = a->chunks;
+			a->chunks = chunk;
+		}
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	memset(p, 0, size);
+
+	return p;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = arena_alloc(a, len);
+
+	if (p)
+		memcpy(p, s, len);
+
+	return p;
+}
+
+void arena_release(struct arena *a)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = a->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	a->chunks = NULL;
+}
+
+void *update_alloc(size_t size)
+{
+	void *p;
+
+	pthread_mutex_lock(&update_arena_lock);
+	p = arena_alloc(&update_arena, size);
+	pthread_mutex_unlock(&update_arena_lock);
+
+	return p;
+}
+
+void update_arena_release(void)
+{
+	pthread_mutex_lock(&update_arena_lock);
+	arena_release(&update_arena);
+	pthread_mutex_unlock(&update_arena_lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator: memory is taken from large chunks
+ * and it is released all together.
+ */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+	size_t chunk_size;
+};
+
+void arena_init(struct arena *a, size_t chunk_size);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_release(struct arena *a);
+
+/*
+ * Arena owning the results of parsing sw-description,
+ * released by cleanup_files() at the end of an update.
+ */
+void *update_alloc(size_t size);
+void update_arena_release(void);
+
+/*
+ * Add to a dictionary of the parsed update, the nodes are taken
+ * from the update arena. dict_drop_db() must still be called
+ * before the arena is released.
+ */
+struct dict;
+int update_dict_insert_value(struct dict *dictionary, const char *key,
+			     const char *value);
+int update_dict_set_value(struct dict *dictionary, const char *key,
+			  const char *value);
+
+#endif
@@ -22,8 +22,9 @@
 #include "swupdate.h"
 #include "parselib.h"
 #include "swupdate_settings.h"
-#include "semver.h"
 #include "versions.h"
+#include "swver_index.h"
+#include "version_key.h"
 
 /*
  * Read versions of components from a file, if provided
@@ -55,7 +56,7 @@ static int read_sw_version_file(struct swupdate_cfg *sw)
 		ret = fscanf(fp, "%ms %ms", &name, &version);
 		/* pair component / version found */
 		if (ret == 2) {
-			swcomp = (struct sw_version *)calloc(1, sizeof(struct sw_version));
+			swcomp = swver_add(&sw->installed_sw_list, name, version);
 			if (!swcomp) {
 				ERROR("Allocation error");
 				fclose(fp);
@@ -63,10 +64,6 @@ static int read_sw_version_file(struct swupdate_cfg *sw)
 				free(version);
 				return -ENOMEM;
 			}
-			strlcpy(swcomp->name, name, sizeof(swcomp->name));
-			strlcpy(swcomp->version, version, sizeof(swcomp->version));
-
-			LIST_INSERT_HEAD(&sw->installed_sw_list, swcomp, next);
 			TRACE("Installed %s: Version %s",
 					swcomp->name,
 					swcomp->version);
@@ -100,6 +97,8 @@ static int versions_settings(void *setting, void *data)
 	void *elem;
 	int count, i;
 	struct sw_version *swcomp;
+	char name[sizeof(swcomp->name)];
+	char version[sizeof(swcomp->version)];
 
 	count = get_array_length(LIBCFG_PARSER, setting);
 
@@ -109,16 +108,15 @@ static int versions_settings(void *setting, void *data)
 		if (!elem)
 			continue;
 
-		swcomp = (struct sw_version *)calloc(1, sizeof(struct sw_version));
+		name[0] = version[0] = '\0';
+		GET_FIELD_STRING(LIBCFG_PARSER, elem, "name", name);
+		GET_FIELD_STRING(LIBCFG_PARSER, elem, "version", version);
+
+		swcomp = swver_add(&sw->installed_sw_list, name, version);
 		if (!swcomp) {
 			ERROR("Allocation error");
 			return -ENOMEM;
 		}
-
-		GET_FIELD_STRING(LIBCFG_PARSER, elem, "name", swcomp->name);
-		GET_FIELD_STRING(LIBCFG_PARSER, elem, "version", swcomp->version);
-
-		LIST_INSERT_HEAD(&sw->installed_sw_list, swcomp, next);
 		TRACE("Installed %s: Version %s",
 			swcomp->name,
 			swcomp->version);
@@ -145,64 +143,6 @@ void get_sw_versions(swupdate_cfg_handle  __attribute__ ((__unused__))*handle,
 }
 #endif
 
-/*
- * convert a version string into a number
- * version string is in the format:
- *
- * 	major.minor.revision.buildinfo
- *
- * but they do not need to have all fields.
- * Also major.minor or major.minor.revision are allowed
- * The conversion generates a 64 bit value that can be compared
- */
-static bool version_to_number(const char *version_string, __u64 *version_number)
-{
-	char **versions = NULL;
-	char **ver;
-	unsigned int count = 0;
-	bool valid = false;
-	__u64 version = 0;
-
-	versions = string_split(version_string, '.');
-	for (ver = versions; *ver != NULL && count < 4; ver++, count++) {
-		unsigned long int fld = strtoul(*ver, NULL, 10);
-		/* check for return of strtoul, mandatory */
-		if (fld > 0xffff) {
-			DEBUG("Version %s had an element > 65535, falling back to semver",
-			      version_string);
-			goto out;
-		}
-		version = (version << 16) | fld;
-	}
-	if (count > 4) {
-		DEBUG("Version %s had more than 4 numbers, trailing numbers will be ignored",
-		      version_string);
-	} else if (count > 0) {
-		version <<= 16 * (4 - count);
-	}
-	*version_number = version;
-	valid = true;
-
-out:
-	free_string_array(versions);
-
-	return valid;
-}
-
-static const char ACCEPTED_CHARS[] = "0123456789.";
-
-static bool is_oldstyle_version(const char *version_string, __u64 *version_number)
-{
-	const char *ver = version_string;
-	while (*ver)
-	{
-		if (strchr(ACCEPTED_CHARS, *ver) == NULL)
-			return false;
-		++ver;
-	}
-	return version_to_number(version_string, version_number);
-}
-
 /*
  * Compare 2 versions.
  *
@@ -216,57 +156,10 @@ static bool is_oldstyle_version(const char *version_string, __u64 *version_numbe
  */
 int compare_versions(const char* left_version, const char* right_version)
 {
+	struct version_key left, right;
 
-	__u64 left_u64;
-	__u64 right_u64;
-
-	if (is_oldstyle_version(left_version, &left_u64)
-	    && is_oldstyle_version(right_version, &right_u64))
-	{
-		DEBUG("Comparing old-style versions '%s' <-> '%s'",
-		      left_version, right_version);
-		TRACE("Parsed: '%llu' <-> '%llu'", left_u64, right_u64);
-
-		if (left_u64 < right_u64)
-			return -1;
-		else if (left_u64 > right_u64)
-			return 1;
-		else
-			return 0;
-	}
-
-	semver_t left_sem = {};
-	semver_t right_sem = {};
-	int comparison;
-
-	/*
-	 * Check if semantic version is possible
-	 */
-	if (!semver_parse(left_version, &left_sem) && !semver_parse(right_version, &right_sem)) {
-		DEBUG("Comparing semantic versions '%s' <-> '%s'", left_version, right_version);
-		if (loglevel >= TRACELEVEL)
-		{
-			char left_rendered[SWUPDATE_GENERAL_STRING_SIZE];
-			char right_rendered[SWUPDATE_GENERAL_STRING_SIZE];
-
-			left_rendered[0] = right_rendered[0] = '\0';
-
-			semver_render(&left_sem, left_rendered);
-			semver_render(&right_sem, right_rendered);
-			TRACE("Parsed: '%s' <-> '%s'", left_rendered, right_rendered);
-		}
+	version_key_parse(left_version, &left);
+	version_key_parse(right_version, &right);
 
-		comparison = semver_compare(left_sem, right_sem);
-		semver_free(&left_sem);
-		semver_free(&right_sem);
-		return comparison;
-	}
-	semver_free(&left_sem);
-	semver_free(&right_sem);
-
-	/*
-	 * Last attempt: just compare the two strings
-	 */
-	DEBUG("Comparing lexicographically '%s' <-> '%s'", left_version, right_version);
-	return strcmp(left_version, right_version);
+	return compare_version_keys(&left, &right);
 }
@@ -6,8 +6,10 @@
  */
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include <util.h>
 #include <bootloader.h>
+#include "bootloader_txn.h"
 
 int   (*bootloader_env_set)(const char *, const char *);
 int   (*bootloader_env_unset)(const char *);
@@ -17,12 +19,98 @@ int   (*bootloader_apply_list)(const char *);
 typedef struct {
 	const char *name;
 	bootloader *funcs;
+	bootloader_txn *txn;
 } entry;
 
 static entry *current = NULL;
 static entry *available = NULL;
 static unsigned int num_available = 0;
 
+/*
+ * The environment can be changed by the installer and by the IPC
+ * thread at the same time, calls into the backend are serialized.
+ * A transaction belongs to the thread that began it: the other
+ * threads wait until it is committed or aborted, so that their
+ * changes do not end up in it.
+ */
+static pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t env_idle = PTHREAD_COND_INITIALIZER;
+static struct {
+	unsigned int depth;
+	pthread_t owner;
+	bool open;	/* backend accepted begin() */
+	bool dirty;
+	bool aborted;
+	unsigned int stores;
+} env_txn;
+
+/* take the lock, waiting for a transaction of another thread to end */
+static void env_enter(void)
+{
+	pthread_mutex_lock(&env_lock);
+	while (env_txn.depth && !pthread_equal(env_txn.owner, pthread_self()))
+		pthread_cond_wait(&env_idle, &env_lock);
+}
+
+/* account a change, it is stored now or when the transaction ends */
+static void env_changed(void)
+{
+	if (env_txn.depth)
+		env_txn.dirty = true;
+	if (!env_txn.open)
+		env_txn.stores++;
+}
+
+static int env_set(const char *name, const char *value)
+{
+	int ret;
+
+	env_enter();
+	ret = current->funcs->env_set(name, value);
+	if (!ret)
+		env_changed();
+	pthread_mutex_unlock(&env_lock);
+
+	return ret;
+}
+
+static int env_unset(const char *name)
+{
+	int ret;
+
+	env_enter();
+	ret = current->funcs->env_unset(name);
+	if (!ret)
+		env_changed();
+	pthread_mutex_unlock(&env_lock);
+
+	return ret;
+}
+
+static char *env_get(const char *name)
+{
+	char *value;
+
+	env_enter();
+	value = current->funcs->env_get(name);
+	pthread_mutex_unlock(&env_lock);
+
+	return value;
+}
+
+static int apply_list(const char *filename)
+{
+	int ret;
+
+	env_enter();
+	ret = current->funcs->apply_list(filename);
+	if (!ret)
+		env_changed();
+	pthread_mutex_unlock(&env_lock);
+
+	return ret;
+}
+
 int register_bootloader(const char *name, bootloader *bl)
 {
 	entry *tmp = realloc(available, (num_available + 1) * sizeof(entry));
@@ -31,6 +119,7 @@ int register_bootloader(const char *name, bootloader *bl)
 	}
 	tmp[num_available].name = (char*)name;
 	tmp[num_available].funcs = bl;
+	tmp[num_available].txn = NULL;
 	num_available++;
 	available = tmp;
 	return 0;
@@ -44,17 +133,126 @@ int set_bootloader(const char *name)
 	for (unsigned int i = 0; i < num_available; i++) {
 		if (available[i].funcs &&
 		    (strcmp(available[i].name, name) == 0)) {
-			bootloader_env_set = available[i].funcs->env_set;
-			bootloader_env_get = available[i].funcs->env_get;
-			bootloader_env_unset = available[i].funcs->env_unset;
-			bootloader_apply_list = available[i].funcs->apply_list;
+			env_enter();
+			if (env_txn.depth) {
+				pthread_mutex_unlock(&env_lock);
+				ERROR("Cannot switch bootloader inside a transaction");
+				return -EBUSY;
+			}
+			bootloader_env_set = env_set;
+			bootloader_env_get = env_get;
+			bootloader_env_unset = env_unset;
+			bootloader_apply_list = apply_list;
 			current = &available[i];
+			pthread_mutex_unlock(&env_lock);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+int register_bootloader_txn(const char *name, bootloader_txn *txn)
+{
+	for (unsigned int i = 0; i < num_available; i++) {
+		if (strcmp(available[i].name, name) == 0) {
+			available[i].txn = txn;
 			return 0;
 		}
 	}
 	return -ENOENT;
 }
 
+int bootloader_env_begin(void)
+{
+	int ret;
+
+	if (!current)
+		return -ENOENT;
+
+	env_enter();
+	if (env_txn.depth++ == 0) {
+		env_txn.owner = pthread_self();
+		env_txn.open = false;
+		env_txn.dirty = false;
+		env_txn.aborted = false;
+		/*
+		 * On error the transaction still exists and must be
+		 * committed, but the changes are stored one by one.
+		 */
+		if (current->txn) {
+			ret = current->txn->begin();
+			if (ret)
+				WARN("Bootloader environment transaction not "
+				     "available (%d), storing each change", ret);
+			env_txn.open = (ret == 0);
+		}
+	}
+	pthread_mutex_unlock(&env_lock);
+
+	return 0;
+}
+
+/*
+ * Leave one level of the transaction of the calling thread. When the
+ * outermost one ends, the changes are stored, or dropped if any level
+ * was aborted.
+ */
+static int env_end(bool abort)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&env_lock);
+	if (!env_txn.depth ||
+	    !pthread_equal(env_txn.owner, pthread_self())) {
+		pthread_mutex_unlock(&env_lock);
+		return -EINVAL;
+	}
+	if (abort)
+		env_txn.aborted = true;
+	if (--env_txn.depth == 0) {
+		if (env_txn.aborted) {
+			if (env_txn.open)
+				ret = current->txn->abort();
+			else if (env_txn.dirty)
+				WARN("Bootloader environment changes were already stored");
+			if (!ret && !abort)
+				ret = -ECANCELED;
+		} else if (env_txn.open) {
+			ret = current->txn->commit();
+			if (!ret && env_txn.dirty)
+				env_txn.stores++;
+		}
+		env_txn.open = false;
+		env_txn.dirty = false;
+		pthread_cond_broadcast(&env_idle);
+	}
+	pthread_mutex_unlock(&env_lock);
+
+	return ret;
+}
+
+int bootloader_env_commit(void)
+{
+	int ret = env_end(false);
+
+	if (ret == -ECANCELED)
+		WARN("Bootloader environment transaction was aborted");
+	else if (ret && ret != -EINVAL)
+		ERROR("Cannot store bootloader environment: %d", ret);
+
+	return ret;
+}
+
+int bootloader_env_abort(void)
+{
+	return env_end(true);
+}
+
+unsigned int bootloader_env_stores(void)
+{
+	return env_txn.stores;
+}
+
 bool is_bootloader(const char *name) {
 	if (!name || !current) {
 		return false;
@@ -0,0 +1,43 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _BOOTLOADER_TXN_H
+#define _BOOTLOADER_TXN_H
+
+/*
+ * Optional hooks of a bootloader backend to batch environment
+ * changes. Between begin() and commit() the backend keeps the
+ * environment in RAM, commit() writes it once if it was changed,
+ * abort() drops the changes.
+ */
+typedef struct {
+	int (*begin)(void);
+	int (*commit)(void);
+	int (*abort)(void);
+} bootloader_txn;
+
+int register_bootloader_txn(const char *name, bootloader_txn *txn);
+
+/*
+ * Group the following env_set / env_unset / apply_list calls, they
+ * are stored when the outermost transaction is committed. Backends
+ * without hooks, or whose begin hook fails, store every change as
+ * before; begin() succeeds anyway and must be paired with commit().
+ *
+ * A transaction belongs to the calling thread, the other threads
+ * block on the environment until it ends. commit() and abort()
+ * return -EINVAL without an open transaction of the caller.
+ * After an abort() at any level the changes are dropped when the
+ * outermost transaction ends, its commit() returns -ECANCELED.
+ */
+int bootloader_env_begin(void);
+int bootloader_env_commit(void);
+int bootloader_env_abort(void);
+
+/* number of times the environment was stored since startup */
+unsigned int bootloader_env_stores(void);
+
+#endif
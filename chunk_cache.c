@@ -0,0 +1,512 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "sslapi.h"
+#include "channel.h"
+#include "channel_curl.h"
+#include "chunk_cache.h"
+
+#define CHUNK_MAX_SIZE		(8 * 1024 * 1024)
+#define CHUNK_MANIFEST_MAX	(4 * 1024 * 1024)
+/* upper limit of the data fetched with a single Range request */
+#define CHUNK_RANGE_MAX		(32 * 1024 * 1024)
+
+struct manifest_buf {
+	char *data;
+	size_t len;
+};
+
+struct range_state {
+	const char *dir;
+	struct chunk_entry *chunks;
+	unsigned int next;	/* chunk being received */
+	unsigned int end;
+	unsigned char *buf;
+	size_t fill;
+	/* the whole artifact is received, data before chunk next is dropped */
+	bool whole;
+	unsigned long long skip;
+	writeimage out_cb;
+	void *out;
+	int err;
+};
+
+struct store_file {
+	char name[2 * SHA256_HASH_LENGTH + 1];
+	off_t size;
+	time_t used;
+};
+
+int chunk_manifest_parse(struct chunk_manifest *m, const char *text, size_t len)
+{
+	char hashstr[2 * SHA256_HASH_LENGTH + 1];
+	unsigned long long offset = 0;
+	unsigned int alloc = 0;
+	const char *p = text, *end = text + len, *eol;
+	char line[256];
+	unsigned long size;
+
+	memset(m, 0, sizeof(*m));
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		if ((size_t)(eol - p) >= sizeof(line))
+			goto err;
+		memcpy(line, p, eol - p);
+		line[eol - p] = '\0';
+		if (line[0] == '#' || line[strspn(line, " \t\r")] == '\0')
+			continue;
+
+		if (sscanf(line, "%64s %lu", hashstr, &size) != 2 ||
+		    strlen(hashstr) != 2 * SHA256_HASH_LENGTH ||
+		    !size || size > CHUNK_MAX_SIZE)
+			goto err;
+
+		if (m->count == alloc) {
+			struct chunk_entry *tmp;
+
+			alloc = alloc ? 2 * alloc : 64;
+			tmp = realloc(m->chunks, alloc * sizeof(*tmp));
+			if (!tmp) {
+				chunk_manifest_free(m);
+				return -ENOMEM;
+			}
+			m->chunks = tmp;
+		}
+		if (ascii_to_hash(m->chunks[m->count].hash, hashstr))
+			goto err;
+		m->chunks[m->count].offset = offset;
+		m->chunks[m->count].size = size;
+		m->maxsize = max(m->maxsize, (size_t)size);
+		offset += size;
+		m->count++;
+	}
+
+	if (!m->count)
+		goto err;
+
+	return 0;
+
+err:
+	ERROR("Chunk manifest is malformed");
+	chunk_manifest_free(m);
+	return -EINVAL;
+}
+
+void chunk_manifest_free(struct chunk_manifest *m)
+{
+	free(m->chunks);
+	memset(m, 0, sizeof(*m));
+}
+
+static size_t manifest_write(char *streamdata, size_t size, size_t nmemb, void *data)
+{
+	channel_data_t *channel_data = (channel_data_t *)data;
+	struct manifest_buf *mb = (struct manifest_buf *)channel_data->user;
+	size_t len = size * nmemb;
+	char *tmp;
+
+	if (mb->len + len > CHUNK_MANIFEST_MAX)
+		return 0;
+	tmp = realloc(mb->data, mb->len + len);
+	if (!tmp)
+		return 0;
+	memcpy(tmp + mb->len, streamdata, len);
+	mb->data = tmp;
+	mb->len += len;
+
+	return len;
+}
+
+int chunk_manifest_download(channel_t *channel, channel_data_t *channel_data,
+			    struct chunk_manifest *m)
+{
+	channel_data_t cd = *channel_data;
+	struct manifest_buf mb = { 0 };
+	char *url;
+	int ret;
+
+	if (asprintf(&url, "%s%s", channel_data->url, CHUNK_MANIFEST_SUFFIX) < 0)
+		return -ENOMEM;
+
+	cd.url = url;
+	cd.range = NULL;
+	cd.cached_file = NULL;
+	cd.noipc = true;
+	cd.dwlwrdata = manifest_write;
+	cd.user = &mb;
+
+	if (channel->get_file(channel, &cd) != CHANNEL_OK || !mb.len) {
+		TRACE("No chunk manifest at %s", url);
+		ret = -ENOENT;
+	} else {
+		ret = chunk_manifest_parse(m, mb.data, mb.len);
+	}
+
+	free(mb.data);
+	free(url);
+
+	return ret;
+}
+
+static void chunk_path(char *path, size_t len, const char *dir,
+		       const unsigned char *hash)
+{
+	char hashstr[2 * SHA256_HASH_LENGTH + 1];
+
+	hash_to_ascii(hash, hashstr);
+	snprintf(path, len, "%s/%s", dir, hashstr);
+}
+
+static bool chunk_verify(const struct chunk_entry *c, const unsigned char *buf)
+{
+	struct swupdate_digest *dgst;
+	unsigned char md_value[64];
+	unsigned int md_len = 0;
+	bool ok = false;
+
+	dgst = swupdate_HASH_init(SHA_DEFAULT);
+	if (!dgst)
+		return false;
+	if (swupdate_HASH_update(dgst, buf, c->size) >= 0 &&
+	    swupdate_HASH_final(dgst, md_value, &md_len) >= 0)
+		ok = md_len == SHA256_HASH_LENGTH &&
+		     !swupdate_HASH_compare((unsigned char *)c->hash, md_value);
+	swupdate_HASH_cleanup(dgst);
+
+	return ok;
+}
+
+static bool chunk_cached(const char *dir, const struct chunk_entry *c)
+{
+	char path[PATH_MAX];
+
+	chunk_path(path, sizeof(path), dir, c->hash);
+
+	return access(path, R_OK) == 0;
+}
+
+/*
+ * Read a chunk from the store, a chunk that does not
+ * match its hash is removed and must be fetched again.
+ */
+static bool chunk_read(const char *dir, const struct chunk_entry *c,
+		       unsigned char *buf)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	bool ok = false;
+	int fd;
+
+	chunk_path(path, sizeof(path), dir, c->hash);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (!fstat(fd, &st) && (size_t)st.st_size == c->size &&
+	    fill_buffer(fd, buf, c->size) == (int)c->size)
+		ok = chunk_verify(c, buf);
+	/* the modification time tracks the last use for the eviction */
+	if (ok)
+		futimens(fd, NULL);
+	close(fd);
+
+	if (!ok) {
+		WARN("Chunk %s is corrupted, fetching it again", path);
+		unlink(path);
+	}
+
+	return ok;
+}
+
+static void chunk_store(const char *dir, const struct chunk_entry *c,
+			const unsigned char *buf)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s/.chunk-XXXXXX", dir);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		WARN("Cannot store chunk in %s: %s", dir, strerror(errno));
+		return;
+	}
+
+	chunk_path(path, sizeof(path), dir, c->hash);
+	if (copy_write(&fd, buf, c->size) || close(fd) || rename(tmp, path)) {
+		WARN("Cannot store chunk %s", path);
+		unlink(tmp);
+	}
+}
+
+static size_t chunk_range_write(char *streamdata, size_t size, size_t nmemb, void *data)
+{
+	channel_data_t *channel_data = (channel_data_t *)data;
+	struct range_state *s = (struct range_state *)channel_data->user;
+	size_t len = size * nmemb;
+	struct chunk_entry *c;
+	size_t n;
+
+	/* a server ignoring the Range answers 200 with the whole artifact */
+	if (!s->whole && channel_data->http_response_code == 200) {
+		TRACE("Server does not support Range requests");
+		s->err = -ENOTSUP;
+		return 0;
+	}
+	/* error pages are not data, the code is checked by the caller */
+	if (channel_data->http_response_code != (s->whole ? 200 : 206))
+		return 0;
+	if (s->skip) {
+		n = min(len, s->skip);
+		s->skip -= n;
+		streamdata += n;
+		len -= n;
+	}
+
+	while (len) {
+		if (s->next == s->end) {
+			ERROR("Server sent more data than requested");
+			s->err = -EINVAL;
+			return 0;
+		}
+		c = &s->chunks[s->next];
+		n = min(len, c->size - s->fill);
+		memcpy(s->buf + s->fill, streamdata, n);
+		s->fill += n;
+		streamdata += n;
+		len -= n;
+		if (s->fill < c->size)
+			continue;
+
+		if (!chunk_verify(c, s->buf)) {
+			ERROR("Chunk at offset %llu does not match its hash", c->offset);
+			s->err = -EFAULT;
+			return 0;
+		}
+		if (s->out_cb(s->out, s->buf, c->size) < 0) {
+			s->err = -EIO;
+			return 0;
+		}
+		chunk_store(s->dir, c, s->buf);
+		s->fill = 0;
+		s->next++;
+	}
+
+	return size * nmemb;
+}
+
+/*
+ * Client errors do not go away by retrying: the artifact or the
+ * range does not exist (404, 416) or the request is refused.
+ */
+static bool chunk_http_permanent(long code)
+{
+	return code >= 400 && code < 500 && code != 408 && code != 429;
+}
+
+/*
+ * Fetch the chunks [first, end) with a Range request, or the whole
+ * artifact if s->whole is set. A broken transfer is resumed from the
+ * first chunk not yet received, the chunks are passed on only when
+ * complete and verified. As for the channel, retries is the number
+ * of attempts after the first failure, the count restarts when a
+ * chunk was received.
+ */
+static int chunk_fetch_range(struct range_state *s, channel_t *channel,
+			     channel_data_t *channel_data)
+{
+	channel_data_t cd = *channel_data;
+	struct chunk_entry *last = &s->chunks[s->end - 1];
+	char range[64];
+	unsigned int tries = 0, first;
+
+	cd.cached_file = NULL;
+	cd.noipc = true;
+	cd.dwlwrdata = chunk_range_write;
+	cd.user = s;
+	/* curl resumes by offset, which does not mix with a range */
+	cd.retries = 0;
+
+	while (true) {
+		if (s->whole) {
+			snprintf(range, sizeof(range), "whole artifact");
+			cd.range = NULL;
+			s->skip = s->chunks[s->next].offset;
+		} else {
+			snprintf(range, sizeof(range), "%llu-%llu",
+				 s->chunks[s->next].offset,
+				 last->offset + last->size - 1);
+			cd.range = range;
+		}
+		s->fill = 0;
+		s->err = 0;
+		first = s->next;
+
+		if (channel->get_file(channel, &cd) == CHANNEL_OK && s->next == s->end)
+			return 0;
+		if (s->err)
+			return s->err;
+		if (chunk_http_permanent(cd.http_response_code)) {
+			ERROR("Cannot fetch %s: HTTP error %ld", range,
+			      cd.http_response_code);
+			return -EIO;
+		}
+		if (s->next != first)
+			tries = 0;
+		if (++tries > channel_data->retries) {
+			ERROR("Cannot fetch %s", range);
+			return -EIO;
+		}
+		WARN("Fetching %s failed, retrying", range);
+		sleep(channel_data->retry_sleep);
+	}
+}
+
+static int store_file_cmp(const void *a, const void *b)
+{
+	const struct store_file *x = a, *y = b;
+
+	if (x->used == y->used)
+		return 0;
+	return x->used < y->used ? -1 : 1;
+}
+
+/*
+ * Keep the store below max bytes, the chunks not used
+ * for the longest time are removed first.
+ */
+static void chunk_store_evict(const char *dir, unsigned long long max)
+{
+	struct store_file *files = NULL, *tmp;
+	unsigned int count = 0, alloc = 0, i;
+	unsigned long long total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((de = readdir(d))) {
+		if (strlen(de->d_name) != 2 * SHA256_HASH_LENGTH ||
+		    fstatat(dirfd(d), de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? 2 * alloc : 256;
+			tmp = realloc(files, alloc * sizeof(*files));
+			if (!tmp)
+				break;
+			files = tmp;
+		}
+		strlcpy(files[count].name, de->d_name, sizeof(files[count].name));
+		files[count].size = st.st_size;
+		files[count].used = st.st_mtime;
+		total += st.st_size;
+		count++;
+	}
+
+	if (total > max) {
+		qsort(files, count, sizeof(*files), store_file_cmp);
+		for (i = 0; i < count && total > max; i++) {
+			if (!unlinkat(dirfd(d), files[i].name, 0))
+				total -= files[i].size;
+		}
+		TRACE("Chunk store trimmed, %u chunks removed", i);
+	}
+
+	closedir(d);
+	free(files);
+}
+
+int chunk_cache_fetch(const char *dir, unsigned long long store_max,
+		      channel_t *channel, channel_data_t *channel_data,
+		      struct chunk_manifest *m, writeimage out_cb, void *out)
+{
+	struct range_state s = {
+		.dir = dir,
+		.chunks = m->chunks,
+		.out_cb = out_cb,
+		.out = out,
+	};
+	unsigned long long reused = 0, total = 0;
+	unsigned int i, end;
+	size_t bytes;
+	int ret = 0;
+
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		ERROR("Cannot create chunk store %s: %s", dir, strerror(errno));
+		return -EFAULT;
+	}
+
+	s.buf = malloc(m->maxsize);
+	if (!s.buf)
+		return -ENOMEM;
+
+	for (i = 0; i < m->count; i = end) {
+		total += m->chunks[i].size;
+		if (chunk_cached(dir, &m->chunks[i]) &&
+		    chunk_read(dir, &m->chunks[i], s.buf)) {
+			reused += m->chunks[i].size;
+			if (out_cb(out, s.buf, m->chunks[i].size) < 0) {
+				ret = -EIO;
+				break;
+			}
+			end = i + 1;
+			continue;
+		}
+
+		/* adjacent missing chunks are fetched with a single request */
+		bytes = m->chunks[i].size;
+		for (end = i + 1; end < m->count; end++) {
+			if (bytes + m->chunks[end].size > CHUNK_RANGE_MAX ||
+			    chunk_cached(dir, &m->chunks[end]))
+				break;
+			bytes += m->chunks[end].size;
+			total += m->chunks[end].size;
+		}
+
+		s.next = i;
+		s.end = end;
+		ret = chunk_fetch_range(&s, channel, channel_data);
+		if (ret == -ENOTSUP) {
+			/* no Range support, get the rest from the whole artifact */
+			WARN("Range requests not supported, downloading the artifact");
+			for (; end < m->count; end++)
+				total += m->chunks[end].size;
+			s.next = i;
+			s.end = end;
+			s.whole = true;
+			ret = chunk_fetch_range(&s, channel, channel_data);
+		}
+		if (ret)
+			break;
+	}
+
+	free(s.buf);
+
+	if (store_max)
+		chunk_store_evict(dir, store_max);
+
+	if (!ret)
+		INFO("%llu of %llu bytes reused from the chunk store", reused, total);
+
+	return ret;
+}
@@ -0,0 +1,55 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _CHUNK_CACHE_H
+#define _CHUNK_CACHE_H
+
+#include "util.h"
+#include "channel.h"
+#include "channel_curl.h"
+
+/*
+ * An artifact on the server can be described by a manifest, stored
+ * next to it as <url>.chunks. Each line lists a chunk of the artifact
+ * as "<sha256> <size>", the chunks are contiguous and in order.
+ * Chunks are kept in a local store named by their hash, so that the
+ * chunks shared with a previous download are not fetched again.
+ */
+#define CHUNK_MANIFEST_SUFFIX	".chunks"
+
+struct chunk_entry {
+	unsigned char hash[SHA256_HASH_LENGTH];
+	unsigned long long offset;
+	size_t size;
+};
+
+struct chunk_manifest {
+	struct chunk_entry *chunks;
+	unsigned int count;
+	size_t maxsize;
+};
+
+int chunk_manifest_parse(struct chunk_manifest *m, const char *text, size_t len);
+int chunk_manifest_download(channel_t *channel, channel_data_t *channel_data,
+			    struct chunk_manifest *m);
+void chunk_manifest_free(struct chunk_manifest *m);
+
+/* default maximum size of the chunk store */
+#define CHUNK_STORE_DEFAULT_MAX	(256ULL * 1024 * 1024)
+
+/*
+ * Pass the artifact described by the manifest to out_cb, reading
+ * the chunks from the store in dir and fetching the missing ones
+ * with Range requests. If the server ignores the Range, the rest of
+ * the artifact is downloaded in full. The fetched chunks are added
+ * to the store, that is then trimmed to store_max bytes removing the
+ * least recently used chunks (0: no limit).
+ */
+int chunk_cache_fetch(const char *dir, unsigned long long store_max,
+		      channel_t *channel, channel_data_t *channel_data,
+		      struct chunk_manifest *m, writeimage out_cb, void *out);
+
+#endif
@@ -26,6 +26,7 @@
 #include "util.h"
 #include "sslapi.h"
 #include "progress.h"
+#include "swu_map.h"
 
 #define MODULE_NAME "cpio"
 
@@ -188,6 +189,135 @@ int copy_write(void *out, const void *buf, size_t len)
 	return 0;
 }
 
+/*
+ * Compare before write: with the image property
+ * "compare-before-write" = "true", copyimage() reads the destination
+ * and writes only the blocks that differ. When most of the image is
+ * already on the device, as in A/B updates, this saves time and wear.
+ */
+#define COMPARE_BLOCK_SIZE	4096
+
+struct compare_write {
+	int fd;
+	off_t pos;
+	bool disabled;
+	unsigned char *buf;
+	size_t bufsize;
+	unsigned long long written;
+	unsigned long long skipped;
+};
+
+/*
+ * Return the bytes read, a short count at the end of the device,
+ * -1 if nothing can be read
+ */
+static ssize_t pread_all(int fd, unsigned char *buf, size_t len, off_t pos)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, buf + done, len - done, pos + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && !done)
+			return -1;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t pos)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			ERROR("cannot write %" PRIuPTR " bytes: %s", len, strerror(errno));
+			return -1;
+		}
+		len -= ret;
+		buf += ret;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+static int copy_write_compare(void *out, const void *buf, size_t len)
+{
+	struct compare_write *cw = (struct compare_write *)out;
+	const unsigned char *data = buf;
+	size_t off, blk, run = 0, runlen = 0;
+	ssize_t avail;
+
+	if (cw->disabled)
+		goto write_all;
+
+	if (len > cw->bufsize) {
+		unsigned char *tmp = realloc(cw->buf, len);
+		if (!tmp) {
+			ERROR("No memory to compare %" PRIuPTR " bytes", len);
+			return -1;
+		}
+		cw->buf = tmp;
+		cw->bufsize = len;
+	}
+
+	/* a short read just means that the rest must be written */
+	avail = pread_all(cw->fd, cw->buf, len, cw->pos);
+	if (avail < 0) {
+		WARN("Destination cannot be read (%s), compare-before-write disabled",
+		     strerror(errno));
+		cw->disabled = true;
+		goto write_all;
+	}
+
+	for (off = 0; off < len; off += blk) {
+		blk = min(len - off, COMPARE_BLOCK_SIZE -
+			  (size_t)((cw->pos + off) % COMPARE_BLOCK_SIZE));
+		if (off + blk <= (size_t)avail &&
+		    !memcmp(cw->buf + off, data + off, blk)) {
+			cw->skipped++;
+			if (runlen && pwrite_all(cw->fd, data + run, runlen, cw->pos + run))
+				return -1;
+			runlen = 0;
+			continue;
+		}
+		cw->written++;
+		if (!runlen)
+			run = off;
+		runlen += blk;
+	}
+	if (runlen && pwrite_all(cw->fd, data + run, runlen, cw->pos + run))
+		return -1;
+
+	cw->pos += len;
+
+	return 0;
+
+write_all:
+	if (pwrite_all(cw->fd, data, len, cw->pos))
+		return -1;
+	cw->written += (len + COMPARE_BLOCK_SIZE - 1) / COMPARE_BLOCK_SIZE;
+	cw->pos += len;
+
+	return 0;
+}
+
+static bool compare_before_write(struct img_type *img)
+{
+	char *value = dict_get_value(&img->properties, "compare-before-write");
+
+	return value && !strcmp(value, "true");
+}
+
 #if defined(__FreeBSD__)
 /*
  * FreeBSD likes to have multiples of 512 bytes written
@@ -253,6 +383,8 @@ static int input_step(void *state, void *buffer, size_t size)
 		break;
 	case INPUT_FROM_MEMORY:
 		memcpy(buffer, &s->inbuf[s->pos], size);
+		for (size_t i = 0; i < size; i++)
+			s->checksum += s->inbuf[s->pos + i];
 		if (s->dgst) {
 			if (swupdate_HASH_update(s->dgst, &s->inbuf[s->pos], size) < 0)
 				return -EFAULT;
@@ -710,6 +842,7 @@ copyfile_exit:
 
 int copyimage(void *out, struct img_type *img, writeimage callback)
 {
+	struct compare_write cw = { .fd = -1 };
 	struct swupdate_copy copy = {
 		.fdin = img->fdin,
 		.out = out,
@@ -723,8 +856,46 @@ int copyimage(void *out, struct img_type *img, writeimage callback)
 		.hash = img->sha256,
 		.encrypted = img->is_encrypted,
 		.imgivt = img->ivt_ascii,
+		/* read from the mapped SWU if the image was not copied */
+		.inbuf = swu_map_image_data(img),
 	};
-	return copyfile(&copy);
+	int ret;
+
+	/*
+	 * Only the default writer to a file descriptor can compare.
+	 * The compare writer uses pread/pwrite at its own position,
+	 * the seek of the image is applied to it here.
+	 */
+	if (!callback && out && compare_before_write(img)) {
+		cw.fd = *(int *)out;
+		cw.pos = lseek(cw.fd, img->seek, img->seek ? SEEK_SET : SEEK_CUR);
+		if (cw.pos < 0) {
+			ERROR("Cannot set output position: %s", strerror(errno));
+			return -EFAULT;
+		}
+		copy.out = &cw;
+		copy.callback = copy_write_compare;
+		copy.seek = 0;
+	}
+
+	ret = copyfile(&copy);
+
+	if (cw.fd >= 0) {
+		char info[PRINFOSIZE];
+
+		if (lseek(cw.fd, cw.pos, SEEK_SET) < 0)
+			WARN("Cannot set output position: %s", strerror(errno));
+		TRACE("%s: %llu blocks written, %llu unchanged", img->fname,
+		      cw.written, cw.skipped);
+		snprintf(info, sizeof(info),
+			 "{\"compare-before-write\": {\"image\": \"%s\", "
+			 "\"blocksize\": %d, \"written\": %llu, \"skipped\": %llu}}",
+			 img->fname, COMPARE_BLOCK_SIZE, cw.written, cw.skipped);
+		swupdate_progress_info(RUN, CAUSE_NONE, info);
+		free(cw.buf);
+	}
+
+	return ret;
 }
 
 int extract_cpio_header(int fd, struct filehdr *fhdr, unsigned long *offset)
@@ -20,6 +20,7 @@
 #include "parselib.h"
 #include "swupdate_settings.h"
 #include "pctl.h"
+#include "chunk_cache.h"
 
 /*
  * Number of seconds while below low speed
@@ -52,6 +53,46 @@ static channel_data_t channel_options = {
 	.headers = NULL,
 };
 
+/*
+ * Directory of the local chunk store, see chunk_cache.h.
+ * If it is not set, the artifacts are always downloaded in full.
+ */
+static char chunk_cache_dir[SWUPDATE_GENERAL_STRING_SIZE];
+static unsigned long long chunk_cache_size = CHUNK_STORE_DEFAULT_MAX;
+
+static int ipc_write_stream(void *out, const void *buf, size_t len)
+{
+	return ipc_send_data(*(int *)out, (char *)buf, (int)len) < 0 ? -1 : 0;
+}
+
+/*
+ * Stream the artifact described by the manifest to the installer,
+ * fetching from the server only the chunks missing in the store.
+ */
+static RECOVERY_STATUS download_chunks(channel_t *channel,
+				       channel_data_t *channel_data,
+				       struct chunk_manifest *manifest)
+{
+	struct swupdate_request req;
+	int fd;
+	int ret;
+
+	swupdate_prepare_req(&req);
+	req.dry_run = channel_data->dry_run;
+	req.source = channel_data->source;
+	fd = ipc_inst_start_ext(&req, sizeof(req));
+	if (fd < 0) {
+		ERROR("Cannot open SWUpdate IPC stream: %s", strerror(errno));
+		return FAILURE;
+	}
+
+	ret = chunk_cache_fetch(chunk_cache_dir, chunk_cache_size, channel,
+				channel_data, manifest, ipc_write_stream, &fd);
+	ipc_end(fd);
+
+	return ret ? FAILURE : SUCCESS;
+}
+
 /*
  * This provides a pull from an external server
  * It is not thought to work with local (file://)
@@ -69,9 +110,17 @@ static RECOVERY_STATUS download_from_url(channel_data_t* channel_data)
 
 	RECOVERY_STATUS result = SUCCESS;
 	channel_data->source = SOURCE_DOWNLOADER;
-	channel_op_res_t chanresult = channel->get_file(channel, channel_data);
-	if (chanresult != CHANNEL_OK) {
-		result = FAILURE;
+	struct chunk_manifest manifest;
+	if (strlen(chunk_cache_dir) &&
+	    !chunk_manifest_download(channel, channel_data, &manifest)) {
+		TRACE("Chunk manifest found, %u chunks", manifest.count);
+		result = download_chunks(channel, channel_data, &manifest);
+		chunk_manifest_free(&manifest);
+	} else {
+		channel_op_res_t chanresult = channel->get_file(channel, channel_data);
+		if (chanresult != CHANNEL_OK) {
+			result = FAILURE;
+		}
 	}
 	if (ipc_wait_for_complete(NULL) != SUCCESS) {
 		result = FAILURE;
@@ -107,6 +156,21 @@ static int download_settings(void *elem, void  __attribute__ ((__unused__)) *dat
 		opt->auth = NULL;
 	}
 
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "chunk-cache", tmp);
+	if (strlen(tmp)) {
+		strlcpy(chunk_cache_dir, tmp, sizeof(chunk_cache_dir));
+	}
+
+	GET_FIELD_STRING_RESET(LIBCFG_PARSER, elem, "chunk-cache-size", tmp);
+	if (strlen(tmp)) {
+		errno = 0;
+		chunk_cache_size = ustrtoull(tmp, NULL, 10);
+		if (errno) {
+			ERROR("chunk-cache-size %s: ustrtoull failed", tmp);
+			return -EINVAL;
+		}
+	}
+
 	GET_FIELD_INT(LIBCFG_PARSER, elem, "retries",
 		(int *)&opt->retries);
 	GET_FIELD_INT(LIBCFG_PARSER, elem, "timeout",
@@ -512,6 +512,11 @@ static int do_apply_list(const char *filename)
 	return result;
 }
 
+/*
+ * No bootloader_txn hooks: changes already go to the in-memory working
+ * copy and are persisted only by the state transitions above, so
+ * bootloader_env_begin()/commit() leave EFI Boot Guard untouched.
+ */
 static bootloader ebg = {
 	.env_get = &do_env_get,
 	.env_set = &do_env_set,
@@ -20,6 +20,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
 #include <linux/version.h>
 #include <sys/ioctl.h>
@@ -27,22 +29,16 @@
 #include <mtd/mtd-user.h>
 #include "swupdate_image.h"
 #include "handler.h"
+#include "handler_parallel.h"
 #include "util.h"
 #include "flash.h"
 #include "progress.h"
+#include "cpiohdr.h"
+#include "swu_map.h"
 
 #define PROCMTD	"/proc/mtd"
 #define LINESIZE	80
 
-#define EVEN_WHOLE  0xff
-#define EVEN_HALF   0x0f
-#define ODD_HALF    0xf0
-#define EVEN_FOURTH 0x33
-#define ODD_FOURTH  0xcc
-#define EVEN_EIGHTH 0x55
-#define ODD_EIGHTH  0xaa
-#define ODD_WHOLE   0x00
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
 #define MTD_FILE_MODE_RAW MTD_MODE_RAW
 #endif
@@ -54,92 +50,69 @@
 #define LOG2(n) (((n) < 1<<16) ? _L8(n) : 16 + _L8((n)>>16))
 
 void flash_1bit_hamming_handler(void);
+void flash_hamming1_ecc(const unsigned char *sector, unsigned char *code,
+			unsigned int sector_size);
 
-static unsigned char calc_bitwise_parity(unsigned char val, unsigned char mask)
-{
-	unsigned char result = 0, byte_mask;
-	int i;
-
-	byte_mask = mask;
-
-	for (i = 0; i < 8; i++) {
-		if ((byte_mask & 0x1) != 0)
-			result ^= (val & 1);
-		byte_mask >>= 1;
-		val >>= 1;
-	}
-	return result & 0x1;
-}
-
-static unsigned char calc_row_parity_bits(unsigned char byte_parities[],
-					  int even, int chunk_size,
-					  int sector_size)
-{
-	unsigned char result = 0;
-	int i, j;
-
-	for (i = (even ? 0 : chunk_size);
-	     i < sector_size;
-	     i += (2 * chunk_size)) {
-		for (j = 0; j < chunk_size; j++)
-			result ^= byte_parities[i + j];
-	}
-	return result & 0x1;
-}
+/* parity of each byte value */
+#define P2(n)	n, n ^ 1, n ^ 1, n
+#define P4(n)	P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n)	P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+static const unsigned char byte_parity[256] = {
+	P6(0), P6(1), P6(1), P6(0)
+};
 
 /*
  * Based on Texas Instrument's C# GenECC application
  * (sourceforge.net/projects/dvflashutils)
+ *
+ * The row parity bit i is the parity of the bytes whose offset
+ * has bit i set (odd) or cleared (even): xoring the offsets of
+ * the bytes with odd parity computes all odd row bits at once,
+ * the even ones are their complement if the whole sector has
+ * odd parity. The column bits are the parities of the xor of
+ * all bytes.
  */
-static unsigned int nand_calculate_ecc(unsigned char *buf, unsigned int sector_size)
+static unsigned int nand_calculate_ecc(const unsigned char *buf,
+				       unsigned int sector_size)
 {
-	unsigned short odd_result = 0, even_result = 0;
-	unsigned char bit_parities = 0;
-	int i;
-	unsigned char val;
-	unsigned char *byte_parities = malloc(sector_size);
-
-	if (!byte_parities)
-		return -ENOMEM;
-
-	for (i = 0; i < sector_size; i++)
-		bit_parities ^= buf[i];
-
-	even_result |= ((calc_bitwise_parity(bit_parities, EVEN_HALF) << 2) |
-			(calc_bitwise_parity(bit_parities, EVEN_FOURTH) << 1) |
-			(calc_bitwise_parity(bit_parities, EVEN_EIGHTH) << 0));
-
-	odd_result |= ((calc_bitwise_parity(bit_parities, ODD_HALF) << 2) |
-			(calc_bitwise_parity(bit_parities, ODD_FOURTH) << 1) |
-			(calc_bitwise_parity(bit_parities, ODD_EIGHTH) << 0));
-
-	for (i = 0; i < sector_size; i++)
-		byte_parities[i] = calc_bitwise_parity(buf[i], EVEN_WHOLE);
-
-	for (i = 0; i < LOG2(sector_size); i++) {
-		val = 0;
-		val = calc_row_parity_bits(byte_parities, 1, 1 << i, sector_size);
-		even_result |= (val << (3 + i));
-
-		val = calc_row_parity_bits(byte_parities, 0, 1 << i, sector_size);
-		odd_result |= (val << (3 + i));
+	unsigned int rowmask = (1U << LOG2(sector_size)) - 1;
+	unsigned int rows = 0, odd_rows, even_rows;
+	unsigned short odd_result, even_result;
+	unsigned char cp = 0;
+	unsigned int i;
+
+	for (i = 0; i < sector_size; i++) {
+		cp ^= buf[i];
+		rows ^= i & -(unsigned int)byte_parity[buf[i]];
 	}
 
-	free(byte_parities);
+	odd_rows = rows & rowmask;
+	even_rows = byte_parity[cp] ? odd_rows ^ rowmask : odd_rows;
+
+	even_result = (byte_parity[cp & 0x0f] << 2) |
+		      (byte_parity[cp & 0x33] << 1) |
+		      (byte_parity[cp & 0x55] << 0) |
+		      (even_rows << 3);
+	odd_result = (byte_parity[cp & 0xf0] << 2) |
+		     (byte_parity[cp & 0xcc] << 1) |
+		     (byte_parity[cp & 0xaa] << 0) |
+		     (odd_rows << 3);
 
 	return (odd_result << 16) | even_result;
 }
 
+static void fill_oob(unsigned char *oobbuf, size_t len, unsigned char *ecc)
+{
+	memset(oobbuf, 0xff, len);
+	memcpy(oobbuf + 2, ecc, 12);
+}
+
 static int write_ecc(int ofd, unsigned char *ecc, int start)
 {
 	struct mtd_oob_buf oob;
 	unsigned char oobbuf[64];
-	int i;
 
-	memset(oobbuf, 0xff, sizeof(oobbuf));
-
-	for (i = 0; i < 12; i++)
-		oobbuf[i + 2] = ecc[i];
+	fill_oob(oobbuf, sizeof(oobbuf), ecc);
 
 	oob.start = start;
 	oob.ptr = oobbuf;
@@ -148,38 +121,137 @@ static int write_ecc(int ofd, unsigned char *ecc, int start)
 	return ioctl(ofd, MEMWRITEOOB, &oob) != 0;
 }
 
-static void ecc_sector(unsigned char *sector, unsigned char *code,
+/*
+ * Write a page together with its OOB area. MEMWRITE programs both
+ * with a single ioctl, older kernels need a write() and a MEMWRITEOOB.
+ */
+static int write_page_ecc(int ofd, unsigned char *page, int len,
+			  unsigned char *ecc, int start, bool *memwrite)
+{
+#ifdef MEMWRITE
+	if (*memwrite) {
+		unsigned char oobbuf[64];
+		struct mtd_write_req req = {
+			.start = start,
+			.len = len,
+			.ooblen = sizeof(oobbuf),
+			.usr_data = (uintptr_t)page,
+			.usr_oob = (uintptr_t)oobbuf,
+			.mode = MTD_OPS_RAW,
+		};
+
+		fill_oob(oobbuf, sizeof(oobbuf), ecc);
+		if (ioctl(ofd, MEMWRITE, &req) == 0)
+			return 0;
+		if (errno != ENOTTY)
+			return -1;
+		*memwrite = false;
+	}
+#else
+	*memwrite = false;
+#endif
+	if (pwrite(ofd, page, len, start) != len)
+		return -1;
+
+	return write_ecc(ofd, ecc, start);
+}
+
+void flash_hamming1_ecc(const unsigned char *sector, unsigned char *code,
 			unsigned int sector_size)
 {
-	unsigned char *p;
-	int ecc = 0;
+	unsigned int ecc = nand_calculate_ecc(sector, sector_size);
 
-	ecc = nand_calculate_ecc(sector, sector_size);
+	code[0] = ecc & 0xff;
+	code[1] = (ecc >> 16) & 0xff;
+	code[2] = ((ecc >> 8) & 0xff) | ((ecc >> 24) << 4);
+}
+
+/*
+ * State of the copyfile() callback: the data is collected
+ * in a page, that is written with its ECC when full.
+ */
+struct hamming1_writer {
+	struct mtd_dev_info *mtd;
+	int ofd;
+	unsigned char *page;
+	int len;		/* bytes written for each page */
+	int fill;		/* data bytes in page */
+	int page_idx;
+	bool rawNand;
+	bool memwrite;
+};
+
+static int hamming1_write_page(struct hamming1_writer *w)
+{
+	struct mtd_dev_info *mtd = w->mtd;
+	unsigned char ecc[12];
+	int i;
 
-	p = (unsigned char *) &ecc;
+	/* Writes has to be page aligned */
+	if (w->fill < mtd->min_io_size)
+		memset(w->page + w->fill, 0xff, mtd->min_io_size - w->fill);
 
-	code[0] = p[0];
-	code[1] = p[2];
-	code[2] = p[1] | (p[3] << 4);
+	if (w->rawNand) {
+		for (i = 0; i < mtd->min_io_size / mtd->subpage_size; i++) {
+			/* Obtain ECC code for sector */
+			flash_hamming1_ecc(w->page + i * mtd->subpage_size,
+					   &ecc[i * 3], mtd->subpage_size);
+		}
+		if (write_page_ecc(w->ofd, w->page, w->len, ecc,
+				   w->page_idx * mtd->min_io_size, &w->memwrite)) {
+			ERROR("Error writing page and ECC: %s", strerror(errno));
+			return -EIO;
+		}
+	} else {
+		/* The OneNAND has a 2-plane memory but the ROM boot
+		 * can only access one of them, so we have to double
+		 * copy each 2K page. */
+		memcpy(w->page + mtd->min_io_size, w->page, mtd->min_io_size);
+		if (write(w->ofd, w->page, w->len) != w->len) {
+			ERROR("Error writing to output file: %s", strerror(errno));
+			return -EIO;
+		}
+	}
+
+	w->page_idx++;
+	w->fill = 0;
+
+	return 0;
+}
+
+static int hamming1_write_data(void *out, const void *buf, size_t len)
+{
+	struct hamming1_writer *w = (struct hamming1_writer *)out;
+	const unsigned char *data = buf;
+	size_t n;
+	int ret;
+
+	while (len) {
+		n = min(len, (size_t)(w->mtd->min_io_size - w->fill));
+		memcpy(w->page + w->fill, data, n);
+		w->fill += n;
+		data += n;
+		len -= n;
+		if (w->fill == w->mtd->min_io_size) {
+			ret = hamming1_write_page(w);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
 }
 
 static int flash_write_nand_hamming1(int mtdnum, struct img_type *img)
 {
 	struct flash_description *flash = get_flash_info();
-	struct mtd_dev_info *mtd = &flash->mtd_info[mtdnum].mtd;
-	int fd = img->fdin;
-	int ofd;
-	unsigned char *page;
-	unsigned char code[3];
-	unsigned char ecc[12];
-	int cnt = -1;
-	int i, j;
-	int len;
-	long long imglen = 0;
-	int page_idx = 0;
-	int ret = EXIT_FAILURE;
+	struct hamming1_writer w = {
+		.mtd = &flash->mtd_info[mtdnum].mtd,
+		.rawNand = isNand(flash, mtdnum),
+		.memwrite = true,
+	};
+	int ret = -1;
 	char mtd_device[LINESIZE];
-	bool rawNand = isNand(flash, mtdnum);
 
 	/*
 	 * if nothing to do, returns without errors
@@ -192,86 +264,63 @@ static int flash_write_nand_hamming1(int mtdnum, struct img_type *img)
 	/*
 	 * Get page size
 	 */
-	len = mtd->min_io_size;
-	if (!rawNand)
-		len *= 2;
-
-	imglen = img->size;
+	w.len = w.mtd->min_io_size;
+	if (!w.rawNand)
+		w.len *= 2;
 
-	page = (unsigned char *) malloc(len);
-	if (page == NULL) {
-		ERROR("Error opening input file");
+	w.page = (unsigned char *) malloc(w.len);
+	if (w.page == NULL) {
+		ERROR("No memory for a page of %d bytes", w.len);
 		goto out;
 	}
 
-	ofd = open(mtd_device, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG);
-	if (ofd < 0) {
+	w.ofd = open(mtd_device, O_CREAT | O_RDWR, S_IRWXU | S_IRWXG);
+	if (w.ofd < 0) {
 		ERROR("Error opening output file");
 		goto out_input;
 	}
 
-	if (rawNand)
+	if (w.rawNand)
 		/* The device has to be accessed in RAW mode to fill oob area */
-		if (ioctl(ofd, MTDFILEMODE, (void *) MTD_FILE_MODE_RAW)) {
+		if (ioctl(w.ofd, MTDFILEMODE, (void *) MTD_FILE_MODE_RAW)) {
 			ERROR("RAW mode access");
-			goto out_input;
-		}
-
-	while (imglen > 0) {
-		cnt = read(fd, page, min(mtd->min_io_size, imglen));
-		if (cnt < 0)
-			break;
-
-		/* Writes has to be page aligned */
-		if (cnt < mtd->min_io_size)
-			memset(page + cnt, 0xff, mtd->min_io_size - cnt);
-
-		if (rawNand)
-			for (i = 0; i < mtd->min_io_size / mtd->subpage_size; i++) {
-				/* Obtain ECC code for sector */
-				ecc_sector(page + i * mtd->subpage_size, code, mtd->subpage_size);
-				for (j = 0; j < 3; j++)
-					ecc[i * 3 + j] = code[j];
-			}
-		else
-			/* The OneNAND has a 2-plane memory but the ROM boot
-			 * can only access one of them, so we have to double
-			 * copy each 2K page. */
-			memcpy(page + mtd->min_io_size, page, mtd->min_io_size);
-
-		if (write(ofd, page, len) != len) {
-			perror("Error writing to output file");
 			goto out_output;
 		}
 
-		if (rawNand)
-			if (write_ecc(ofd, ecc, page_idx * mtd->min_io_size)) {
-				perror("Error writing ECC in OOB area");
-				goto out_output;
-			}
-		page_idx++;
-
-		imglen -= cnt;
-
-		/*
-		 * this handler does not use copyfile()
-		 * and must update itself the progress bar
-		 */
-		swupdate_progress_update((img->size - imglen) * 100 / img->size);
+	/*
+	 * The image goes through the copyfile() pipeline, so it can
+	 * be streamed, compressed or encrypted and its hash is verified.
+	 * As before, the image is always written from the start of the MTD.
+	 */
+	struct swupdate_copy copy = {
+		.fdin = img->fdin,
+		.out = &w,
+		.callback = hamming1_write_data,
+		.nbytes = img->size,
+		.offs = (unsigned long *)&img->offset,
+		.compressed = img->compressed,
+		.checksum = &img->checksum,
+		.hash = img->sha256,
+		.encrypted = img->is_encrypted,
+		.imgivt = img->ivt_ascii,
+		.inbuf = swu_map_image_data(img),
+	};
+	if (copyfile(&copy) < 0) {
+		ERROR("Error copying %s", img->fname);
+		goto out_output;
 	}
 
-	if (cnt < 0) {
-		ERROR("File I/O error on input file");
+	/* pad and write the last page */
+	if (w.fill && hamming1_write_page(&w))
 		goto out_output;
-	}
 
 	TRACE("Successfully written %s to mtd %d", img->fname, mtdnum);
-	ret = EXIT_SUCCESS;
+	ret = 0;
 
 out_output:
-	close(ofd);
+	close(w.ofd);
 out_input:
-	free(page);
+	free(w.page);
 out:
 	return ret;
 }
@@ -310,6 +359,8 @@ static int install_flash_hamming_image(struct img_type *img,
 __attribute__((constructor))
 void flash_1bit_hamming_handler(void)
 {
-	register_handler("flash-hamming1", install_flash_hamming_image,
-				IMAGE_HANDLER | FILE_HANDLER,  (void *)1);
+	/* the writer keeps its state on the stack, MTDs can be written concurrently */
+	if (!register_handler("flash-hamming1", install_flash_hamming_image,
+				IMAGE_HANDLER | FILE_HANDLER,  (void *)1))
+		(void)register_handler_thread_safe("flash-hamming1");
 }
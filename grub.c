@@ -5,60 +5,64 @@
  * SPDX-License-Identifier:     GPL-2.0-only
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "bootloader.h"
+#include "bootloader_txn.h"
 #include "grub.h"
 
+/*
+ * The environment is kept in RAM between calls and only written back
+ * when the outermost transaction is committed. The cache is dropped
+ * if the file changed on disk outside a transaction.
+ */
+static struct grubenv_t cached_env;
+static struct {
+	bool loaded;
+	bool dirty;
+	unsigned int depth;
+	struct stat st;
+} grubenv_cache;
+
+static bool grubenv_stat_changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev != b->st_dev || a->st_ino != b->st_ino ||
+		a->st_size != b->st_size ||
+		a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+		a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
 
 /* read environment from storage into RAM */
-static int grubenv_open(struct grubenv_t *grubenv)
+static int grubenv_open(struct grubenv_t *grubenv, struct stat *st)
 {
-	FILE *fp = NULL;
-	size_t size;
-	int ret = 0;
-	char *buf = NULL, *key = NULL, *value = NULL;
+	char buf[GRUBENV_SIZE];
+	char *entry, *eq, *eol, *end;
+	int fd, ret = 0;
+	ssize_t n;
 
-	fp = fopen(GRUBENV_PATH, "rb");
-	if (!fp) {
+	fd = open(GRUBENV_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		ERROR("Failed to open grubenv file: %s", GRUBENV_PATH);
-		ret = -1;
-		goto cleanup;
-	}
-
-	if (fseek(fp, 0, SEEK_END)) {
-		ERROR("Failed to seek end grubenv file: %s", GRUBENV_PATH);
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 
-	size = (size_t)ftell(fp);
-
-	if (size != GRUBENV_SIZE) {
-		ERROR("Invalid grubenv file size: %d", (int)size);
+	if (fstat(fd, st)) {
+		ERROR("Failed to stat grubenv file: %s", GRUBENV_PATH);
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (fseek(fp, 0, SEEK_SET)) {
-		ERROR("Failed to seek set grubenv file: %s", GRUBENV_PATH);
+	if (st->st_size != GRUBENV_SIZE) {
+		ERROR("Invalid grubenv file size: %d", (int)st->st_size);
 		ret = -1;
 		goto cleanup;
 	}
 
-	/* grubenv is a block of 'size' bytes not null-terminated, and this is a
-	 * problem when using strtok, which is expecting a null-terminated
-	 * string. Allocate an extra byte to terminate the buffer or strtok will
-	 * overrun it and use calloc() to get a cleared buffer.
-	 * . */
-	buf = calloc(1, size + 1);
-	if (!buf) {
-		ERROR("Not enough memory for environment");
-		ret = -ENOMEM;
-		goto cleanup;
-	}
-
-	if (fread(buf, 1, size, fp) != size) {
+	n = read(fd, buf, GRUBENV_SIZE);
+	if (n != GRUBENV_SIZE) {
 		ERROR("Failed to read file %s", GRUBENV_PATH);
-		ret = 1;
+		ret = -1;
 		goto cleanup;
 	}
 
@@ -68,45 +72,34 @@ static int grubenv_open(struct grubenv_t *grubenv)
 		goto cleanup;
 	}
 
-	/* load key - value pairs from buffer into dictionary list */
-	/* Following approach fails if grubenv block contains empty variable,
-	 * such as `var=`. GRUB env tool allows this situation to happen so it
-	 * should probably be reconsidered. dict_set_value seems to cannot
-	 * assign NULL to a variable, which complicates things a little bit?
+	/*
+	 * Load key - value pairs from buffer into dictionary list.
+	 * Lines are "key=value\n", comments and the '#' padding are
+	 * skipped. Variables without a value (`var=`) are still skipped,
+	 * dict_set_value cannot store them.
 	 */
-	char *entry = buf;
-	char *p_char = buf;
-	while(*p_char != '\0') {
-		if (*p_char != '\n') {
-			p_char++;
+	end = buf + GRUBENV_SIZE;
+	for (entry = buf; entry < end; entry = eol + 1) {
+		eol = memchr(entry, '\n', end - entry);
+		if (!eol)
+			break;
+		if (*entry == '#')
 			continue;
-		}
-
-		/* ignore comments */
-		if (*entry == '#') {
-			entry = p_char + 1;
-			p_char++;
+		eq = memchr(entry, '=', eol - entry);
+		if (!eq || eq == entry || eq + 1 == eol)
 			continue;
+		*eq = '\0';
+		*eol = '\0';
+		ret = dict_set_value(&grubenv->vars, entry, eq + 1);
+		if (ret) {
+			ERROR("Adding pair [%s] = %s into dictionary list"
+				"failed\n", entry, eq + 1);
+			goto cleanup;
 		}
-
-		key = strtok(entry, "=");
-		value = strtok(NULL, "\n");
-		if (value != NULL && key != NULL) {
-			ret = dict_set_value(&grubenv->vars, key, value);
-			if (ret) {
-				ERROR("Adding pair [%s] = %s into dictionary list"
-					"failed\n", key, value);
-				return ret;
-			}
-		}
-		entry = p_char + 1;
-		p_char++;
 	}
 
 cleanup:
-	if (fp) fclose(fp);
-	/* free(null) should not harm anything */
-	free(buf);
+	close(fd);
 	return ret;
 }
 
@@ -153,204 +146,284 @@ cleanup:
 	return ret;
 }
 
-/* I'm not sure about size member of grubenv_t struct
- * It seems to me that it is enough if we check size of env stored in dict list
- * only once, just before writing into grubenv file.
- */
-static inline void grubenv_update_size(struct grubenv_t *grubenv)
+static int write_all(int fd, const char *buf, size_t len)
 {
-	/* size in bytes of grubenv-formatted string */
-	int size = 0;
-	struct dict_entry *grubvar;
-
-	/* lengths of strings + '=' and '\n' characters */
-	LIST_FOREACH(grubvar, &grubenv->vars, next) {
-		char *key = dict_entry_get_key(grubvar);
-		char *value = dict_entry_get_value(grubvar);
-
-		size = size + strlen(key) + strlen(value) + 2;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
 	}
-	size += strlen(GRUBENV_HEADER);
-	grubenv->size = size;
+	return 0;
 }
 
-static int grubenv_write(struct grubenv_t *grubenv)
+/* make the rename of grubenv.new durable */
+static int grubenv_sync_dir(void)
 {
-	FILE *fp = NULL;
-	char *buf = NULL, *ptr;
-	struct dict_entry *grubvar;
-	int ret = 0, llen = 0;
-
-	grubenv_update_size(grubenv);
-	if (grubenv->size > GRUBENV_SIZE) {
-		ERROR("Not enough free space in envblk file, %ld",
-			grubenv->size);
-		ret = -1;
-		goto cleanup;
-	}
-
-	fp = fopen(GRUBENV_PATH_NEW, "wb");
-	if (!fp) {
-		ERROR("Failed to open file: %s", GRUBENV_PATH_NEW);
-		ret = -1;
-		goto cleanup;
-	}
+	char dir[] = GRUBENV_PATH;
+	char *slash = strrchr(dir, '/');
+	int fd, ret;
+
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
 
-	buf = malloc(GRUBENV_SIZE);
-	if (!buf) {
-		ERROR("Not enough memory for environment");
-		ret = -ENOMEM;
-		goto cleanup;
-	}
+static int grubenv_write(struct grubenv_t *grubenv, struct stat *st)
+{
+	char buf[GRUBENV_SIZE];
+	struct dict_entry *grubvar;
+	size_t hlen = strlen(GRUBENV_HEADER);
+	size_t klen, vlen, pos;
+	int fd;
 
 	/* form grubenv-formatted block inside memory */
-	/* +1 for null termination */
-	strncpy(buf, GRUBENV_HEADER, strlen(GRUBENV_HEADER) + 1);
+	memcpy(buf, GRUBENV_HEADER, hlen);
+	pos = hlen;
 
 	LIST_FOREACH(grubvar, &grubenv->vars, next) {
 		char *key = dict_entry_get_key(grubvar);
 		char *value = dict_entry_get_value(grubvar);
-		char *tmp;
 
-		llen = strlen(key) + strlen(value) + 2;
-		/* +1 for null termination */
-		ret = asprintf(&tmp, "%s=%s\n", key, value);
-		if (ret == ENOMEM_ASPRINTF) {
-			ERROR("OOM when copying Grub Env");
-			goto cleanup;
+		klen = strlen(key);
+		vlen = strlen(value);
+		/* key '=' value '\n' */
+		if (klen + vlen + 2 > GRUBENV_SIZE - pos) {
+			ERROR("Not enough free space in envblk file");
+			return -1;
 		}
-		strncat(buf, tmp, llen);
-		free(tmp);
+		memcpy(buf + pos, key, klen);
+		pos += klen;
+		buf[pos++] = '=';
+		memcpy(buf + pos, value, vlen);
+		pos += vlen;
+		buf[pos++] = '\n';
 	}
+	grubenv->size = pos;
 
-	/* # chars starts there */
-	ptr = buf + grubenv->size;
+	/* fill with '#' up to the end of block */
+	memset(buf + pos, '#', GRUBENV_SIZE - pos);
 
-	/* fill with '#' from current ptr position up to the end of block */
-	memset(ptr, '#', buf + GRUBENV_SIZE - ptr);
+	fd = open(GRUBENV_PATH_NEW, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		ERROR("Failed to open file: %s", GRUBENV_PATH_NEW);
+		return -1;
+	}
 
-	/* write buffer into grubenv.nev file */
-	ret = fwrite(buf , 1, GRUBENV_SIZE, fp);
-	if (ret != GRUBENV_SIZE) {
-		ERROR("Failed to write file: %s. Bytes written: %d",
-			GRUBENV_PATH_NEW, ret);
-		ret = -1;
-		goto cleanup;
+	/* write buffer into grubenv.new and make sure it reached the disk */
+	if (write_all(fd, buf, GRUBENV_SIZE) || fsync(fd)) {
+		ERROR("Failed to write file: %s: %s", GRUBENV_PATH_NEW,
+			strerror(errno));
+		close(fd);
+		unlink(GRUBENV_PATH_NEW);
+		return -1;
 	}
+	/* an unknown stat only forces a reload on the next access */
+	if (fstat(fd, st))
+		memset(st, 0, sizeof(*st));
+	close(fd);
 
 	/* rename grubenv.new into grubenv */
 	if (rename(GRUBENV_PATH_NEW, GRUBENV_PATH)) {
 		ERROR("Failed to move environment: %s into %s",
 			GRUBENV_PATH_NEW, GRUBENV_PATH);
-		ret = -1;
-		goto cleanup;
+		unlink(GRUBENV_PATH_NEW);
+		return -1;
 	}
 
-	ret = 0;
+	if (grubenv_sync_dir())
+		WARN("Failed to sync directory of %s", GRUBENV_PATH);
 
-cleanup:
-	if (fp) fclose(fp);
-	/* free(null) should not harm anything */
-	free(buf);
-	return ret;
+	return 0;
 }
 
-/* I'm not sure what would be the proper method to free memory from dict list
- * allocation */
 static inline void grubenv_close(struct grubenv_t *grubenv)
 {
 	dict_drop_db(&grubenv->vars);
 }
 
+static void grubenv_drop_cache(void)
+{
+	grubenv_close(&cached_env);
+	grubenv_cache.loaded = false;
+	grubenv_cache.dirty = false;
+}
+
+/*
+ * Make sure the cached environment is current. Inside a transaction
+ * the cache is authoritative and is not reloaded.
+ */
+static int grubenv_load(void)
+{
+	struct stat st;
+	int ret;
+
+	if (grubenv_cache.loaded) {
+		if (grubenv_cache.depth)
+			return 0;
+		if (!stat(GRUBENV_PATH, &st) &&
+		    !grubenv_stat_changed(&st, &grubenv_cache.st))
+			return 0;
+	}
+
+	grubenv_drop_cache();
+	ret = grubenv_open(&cached_env, &grubenv_cache.st);
+	if (ret) {
+		grubenv_close(&cached_env);
+		return ret;
+	}
+	grubenv_cache.loaded = true;
+
+	return 0;
+}
+
+/*
+ * Transactions nest: changes are collected in RAM and written with a
+ * single durable write when the outermost one is committed.
+ */
+static void grubenv_begin(void)
+{
+	grubenv_cache.depth++;
+}
+
+static int grubenv_commit(void)
+{
+	int ret = 0;
+
+	if (!grubenv_cache.depth)
+		return -EINVAL;
+	if (--grubenv_cache.depth)
+		return 0;
+
+	if (grubenv_cache.dirty) {
+		ret = grubenv_write(&cached_env, &grubenv_cache.st);
+		grubenv_cache.dirty = false;
+		/* force a reload, the file is in an unknown state */
+		if (ret)
+			grubenv_drop_cache();
+	}
+
+	return ret;
+}
+
+/* drop changes of the outermost transaction */
+static void grubenv_abort(void)
+{
+	if (grubenv_cache.depth && !--grubenv_cache.depth &&
+	    grubenv_cache.dirty)
+		grubenv_drop_cache();
+}
+
 /* I feel that '#' and '=' characters should be forbidden. Although it's not
  * explicitly mentioned in original grub env code, they may cause unexpected
  * behavior */
 static int do_env_set(const char *name, const char *value)
 {
-	static struct grubenv_t grubenv;
 	int ret;
 
-	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
+	grubenv_begin();
+	if ((ret = grubenv_load()))
 		goto cleanup;
 
 	/* set new variable or change value of existing one */
-	if ((ret = dict_set_value(&grubenv.vars, (char *)name, (char *)value)))
+	if ((ret = dict_set_value(&cached_env.vars, (char *)name, (char *)value)))
 		goto cleanup;
+	grubenv_cache.dirty = true;
 
-	/* form grubenv format out of dictionary list and save it to file */
-	if ((ret = grubenv_write(&grubenv)))
-		goto cleanup;
+	return grubenv_commit();
 
 cleanup:
-	grubenv_close(&grubenv);
+	grubenv_abort();
 	return ret;
 }
 
 static int do_env_unset(const char *name)
 {
-	static struct grubenv_t grubenv;
-	int ret = 0;
+	int ret;
 
-	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
-		goto cleanup;
+	grubenv_begin();
+	if ((ret = grubenv_load())) {
+		grubenv_abort();
+		return ret;
+	}
 
 	/* remove entry from dictionary list */
-	dict_remove(&grubenv.vars, (char *)name);
-
-	/* form grubenv format out of dictionary list and save it to file */
-	if ((ret = grubenv_write(&grubenv)))
-		goto cleanup;
+	if (dict_get_value(&cached_env.vars, (char *)name)) {
+		dict_remove(&cached_env.vars, (char *)name);
+		grubenv_cache.dirty = true;
+	}
 
-cleanup:
-	grubenv_close(&grubenv);
-	return ret;
+	return grubenv_commit();
 }
 
 static char *do_env_get(const char *name)
 {
-	static struct grubenv_t grubenv;
-	char *value = NULL, *var;
-	int ret = 0;
+	char *var;
 
-	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
-		goto cleanup;
+	if (grubenv_load())
+		return NULL;
 
 	/* retrieve value of given variable from dictionary list */
-	var = dict_get_value(&grubenv.vars, (char *)name);
-
-	if (var)
-		value = strdup(var);
-cleanup:
-	grubenv_close(&grubenv);
-	return value;
+	var = dict_get_value(&cached_env.vars, (char *)name);
 
+	return var ? strdup(var) : NULL;
 }
 
 static int do_apply_list(const char *script)
 {
-	static struct grubenv_t grubenv;
-	int ret = 0;
+	int ret;
 
-	/* read env into dictionary list in RAM */
-	if ((ret = grubenv_open(&grubenv)))
+	grubenv_begin();
+	if ((ret = grubenv_load()))
 		goto cleanup;
 
 	/* add variables from sw-description into dictionary list */
-	if ((ret = grubenv_parse_script(&grubenv, script)))
+	grubenv_cache.dirty = true;
+	if ((ret = grubenv_parse_script(&cached_env, script)))
 		goto cleanup;
 
-	/* form grubenv format out of dictionary list and save it to file */
-	if ((ret = grubenv_write(&grubenv)))
-		goto cleanup;
+	/* one write for the whole list */
+	return grubenv_commit();
 
 cleanup:
-	grubenv_close(&grubenv);
+	grubenv_abort();
 	return ret;
 }
 
+static int do_env_begin(void)
+{
+	grubenv_begin();
+	return 0;
+}
+
+static int do_env_commit(void)
+{
+	return grubenv_commit();
+}
+
+static int do_env_abort(void)
+{
+	grubenv_abort();
+	return 0;
+}
+
 static bootloader grub = {
 	.env_get = &do_env_get,
 	.env_set = &do_env_set,
@@ -358,8 +431,15 @@ static bootloader grub = {
 	.apply_list = &do_apply_list
 };
 
+static bootloader_txn grub_txn = {
+	.begin = &do_env_begin,
+	.commit = &do_env_commit,
+	.abort = &do_env_abort
+};
+
 __attribute__((constructor))
 static void grub_probe(void)
 {
-	(void)register_bootloader(BOOTLOADER_GRUB, &grub);
+	if (!register_bootloader(BOOTLOADER_GRUB, &grub))
+		(void)register_bootloader_txn(BOOTLOADER_GRUB, &grub_txn);
 }
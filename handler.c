@@ -15,9 +15,11 @@
 #include "handler.h"
 #include "lua_util.h"
 #include "util.h"
+#include "handler_parallel.h"
 
 #define MAX_INSTALLER_HANDLER	64
 struct installer_handler supported_types[MAX_INSTALLER_HANDLER];
+static bool thread_safe[MAX_INSTALLER_HANDLER];
 static unsigned long nr_installers = 0;
 static unsigned long handler_index = ULONG_MAX;
 
@@ -44,6 +46,7 @@ static int __register_handler(const char *desc,
 	supported_types[nr_installers].data = data;
 	supported_types[nr_installers].mask = mask;
 	supported_types[nr_installers].noglobal = (lifetime == SESSION_HANDLER);
+	thread_safe[nr_installers] = false;
 	nr_installers++;
 
 	return 0;
@@ -81,12 +84,39 @@ int unregister_handler(const char *desc)
 		supported_types[j - 1].installer = supported_types[j].installer;
 		supported_types[j - 1].data = supported_types[j].data;
 		supported_types[j - 1].mask = supported_types[j].mask;
+		supported_types[j - 1].noglobal = supported_types[j].noglobal;
+		thread_safe[j - 1] = thread_safe[j];
 	}
 	nr_installers--;
 
 	return 0;
 }
 
+int register_handler_thread_safe(const char *desc)
+{
+	int i;
+
+	for (i = 0; i < nr_installers; i++) {
+		if (IS_STR_EQUAL(desc, supported_types[i].desc))
+			break;
+	}
+
+	/* session handlers come from Lua and share its state */
+	if (i == nr_installers || supported_types[i].noglobal)
+		return -1;
+	thread_safe[i] = true;
+
+	return 0;
+}
+
+bool handler_is_thread_safe(struct installer_handler *hnd)
+{
+	if (!hnd || hnd->noglobal)
+		return false;
+
+	return thread_safe[hnd - supported_types];
+}
+
 void unregister_session_handlers(void)
 {
 	int i;
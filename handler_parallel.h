@@ -0,0 +1,23 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _HANDLER_PARALLEL_H
+#define _HANDLER_PARALLEL_H
+
+#include <stdbool.h>
+
+struct installer_handler;
+
+/*
+ * A handler registered as thread-safe can run concurrently with
+ * itself and with other handlers: only images using such handlers
+ * may set "install-parallel". Lua handlers share one Lua state and
+ * are never thread-safe.
+ */
+int register_handler_thread_safe(const char *desc);
+bool handler_is_thread_safe(struct installer_handler *hnd);
+
+#endif
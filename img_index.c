@@ -0,0 +1,119 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsdqueue.h"
+#include "util.h"
+#include "img_index.h"
+
+/* FNV-1a */
+static unsigned int fname_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+struct img_index *img_index_build(struct imglist *list)
+{
+	struct img_index *index;
+	struct img_type *img;
+	unsigned int count = 0, n, bucket;
+	int *tail;
+
+	LIST_FOREACH(img, list, next)
+		count++;
+
+	index = (struct img_index *)calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+
+	/* keep the load factor below 0.5 */
+	for (index->nbuckets = 16; index->nbuckets < count * 2; index->nbuckets <<= 1)
+		;
+
+	index->buckets = (int *)malloc(index->nbuckets * sizeof(*index->buckets));
+	tail = (int *)malloc(index->nbuckets * sizeof(*tail));
+	index->entries = (struct img_index_entry *)calloc(count ? count : 1,
+							  sizeof(*index->entries));
+	if (!index->buckets || !tail || !index->entries) {
+		free(tail);
+		img_index_free(index);
+		return NULL;
+	}
+
+	for (n = 0; n < index->nbuckets; n++) {
+		index->buckets[n] = -1;
+		tail[n] = -1;
+	}
+
+	/*
+	 * Append to the tail of the bucket so that images
+	 * with the same filename are found in list order
+	 */
+	n = 0;
+	LIST_FOREACH(img, list, next) {
+		index->entries[n].img = img;
+		index->entries[n].hash = fname_hash(img->fname);
+		index->entries[n].next = -1;
+		bucket = index->entries[n].hash & (index->nbuckets - 1);
+		if (tail[bucket] < 0)
+			index->buckets[bucket] = n;
+		else
+			index->entries[tail[bucket]].next = n;
+		tail[bucket] = n;
+		n++;
+	}
+	index->nentries = n;
+	free(tail);
+
+	return index;
+}
+
+void img_index_free(struct img_index *index)
+{
+	if (!index)
+		return;
+	free(index->buckets);
+	free(index->entries);
+	free(index);
+}
+
+static struct img_index_entry *img_index_match(struct img_index *index, int pos,
+					       unsigned int hash, const char *fname)
+{
+	struct img_index_entry *entry;
+
+	while (pos >= 0) {
+		entry = &index->entries[pos];
+		if (entry->hash == hash && !strcmp(entry->img->fname, fname))
+			return entry;
+		pos = entry->next;
+	}
+
+	return NULL;
+}
+
+struct img_index_entry *img_index_find(struct img_index *index, const char *fname)
+{
+	unsigned int hash = fname_hash(fname);
+
+	return img_index_match(index, index->buckets[hash & (index->nbuckets - 1)],
+			       hash, fname);
+}
+
+struct img_index_entry *img_index_next(struct img_index *index,
+				       struct img_index_entry *entry)
+{
+	return img_index_match(index, entry->next, entry->hash, entry->img->fname);
+}
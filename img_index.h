@@ -0,0 +1,43 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _IMG_INDEX_H
+#define _IMG_INDEX_H
+
+#include "swupdate_image.h"
+#include "cpiohdr.h"
+#include "installer.h"
+
+/*
+ * Hash index filename -> images of a list, built once
+ * after the sw-description is parsed. Images sharing the
+ * same filename are kept in the order of the list.
+ */
+struct img_index_entry {
+	struct img_type *img;
+	unsigned int hash;
+	int next;		/* next entry in the bucket, -1 at the end */
+};
+
+struct img_index {
+	unsigned int nbuckets;
+	unsigned int nentries;
+	int *buckets;
+	struct img_index_entry *entries;
+};
+
+struct img_index *img_index_build(struct imglist *list);
+void img_index_free(struct img_index *index);
+struct img_index_entry *img_index_find(struct img_index *index, const char *fname);
+struct img_index_entry *img_index_next(struct img_index *index,
+				       struct img_index_entry *entry);
+
+swupdate_file_t check_if_required_indexed(struct img_index *index,
+					  struct filehdr *pfdh,
+					  const char *destdir,
+					  struct img_type **pimg);
+
+#endif
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <pthread.h>
 
 #include "generated/autoconf.h"
 #include "bsdqueue.h"
@@ -27,6 +28,7 @@
 #include "swupdate.h"
 #include "installer.h"
 #include "handler.h"
+#include "handler_parallel.h"
 #include "cpiohdr.h"
 #include "parsers.h"
 #include "bootloader.h"
@@ -34,6 +36,55 @@
 #include "pctl.h"
 #include "swupdate_vars.h"
 #include "lua_util.h"
+#include "img_index.h"
+#include "swu_map.h"
+#include "arena.h"
+#include "swver_index.h"
+
+/*
+ * Check a single image matching the file in the cpio header,
+ * it returns the result for check_if_required()
+ */
+static swupdate_file_t check_image(struct img_type *img, struct filehdr *pfdh,
+				   const char *destdir, int *install_direct,
+				   struct img_type **pimg)
+{
+	swupdate_file_t skip = COPY_FILE;
+
+	img->provided = 1;
+	if (img->size && img->size != (unsigned int)pfdh->size) {
+		ERROR("Size in sw-description %llu does not match size in cpio %u",
+			img->size, (unsigned int)pfdh->size);
+		return -EINVAL;
+
+	}
+	img->size = (unsigned int)pfdh->size;
+
+	if (snprintf(img->extract_file,
+		     sizeof(img->extract_file), "%s%s",
+		     destdir, pfdh->filename) >= (int)sizeof(img->extract_file)) {
+		ERROR("Path too long: %s%s", destdir, pfdh->filename);
+		return -EBADF;
+	}
+	/*
+	 *  Streaming is possible to only one handler
+	 *  If more img requires the same file,
+	 *  sw-description contains an error
+	 */
+	if (*install_direct) {
+		ERROR("sw-description: stream to several handlers unsupported");
+		return -EINVAL;
+	}
+
+	if (img->install_directly) {
+		skip = INSTALL_FROM_STREAM;
+		(*install_direct)++;
+	}
+
+	*pimg = img;
+
+	return skip;
+}
 
 /*
  * function returns:
@@ -56,39 +107,35 @@ swupdate_file_t check_if_required(struct imglist *list, struct filehdr *pfdh,
 
 	LIST_FOREACH(img, list, next) {
 		if (strcmp(pfdh->filename, img->fname) == 0) {
-			skip = COPY_FILE;
-			img->provided = 1;
-			if (img->size && img->size != (unsigned int)pfdh->size) {
-				ERROR("Size in sw-description %llu does not match size in cpio %u",
-					img->size, (unsigned int)pfdh->size);
-				return -EINVAL;
-
-			}
-			img->size = (unsigned int)pfdh->size;
+			skip = check_image(img, pfdh, destdir, &install_direct,
+					   pimg);
+			if (skip != COPY_FILE && skip != INSTALL_FROM_STREAM)
+				return skip;
+		}
+	}
 
-			if (snprintf(img->extract_file,
-				     sizeof(img->extract_file), "%s%s",
-				     destdir, pfdh->filename) >= (int)sizeof(img->extract_file)) {
-				ERROR("Path too long: %s%s", destdir, pfdh->filename);
-				return -EBADF;
-			}
-			/*
-			 *  Streaming is possible to only one handler
-			 *  If more img requires the same file,
-			 *  sw-description contains an error
-			 */
-			if (install_direct) {
-				ERROR("sw-description: stream to several handlers unsupported");
-				return -EINVAL;
-			}
+	return skip;
+}
 
-			if (img->install_directly) {
-				skip = INSTALL_FROM_STREAM;
-				install_direct++;
-			}
+/*
+ * Same as check_if_required(), but the images are
+ * looked up in the index instead of scanning the list
+ */
+swupdate_file_t check_if_required_indexed(struct img_index *index,
+					  struct filehdr *pfdh,
+					  const char *destdir,
+					  struct img_type **pimg)
+{
+	swupdate_file_t skip = SKIP_FILE;
+	struct img_index_entry *entry;
+	int install_direct = 0;
 
-			*pimg = img;
-		}
+	for (entry = img_index_find(index, pfdh->filename); entry;
+	     entry = img_index_next(index, entry)) {
+		skip = check_image(entry->img, pfdh, destdir, &install_direct,
+				   pimg);
+		if (skip != COPY_FILE && skip != INSTALL_FROM_STREAM)
+			return skip;
 	}
 
 	return skip;
@@ -312,19 +359,17 @@ static int update_installed_image_version(struct swver *sw_ver_list,
 		struct img_type *img)
 {
 	struct sw_version *swver;
-	struct sw_version *swcomp;
 
 	if (!sw_ver_list)
 		return false;
 
-	LIST_FOREACH(swver, sw_ver_list, next) {
-		/*
-		 * If component is already installed, update the version
-		 */
-		if (!strncmp(img->id.name, swver->name, sizeof(img->id.name))) {
-			strncpy(swver->version, img->id.version, sizeof(img->id.version));
-			return true;
-		}
+	/*
+	 * If component is already installed, update the version
+	 */
+	swver = swver_find(sw_ver_list, img->id.name);
+	if (swver) {
+		swver_set_version(swver, img->id.version);
+		return true;
 	}
 
 	if (!strlen(img->id.version))
@@ -333,19 +378,276 @@ static int update_installed_image_version(struct swver *sw_ver_list,
 	/*
 	 * No previous version of this component is installed. Create a new entry.
 	 */
-	swcomp = (struct sw_version *)calloc(1, sizeof(struct sw_version));
-	if (!swcomp) {
+	if (!swver_add(sw_ver_list, img->id.name, img->id.version)) {
 		ERROR("Could not create new version entry.");
 		return false;
 	}
 
-	strlcpy(swcomp->name, img->id.name, sizeof(swcomp->name));
-	strlcpy(swcomp->version, img->id.version, sizeof(swcomp->version));
-	LIST_INSERT_HEAD(sw_ver_list, swcomp, next);
+	return true;
+}
+
+/*
+ * Images can be installed concurrently if they are flagged in
+ * sw-description with the property "install-parallel" = "true"
+ * and their handler is registered as thread-safe.
+ * Adjacent flagged images build a group that is run on a pool of
+ * workers, images without the flag are barriers and are still
+ * installed in the order they are listed. Inside a group, images
+ * writing to the same target are serialized and an image waits for
+ * the images listed in its "install-after" property.
+ */
+#define INSTALL_MAX_WORKERS	4
+
+struct install_job {
+	struct img_type *img;
+	bool running;
+	bool done;
+	int ret;
+};
+
+struct install_sched {
+	struct install_job *jobs;
+	unsigned int njobs;
+	unsigned int finished;
+	unsigned int running;
+	bool dry_run;
+	int ret;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static bool install_in_parallel(struct img_type *img)
+{
+	char *value = dict_get_value(&img->properties, "install-parallel");
+
+	return value && !strcmp(value, "true");
+}
+
+/*
+ * The flag is rejected for handlers that are not thread-safe
+ * instead of silently installing the image sequentially.
+ */
+static int check_parallel_images(struct imglist *list)
+{
+	struct img_type *img;
+
+	LIST_FOREACH(img, list, next) {
+		if (!install_in_parallel(img))
+			continue;
+		if (!handler_is_thread_safe(find_handler(img))) {
+			ERROR("%s: handler %s is not thread-safe, "
+			      "install-parallel is not allowed",
+			      img->fname, img->type);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static const char *install_target(struct img_type *img)
+{
+	if (strlen(img->device))
+		return img->device;
+	if (strlen(img->volname))
+		return img->volname;
+	return img->path;
+}
+
+static int install_sched_add(struct install_sched *s, struct img_type *img)
+{
+	struct install_job *jobs;
+
+	jobs = realloc(s->jobs, (s->njobs + 1) * sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+	s->jobs = jobs;
+	memset(&jobs[s->njobs], 0, sizeof(*jobs));
+	jobs[s->njobs++].img = img;
+
+	return 0;
+}
+
+static bool install_job_ready(struct install_sched *s, unsigned int n)
+{
+	struct install_job *job = &s->jobs[n];
+	const char *target = install_target(job->img);
+	struct dict_list *deps;
+	struct dict_list_elem *dep;
+	unsigned int i;
+
+	for (i = 0; i < s->njobs; i++) {
+		if (i == n || s->jobs[i].done)
+			continue;
+		if (i < n && strlen(target) &&
+		    !strcmp(target, install_target(s->jobs[i].img)))
+			return false;
+	}
+
+	deps = dict_get_list(&job->img->properties, "install-after");
+	if (!deps)
+		return true;
+
+	LIST_FOREACH(dep, deps, next) {
+		for (i = 0; i < s->njobs; i++) {
+			if (i != n && !s->jobs[i].done &&
+			    !strcmp(dep->value, s->jobs[i].img->fname))
+				return false;
+		}
+	}
 
 	return true;
 }
 
+static void *install_worker(void *data)
+{
+	struct install_sched *s = (struct install_sched *)data;
+	struct install_job *job;
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->ret && s->finished < s->njobs) {
+		job = NULL;
+		for (i = 0; i < s->njobs; i++) {
+			if (!s->jobs[i].running && !s->jobs[i].done &&
+			    install_job_ready(s, i)) {
+				job = &s->jobs[i];
+				break;
+			}
+		}
+
+		if (!job) {
+			if (!s->running) {
+				ERROR("Images in parallel group depend on each other, cannot install");
+				s->ret = -EINVAL;
+				pthread_cond_broadcast(&s->cond);
+				break;
+			}
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+
+		job->running = true;
+		s->running++;
+		pthread_mutex_unlock(&s->lock);
+
+		ret = install_single_image(job->img, s->dry_run);
+
+		pthread_mutex_lock(&s->lock);
+		job->running = false;
+		job->done = true;
+		job->ret = ret;
+		s->running--;
+		s->finished++;
+		if (ret && !s->ret)
+			s->ret = ret;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/*
+ * Install all images queued in the scheduler, the calling thread
+ * is one of the workers. The queue is empty after return.
+ */
+static int install_sched_run(struct install_sched *s, struct swupdate_cfg *sw)
+{
+	pthread_t workers[INSTALL_MAX_WORKERS - 1];
+	unsigned int nthreads = min(s->njobs, (unsigned int)INSTALL_MAX_WORKERS);
+	unsigned int nworkers = 0, i;
+	int ret;
+
+	if (!s->njobs)
+		return 0;
+
+	s->finished = 0;
+	s->running = 0;
+	s->ret = 0;
+
+	if (s->njobs > 1)
+		TRACE("Installing %u images in parallel", s->njobs);
+
+	for (i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&workers[nworkers], NULL, install_worker, s)) {
+			WARN("Cannot start install worker, continue with %u",
+			     nworkers + 1);
+			break;
+		}
+		nworkers++;
+	}
+
+	install_worker(s);
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	/* Versions are updated in the order of sw-description */
+	for (i = 0; i < s->njobs; i++) {
+		close(s->jobs[i].img->fdin);
+		if (s->jobs[i].done && !s->jobs[i].ret)
+			update_installed_image_version(&sw->installed_sw_list,
+						       s->jobs[i].img);
+	}
+
+	ret = s->ret;
+	s->njobs = 0;
+
+	return ret;
+}
+
+static void install_sched_free(struct install_sched *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->njobs; i++)
+		close(s->jobs[i].img->fdin);
+	free(s->jobs);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->cond);
+}
+
+/*
+ * Open the image to be installed: it is read from the mapped SWU
+ * if it was not copied into TMPDIR
+ */
+static int open_image(struct img_type *img)
+{
+	const char* TMPDIR = get_tmpdir();
+	char *filename;
+	struct stat buf;
+
+	if (swu_map_image_data(img)) {
+		img->fdin = swu_map_image_fd(img);
+		img->offset = 0;
+		return img->fdin < 0 ? -1 : 0;
+	}
+
+	if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
+			ENOMEM_ASPRINTF) {
+			ERROR("Path too long: %s%s", TMPDIR, img->fname);
+			return -1;
+	}
+
+	if (stat(filename, &buf)) {
+		TRACE("%s not found or wrong", filename);
+		free(filename);
+		return -1;
+	}
+	img->size = buf.st_size;
+	img->fdin = open(filename, O_RDONLY);
+	free(filename);
+	if (img->fdin < 0) {
+		ERROR("Image %s cannot be opened",
+		img->fname);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * streamfd: file descriptor if it is required to extract
  *           images from the stream (update from file)
@@ -356,11 +658,18 @@ int install_images(struct swupdate_cfg *sw)
 {
 	int ret;
 	struct img_type *img, *tmp;
-	char *filename;
-	struct stat buf;
 	const char* TMPDIR = get_tmpdir();
 	bool dry_run = sw->parms.dry_run;
 	bool dropimg;
+	struct install_sched sched = {
+		.dry_run = dry_run,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER
+	};
+
+	ret = check_parallel_images(&sw->images);
+	if (ret)
+		return ret;
 
 	/* Extract all scripts, preinstall scripts must be run now */
 	const char* tmpdir_scripts = get_tmpdirscripts();
@@ -393,24 +702,17 @@ int install_images(struct swupdate_cfg *sw)
 		if (img->install_directly)
 			continue;
 
-		if (asprintf(&filename, "%s%s", TMPDIR, img->fname) ==
-				ENOMEM_ASPRINTF) {
-				ERROR("Path too long: %s%s", TMPDIR, img->fname);
-				return -1;
+		/* a sequential image waits for the running group */
+		if (!install_in_parallel(img)) {
+			ret = install_sched_run(&sched, sw);
+			if (ret) {
+				install_sched_free(&sched);
+				return ret;
+			}
 		}
 
-		ret = stat(filename, &buf);
-		if (ret) {
-			TRACE("%s not found or wrong", filename);
-			free(filename);
-			return -1;
-		}
-		img->size = buf.st_size;
-		img->fdin = open(filename, O_RDONLY);
-		free(filename);
-		if (img->fdin < 0) {
-			ERROR("Image %s cannot be opened",
-			img->fname);
+		if (open_image(img)) {
+			install_sched_free(&sched);
 			return -1;
 		}
 
@@ -430,6 +732,14 @@ int install_images(struct swupdate_cfg *sw)
 			}
 			dropimg = true;
 			ret = 0;
+		} else if (install_in_parallel(img)) {
+			ret = install_sched_add(&sched, img);
+			if (ret) {
+				close(img->fdin);
+				install_sched_free(&sched);
+				return ret;
+			}
+			continue;
 		} else {
 			ret = install_single_image(img, dry_run);
 		}
@@ -441,10 +751,17 @@ int install_images(struct swupdate_cfg *sw)
 		if (dropimg)
 			free_image(img);
 
-		if (ret)
+		if (ret) {
+			install_sched_free(&sched);
 			return ret;
+		}
 	}
 
+	ret = install_sched_run(&sched, sw);
+	install_sched_free(&sched);
+	if (ret)
+		return ret;
+
 	/*
 	 * Skip scripts in dry-run mode
 	 */
@@ -513,17 +830,18 @@ static void cleaup_img_entry(struct img_type *img)
 	}
 }
 
+/*
+ * Images are allocated by the parser from the update arena,
+ * just the properties must be dropped
+ */
 void free_image(struct img_type *img) {
 	dict_drop_db(&img->properties);
-	free(img);
 }
 
 void cleanup_files(struct swupdate_cfg *software) {
 	char *fn;
 	struct img_type *img;
 	struct img_type *img_tmp;
-	struct hw_type *hw;
-	struct hw_type *hw_tmp;
 	const char* TMPDIR = get_tmpdir();
 	struct imglist *list[] = {&software->scripts};
 
@@ -568,10 +886,7 @@ void cleanup_files(struct swupdate_cfg *software) {
 		free(fn);
 	}
 
-	LIST_FOREACH_SAFE(hw, &software->hardware, next, hw_tmp) {
-		LIST_REMOVE(hw, next);
-		free(hw);
-	}
+	LIST_INIT(&software->hardware);
 	if (asprintf(&fn, "%s%s", TMPDIR, SW_DESCRIPTION_FILENAME) != ENOMEM_ASPRINTF) {
 		remove_sw_file(fn);
 		free(fn);
@@ -582,6 +897,9 @@ void cleanup_files(struct swupdate_cfg *software) {
 		free(fn);
 	}
 #endif
+
+	/* images and hardware revisions are released at once */
+	update_arena_release();
 }
 
 int preupdatecmd(struct swupdate_cfg *swcfg)
@@ -17,6 +17,7 @@
 #endif
 #include <sys/types.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -206,6 +207,196 @@ static void lua_report_exception(lua_State *L)
 	} while (*s++);
 }
 
+/*
+ * Compiled chunks are cached by content: scripts and embedded code
+ * that are the same in consecutive updates are not compiled again.
+ * The least recently used chunk is replaced when the cache is full.
+ */
+#define LUA_CHUNK_CACHE_SIZE	8
+
+/*
+ * The compiled code keeps the chunk name of the first load,
+ * so a chunk is reused only for the same source and name.
+ */
+struct lua_chunk {
+	unsigned int hash;
+	char *name;
+	char *src;
+	size_t srclen;
+	char *code;
+	size_t codelen;
+	unsigned long lastuse;
+};
+
+static struct lua_chunk chunk_cache[LUA_CHUNK_CACHE_SIZE];
+static unsigned long chunk_clock;
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct lua_chunk_writer {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int lua_chunk_write(lua_State __attribute__ ((__unused__)) *L,
+			   const void *p, size_t sz, void *ud)
+{
+	struct lua_chunk_writer *w = (struct lua_chunk_writer *)ud;
+	char *buf;
+
+	if (w->len + sz > w->size) {
+		size_t size = w->size ? w->size : 4096;
+
+		while (size < w->len + sz)
+			size <<= 1;
+		buf = realloc(w->buf, size);
+		if (!buf)
+			return 1;
+		w->buf = buf;
+		w->size = size;
+	}
+	memcpy(w->buf + w->len, p, sz);
+	w->len += sz;
+
+	return 0;
+}
+
+/* FNV-1a */
+static unsigned int lua_chunk_hash(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void lua_chunk_store(lua_State *L, unsigned int hash, const char *src,
+			    size_t len, const char *name)
+{
+	struct lua_chunk_writer w = { NULL, 0, 0 };
+	struct lua_chunk *chunk = &chunk_cache[0];
+	char *copy, *chunkname;
+	int ret;
+
+#if LUA_VERSION_NUM > 502
+	ret = lua_dump(L, lua_chunk_write, &w, 0);
+#else
+	ret = lua_dump(L, lua_chunk_write, &w);
+#endif
+	copy = malloc(len);
+	chunkname = strdup(name);
+	if (ret || !copy || !chunkname) {
+		free(w.buf);
+		free(copy);
+		free(chunkname);
+		return;
+	}
+	memcpy(copy, src, len);
+
+	for (unsigned int i = 1; i < LUA_CHUNK_CACHE_SIZE; i++) {
+		if (chunk_cache[i].lastuse < chunk->lastuse)
+			chunk = &chunk_cache[i];
+	}
+	free(chunk->name);
+	free(chunk->src);
+	free(chunk->code);
+	chunk->hash = hash;
+	chunk->name = chunkname;
+	chunk->src = copy;
+	chunk->srclen = len;
+	chunk->code = w.buf;
+	chunk->codelen = w.len;
+	chunk->lastuse = ++chunk_clock;
+}
+
+/*
+ * Load a chunk like luaL_loadbuffer(), taking the compiled
+ * code from the cache if the same source was already loaded
+ */
+static int lua_load_cached(lua_State *L, const char *src, size_t len, const char *name)
+{
+	unsigned int hash = lua_chunk_hash(src, len);
+	struct lua_chunk *chunk;
+	int ret = -1;
+
+	pthread_mutex_lock(&chunk_lock);
+	for (unsigned int i = 0; i < LUA_CHUNK_CACHE_SIZE; i++) {
+		chunk = &chunk_cache[i];
+		if (chunk->src && chunk->hash == hash && chunk->srclen == len &&
+		    !strcmp(chunk->name, name) && !memcmp(chunk->src, src, len)) {
+			chunk->lastuse = ++chunk_clock;
+			ret = luaL_loadbuffer(L, chunk->code, chunk->codelen, name);
+			break;
+		}
+	}
+
+	if (ret) {
+		if (ret > 0)
+			lua_pop(L, 1);
+		ret = luaL_loadbuffer(L, src, len, name);
+		if (!ret)
+			lua_chunk_store(L, hash, src, len, name);
+	}
+	pthread_mutex_unlock(&chunk_lock);
+
+	return ret;
+}
+
+/*
+ * Same as luaL_loadfile(), the file is read to look it up in the cache.
+ * If it cannot be read at once, luaL_loadfile() is used instead.
+ */
+static int lua_load_file_cached(lua_State *L, const char *script)
+{
+	struct stat st;
+	char *buf, *src, *name;
+	ssize_t len = 0, n;
+	int fd, ret;
+
+	fd = open(script, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return luaL_loadfile(L, script);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return luaL_loadfile(L, script);
+	}
+	while (len < st.st_size && (n = read(fd, buf + len, st.st_size - len)) > 0)
+		len += n;
+	close(fd);
+	if (len != st.st_size) {
+		free(buf);
+		return luaL_loadfile(L, script);
+	}
+
+	/* skip a UTF-8 BOM as luaL_loadfile() does */
+	src = buf;
+	if (len >= 3 && !memcmp(src, "\xEF\xBB\xBF", 3)) {
+		src += 3;
+		len -= 3;
+	}
+
+	/* skip the first line if it is a comment (#!), keep line numbers */
+	if (len && src[0] == '#') {
+		for (n = 0; n < len && src[n] != '\n'; n++)
+			src[n] = ' ';
+	}
+
+	if (asprintf(&name, "@%s", script) == ENOMEM_ASPRINTF) {
+		free(buf);
+		return LUA_ERRMEM;
+	}
+	ret = lua_load_cached(L, src, len, name);
+	free(name);
+	free(buf);
+
+	return ret;
+}
+
 int run_lua_script(lua_State *L, const char *script, bool load, const char *function, char *parms)
 {
 	int ret;
@@ -218,7 +409,7 @@ int run_lua_script(lua_State *L, const char *script, bool load, const char *func
 
 	if (load) {
 		TRACE("Loading Lua %s script", script);
-		if (luaL_loadfile(L, script)) {
+		if (lua_load_file_cached(L, script)) {
 			ERROR("ERROR loading %s", script);
 			return -1;
 		}
@@ -423,25 +614,134 @@ copyfile_exit:
 	return 2;
 }
 
-static int istream_read_callback(void *out, const void *buf, size_t len)
+/*
+ * image:read(callback [, options]) passes the data to the callback.
+ * By default each chunk of the pipeline is a Lua string, with
+ * options = { buffer = true } the callback gets instead a buffer
+ * userdata that refers to the data without copying it: it is valid
+ * just during the call and is read with #buf, buf:byte(i [, j]),
+ * buf:sub(i [, j]) or tostring(buf). options.chunk sets the size of
+ * the chunks passed to the callback, to reduce the number of calls.
+ */
+#define ISTREAM_BUFFER_MT	"swupdate.istream_buffer"
+#define ISTREAM_MAX_CHUNK	(16 * 1024 * 1024)
+
+struct istream_buffer {
+	const char *data;
+	size_t len;
+};
+
+struct istream_state {
+	lua_State *L;
+	int ud;			/* stack index of the buffer, 0 for strings */
+	struct istream_buffer *ubuf;
+	char *chunk;
+	size_t chunksize;
+	size_t chunklen;
+};
+
+static struct istream_buffer *istream_check_buffer(lua_State *L)
+{
+	struct istream_buffer *ubuf = luaL_checkudata(L, 1, ISTREAM_BUFFER_MT);
+
+	if (!ubuf->data)
+		luaL_error(L, "buffer is valid only inside the read callback");
+
+	return ubuf;
+}
+
+/* relative string position as for string.sub() */
+static size_t istream_pos(lua_Integer pos, size_t len)
+{
+	if (pos >= 0)
+		return (size_t)pos;
+	if ((size_t)-pos > len)
+		return 0;
+	return len + pos + 1;
+}
+
+static int l_istream_buffer_len(lua_State *L)
+{
+	struct istream_buffer *ubuf = istream_check_buffer(L);
+
+	lua_pushinteger(L, (lua_Integer)ubuf->len);
+	return 1;
+}
+
+static int l_istream_buffer_sub(lua_State *L)
+{
+	struct istream_buffer *ubuf = istream_check_buffer(L);
+	size_t start = istream_pos(luaL_optinteger(L, 2, 1), ubuf->len);
+	size_t end = istream_pos(luaL_optinteger(L, 3, -1), ubuf->len);
+
+	if (start < 1)
+		start = 1;
+	if (end > ubuf->len)
+		end = ubuf->len;
+	if (start > end)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, ubuf->data + start - 1, end - start + 1);
+	return 1;
+}
+
+static int l_istream_buffer_byte(lua_State *L)
+{
+	struct istream_buffer *ubuf = istream_check_buffer(L);
+	size_t start = istream_pos(luaL_optinteger(L, 2, 1), ubuf->len);
+	size_t end = istream_pos(luaL_optinteger(L, 3, (lua_Integer)start), ubuf->len);
+	int n = 0;
+
+	if (start < 1)
+		start = 1;
+	if (end > ubuf->len)
+		end = ubuf->len;
+	if (start > end)
+		return 0;
+	luaL_checkstack(L, (int)(end - start + 1), "buffer slice too large");
+	for (size_t i = start; i <= end; i++, n++)
+		lua_pushinteger(L, (unsigned char)ubuf->data[i - 1]);
+	return n;
+}
+
+static int l_istream_buffer_tostring(lua_State *L)
+{
+	struct istream_buffer *ubuf = istream_check_buffer(L);
+
+	lua_pushlstring(L, ubuf->data, ubuf->len);
+	return 1;
+}
+
+static const luaL_Reg l_istream_buffer[] = {
+	{ "__len", l_istream_buffer_len },
+	{ "__tostring", l_istream_buffer_tostring },
+	{ "sub", l_istream_buffer_sub },
+	{ "byte", l_istream_buffer_byte },
+	{ "tostring", l_istream_buffer_tostring },
+	{ NULL, NULL }
+};
+
+static int istream_deliver(struct istream_state *s, const char *data, size_t len)
 {
-	lua_State* L = (lua_State*)out;
+	lua_State* L = s->L;
 	lua_Number result;
-	if (len > LUAL_BUFFERSIZE) {
-		ERROR("I/O buffer size is larger than Lua's buffer size %d", LUAL_BUFFERSIZE);
-		return -1;
-	}
+	int ret;
 
-	luaL_checktype(L, 2, LUA_TFUNCTION);
 	lua_pushvalue(L, 2);
+	if (s->ud) {
+		s->ubuf->data = data;
+		s->ubuf->len = len;
+		lua_pushvalue(L, s->ud);
+	} else {
+		lua_pushlstring(L, data, len);
+	}
 
-	luaL_Buffer lbuffer;
-	luaL_buffinit(L, &lbuffer);
-	char *buffer = luaL_prepbuffsize(&lbuffer, len);
-	memcpy(buffer, buf, len);
-	luaL_addsize(&lbuffer, len);
-	luaL_pushresult(&lbuffer);
-	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+	ret = lua_pcall(L, 1, 1, 0);
+	if (s->ud) {
+		s->ubuf->data = NULL;
+		s->ubuf->len = 0;
+	}
+	if (ret != LUA_OK) {
 		ERROR("Lua error in callback: %s", lua_tostring(L, -1));
 		lua_pop(L, 1);
 		return -1;
@@ -460,11 +760,86 @@ static int istream_read_callback(void *out, const void *buf, size_t len)
 	return (int) result;
 }
 
+static int istream_read_callback(void *out, const void *buf, size_t len)
+{
+	struct istream_state *s = (struct istream_state *)out;
+	const char *data = buf;
+	size_t n;
+	int ret = 0;
+
+	if (!s->chunksize)
+		return istream_deliver(s, data, len);
+
+	/* collect the data to pass chunks of the requested size */
+	while (len) {
+		if (!s->chunklen && len >= s->chunksize) {
+			n = s->chunksize;
+			ret = istream_deliver(s, data, n);
+		} else {
+			n = min(len, s->chunksize - s->chunklen);
+			memcpy(s->chunk + s->chunklen, data, n);
+			s->chunklen += n;
+			if (s->chunklen == s->chunksize) {
+				ret = istream_deliver(s, s->chunk, s->chunklen);
+				s->chunklen = 0;
+			}
+		}
+		if (ret < 0)
+			return ret;
+		data += n;
+		len -= n;
+	}
+
+	return ret;
+}
+
 static int l_istream_read(lua_State* L)
 {
+	struct istream_state state = { .L = L };
+	lua_Integer chunk = 0;
+	int buffer, ret;
+
 	luaL_checktype(L, 1, LUA_TTABLE);
 	luaL_checktype(L, 2, LUA_TFUNCTION);
 
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "chunk");
+		chunk = lua_isnumber(L, -1) ? lua_tointeger(L, -1) : 0;
+		lua_pop(L, 1);
+		if (chunk < 0 || chunk > ISTREAM_MAX_CHUNK) {
+			lua_pushinteger(L, -1);
+			lua_pushfstring(L, "chunk size must be between 0 and %d",
+					ISTREAM_MAX_CHUNK);
+			return 2;
+		}
+		lua_getfield(L, 3, "buffer");
+		buffer = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (buffer) {
+			state.ubuf = lua_newuserdata(L, sizeof(*state.ubuf));
+			state.ubuf->data = NULL;
+			state.ubuf->len = 0;
+			if (luaL_newmetatable(L, ISTREAM_BUFFER_MT)) {
+				luaL_setfuncs(L, l_istream_buffer, 0);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, -2, "__index");
+			}
+			lua_setmetatable(L, -2);
+			state.ud = lua_gettop(L);
+		}
+	}
+
+	if (chunk) {
+		state.chunksize = chunk;
+		state.chunk = malloc(chunk);
+		if (!state.chunk) {
+			lua_settop(L, 1);
+			lua_pushinteger(L, -1);
+			lua_pushstring(L, strerror(ENOMEM));
+			return 2;
+		}
+	}
+
 	struct img_type img = {};
 	uint32_t image_checksum = img.checksum;
 
@@ -472,9 +847,12 @@ static int l_istream_read(lua_State* L)
 	table2image(L, &img);
 	lua_pop(L, 1);
 
-	int ret = copyimage(L, &img, istream_read_callback);
+	ret = copyimage(&state, &img, istream_read_callback);
+	if (ret >= 0 && state.chunklen)
+		ret = istream_deliver(&state, state.chunk, state.chunklen) < 0 ? -1 : 0;
+	free(state.chunk);
 
-	lua_pop(L, 1);
+	lua_settop(L, 1);
 	update_table(L, &img);
 	lua_pop(L, 1);
 
@@ -1547,7 +1925,7 @@ static int lua_handlers_init(lua_State *L, struct dict *bootenv)
 		lua_pop(L, 1); /* remove unused copy left on stack */
 		/* try to load Lua handlers for the swupdate system */
 #if defined(CONFIG_EMBEDDED_LUA_HANDLER)
-		ret = (luaL_loadbuffer(L, EMBEDDED_LUA_SRC_START, EMBEDDED_LUA_SRC_END-EMBEDDED_LUA_SRC_START, "LuaHandler") ||
+		ret = (lua_load_cached(L, EMBEDDED_LUA_SRC_START, EMBEDDED_LUA_SRC_END-EMBEDDED_LUA_SRC_START, "LuaHandler") ||
 		       lua_pcall(L, 0, LUA_MULTRET, 0));
 #else
 		ret = luaL_dostring(L, "require (\"swupdate_handlers\")");
@@ -1596,7 +1974,7 @@ int lua_init(void)
 
 int lua_load_buffer(lua_State *L, const char *buf)
 {
-	if (luaL_loadstring(L, buf) || lua_pcall(L, 0, 0, 0)) {
+	if (lua_load_cached(L, buf, strlen(buf), buf) || lua_pcall(L, 0, 0, 0)) {
 		LUAstackDump(L);
 		ERROR("ERROR loading Lua code");
 		return 1;
@@ -28,6 +28,57 @@ static char mtd_ubi_blacklist[100] = { 0 };
  */
 #define EMPTY_BYTE	0xFF
 
+/*
+ * Size of the first read when checking if a NOR block is empty:
+ * a block with data is usually detected here, without reading
+ * the whole block before erasing it.
+ */
+#define BLANK_CHECK_PROBE	4096
+
+static bool buffer_is_blank(const uint8_t *buf, size_t len)
+{
+	unsigned long w[4];
+	size_t i;
+
+	/*
+	 * Compare a word at a time, memcpy() does not break strict
+	 * aliasing and compiles to plain loads
+	 */
+	for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(w, buf + i, sizeof(w));
+		if ((w[0] & w[1] & w[2] & w[3]) != ~0UL)
+			return false;
+	}
+	for (; i < len; i++) {
+		if (buf[i] != EMPTY_BYTE)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Return 1 if the erase block is empty, 0 if it contains data
+ * and a negative value on read error.
+ */
+static int mtd_block_is_blank(struct mtd_dev_info *mtd, int fd, int eb,
+			      uint8_t *buf)
+{
+	int probe = min(mtd->eb_size, BLANK_CHECK_PROBE);
+
+	if (mtd_read(mtd, fd, eb, 0, buf, probe) != 0)
+		return -EIO;
+	if (!buffer_is_blank(buf, probe))
+		return 0;
+	if (probe == mtd->eb_size)
+		return 1;
+
+	if (mtd_read(mtd, fd, eb, probe, buf + probe, mtd->eb_size - probe) != 0)
+		return -EIO;
+
+	return buffer_is_blank(buf + probe, mtd->eb_size - probe);
+}
+
 int flash_erase_sector(int mtdnum, off_t start, size_t size)
 {
 	int fd;
@@ -35,7 +86,7 @@ int flash_erase_sector(int mtdnum, off_t start, size_t size)
 	struct mtd_dev_info *mtd;
 	int noskipbad = 0;
 	int ret = 0;
-	unsigned int eb, eb_start, i, eb_end, end;
+	unsigned int eb, eb_start, eb_end, end;
 	uint8_t *buf;
 	struct flash_description *flash = get_flash_info();
 
@@ -112,22 +163,17 @@ int flash_erase_sector(int mtdnum, off_t start, size_t size)
 		 * NAND flash is always erased.
 		 */
 		if (!isNand(flash, mtdnum)) {
-			if (mtd_read(mtd, fd, eb, 0, buf, mtd->eb_size) != 0) {
+			int blank = mtd_block_is_blank(mtd, fd, eb, buf);
+
+			if (blank < 0) {
 				ERROR("%s: MTD Read failure", mtd_device);
 				ret  = -EIO;
 				goto erase_out;
 			}
 
-			/* check if already empty */
-			for (i = 0; i < mtd->eb_size; i++) {
-				if (buf[i] != EMPTY_BYTE)
-					break;
-			}
-
 			/* skip erase if empty */
-			if (i == mtd->eb_size)
+			if (blank)
 				continue;
-
 		}
 
 		/* The sector contains data and it must be erased */
@@ -0,0 +1,121 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "util.h"
+#include "flash.h"
+#include "mtd_topology.h"
+
+static int uevent_fd = -1;
+static bool uevent_opened;
+/* a change was seen while scanning, scan again on next refresh */
+static bool topology_dirty;
+
+static int uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* kernel events */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+/*
+ * Read all pending uevents and check if one of them
+ * is for a MTD or UBI device. Right after a scan, the UBI
+ * devices and volumes added by attaching them are not a change.
+ */
+static bool uevent_topology_changed(bool after_scan)
+{
+	char buf[4096];
+	bool changed = false;
+	bool ubi_add;
+	ssize_t len;
+
+	while (true) {
+		len = recv(uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* events were lost, ENOBUFS, or the socket is broken */
+			changed = true;
+			if (errno == ENOBUFS)
+				continue;
+			break;
+		}
+		if (len == 0)
+			break;
+		buf[len] = '\0';
+
+		/* action@devpath, followed by KEY=value strings */
+		ubi_add = after_scan && !strncmp(buf, "add@", 4);
+		for (char *s = buf; s < buf + len; s += strlen(s) + 1) {
+			if (!strcmp(s, "SUBSYSTEM=mtd") ||
+			    (!strcmp(s, "SUBSYSTEM=ubi") && !ubi_add)) {
+				changed = true;
+				break;
+			}
+		}
+	}
+
+	return changed;
+}
+
+int mtd_topology_refresh(void)
+{
+	struct flash_description *flash = get_flash_info();
+	int ret;
+
+	if (!uevent_opened) {
+		uevent_opened = true;
+		uevent_fd = uevent_open();
+		if (uevent_fd < 0)
+			TRACE("No uevents (%s), MTD is scanned for each update",
+			      strerror(-uevent_fd));
+	}
+
+	if (flash->mtd_info && uevent_fd >= 0 && !topology_dirty &&
+	    !uevent_topology_changed(false)) {
+		TRACE("MTD topology unchanged, not scanning");
+		return flash->mtd.mtd_dev_cnt;
+	}
+
+	mtd_cleanup();
+	ret = scan_mtd_devices();
+
+	/*
+	 * The events queued during the scan are checked now: attaching
+	 * UBI adds devices and volumes, anything else was changed by
+	 * someone else while scanning and needs another scan.
+	 */
+	topology_dirty = uevent_fd >= 0 && uevent_topology_changed(true);
+	if (topology_dirty)
+		TRACE("MTD topology changed during scan");
+
+	return ret;
+}
@@ -0,0 +1,21 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _MTD_TOPOLOGY_H
+#define _MTD_TOPOLOGY_H
+
+#include "flash.h"
+
+/*
+ * The MTD and UBI devices found by scan_mtd_devices() are kept
+ * between updates. The kernel uevents for the mtd and ubi
+ * subsystems tell if they must be scanned again. Without uevents,
+ * they are scanned before every update as before. The UBI devices
+ * and volumes attached by the scan itself do not trigger a rescan.
+ */
+int mtd_topology_refresh(void);
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "network_ipc.h"
+#include "network_ipc_frame.h"
+
+/*
+ * Number of bytes of msgdata that must be sent: everything
+ * after the last non-zero byte is restored as zero by the receiver.
+ */
+size_t ipc_frame_payload_len(const ipc_message *msg)
+{
+	const unsigned char *data = (const unsigned char *)&msg->data;
+	size_t len = sizeof(msg->data);
+
+	while (len > 0 && !data[len - 1])
+		len--;
+
+	return len;
+}
+
+/*
+ * Returns the size of the message starting in buf, as far as
+ * it can be determined with the count bytes already received.
+ * The caller must read until count is equal to the returned
+ * value. A negative value means the frame is invalid.
+ */
+ssize_t ipc_frame_size(const void *buf, size_t count)
+{
+	struct ipc_frame_hdr hdr;
+	int magic;
+
+	if (count < sizeof(magic))
+		return sizeof(magic);
+
+	memcpy(&magic, buf, sizeof(magic));
+	if (magic != IPC_FRAME_MAGIC)
+		return sizeof(ipc_message);
+
+	if (count < sizeof(hdr))
+		return sizeof(hdr);
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.version != IPC_FRAME_VERSION || hdr.len > sizeof(msgdata))
+		return -EINVAL;
+
+	return sizeof(hdr) + hdr.len;
+}
+
+/*
+ * Convert a complete message (legacy or framed) into
+ * an ipc_message. Returns 1 if it was framed, 0 if legacy.
+ */
+int ipc_frame_decode(const void *buf, size_t count, ipc_message *msg)
+{
+	struct ipc_frame_hdr hdr;
+	ssize_t size = ipc_frame_size(buf, count);
+
+	if (size < 0 || (size_t)size != count)
+		return -EINVAL;
+
+	if (count == sizeof(*msg) &&
+	    ((const ipc_message *)buf)->magic != IPC_FRAME_MAGIC) {
+		memcpy(msg, buf, sizeof(*msg));
+		return 0;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	memset(msg, 0, sizeof(*msg));
+	msg->magic = IPC_MAGIC;
+	msg->type = hdr.type;
+	memcpy(&msg->data, (const char *)buf + sizeof(hdr), hdr.len);
+
+	return 1;
+}
+
+/*
+ * Serialize a message as it is sent on the socket, buf must hold
+ * IPC_FRAME_MAX_SIZE bytes. Returns the number of bytes used.
+ */
+size_t ipc_frame_encode(const ipc_message *msg, bool framed, void *buf)
+{
+	struct ipc_frame_hdr hdr;
+
+	if (!framed) {
+		memcpy(buf, msg, sizeof(*msg));
+		return sizeof(*msg);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = IPC_FRAME_MAGIC;
+	hdr.version = IPC_FRAME_VERSION;
+	hdr.type = msg->type;
+	hdr.len = ipc_frame_payload_len(msg);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy((char *)buf + sizeof(hdr), &msg->data, hdr.len);
+
+	return sizeof(hdr) + hdr.len;
+}
+
+static int write_iov(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr mh;
+	ssize_t n;
+
+	while (iovcnt > 0) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = iovcnt;
+		n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+int ipc_frame_write(int fd, const ipc_message *msg, bool framed)
+{
+	struct ipc_frame_hdr hdr;
+	struct iovec iov[2];
+
+	if (!framed) {
+		iov[0].iov_base = (void *)msg;
+		iov[0].iov_len = sizeof(*msg);
+		return write_iov(fd, iov, 1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = IPC_FRAME_MAGIC;
+	hdr.version = IPC_FRAME_VERSION;
+	hdr.type = msg->type;
+	hdr.len = ipc_frame_payload_len(msg);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)&msg->data;
+	iov[1].iov_len = hdr.len;
+
+	return write_iov(fd, iov, hdr.len ? 2 : 1);
+}
+
+/*
+ * Blocking read of one message, in either format
+ */
+int ipc_frame_read(int fd, ipc_message *msg, bool *framed)
+{
+	char buf[IPC_FRAME_MAX_SIZE];
+	size_t count = 0;
+	ssize_t size, n;
+	int ret;
+
+	for (;;) {
+		size = ipc_frame_size(buf, count);
+		if (size < 0)
+			return -1;
+		if ((size_t)size == count)
+			break;
+		n = read(fd, buf + count, size - count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		count += n;
+	}
+
+	ret = ipc_frame_decode(buf, count, msg);
+	if (ret < 0)
+		return -1;
+	if (framed)
+		*framed = ret > 0;
+
+	return 0;
+}
+
+/*
+ * Same as ipc_send_cmd(), but the request is sent framed
+ * and just the used payload is transferred in both directions.
+ */
+int ipc_frame_send_cmd(ipc_message *msg)
+{
+	struct sockaddr_un servaddr;
+	struct pollfd pfd;
+	int connfd, ret = -1;
+
+	connfd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (connfd < 0)
+		return -1;
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sun_family = AF_LOCAL;
+	strncpy(servaddr.sun_path, get_ctrl_socket(), sizeof(servaddr.sun_path) - 1);
+	if (connect(connfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0)
+		goto out;
+
+	msg->magic = IPC_MAGIC;
+	if (ipc_frame_write(connfd, msg, true) < 0)
+		goto out;
+
+	/*
+	 * Do not block forever if the request
+	 * is forwarded to a subprocess
+	 */
+	if (msg->type == SWUPDATE_SUBPROCESS && msg->data.procmsg.timeout > 0) {
+		pfd.fd = connfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (msg->data.procmsg.timeout + 1) * 1000) <= 0)
+			goto out;
+	}
+
+	ret = ipc_frame_read(connfd, msg, NULL);
+
+out:
+	close(connfd);
+	return ret;
+}
@@ -0,0 +1,45 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+#ifndef _NETWORK_IPC_FRAME_H
+#define _NETWORK_IPC_FRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "network_ipc.h"
+
+/*
+ * Variable length framing for the control socket.
+ *
+ * A legacy request is a whole ipc_message starting with IPC_MAGIC.
+ * A framed request starts with IPC_FRAME_MAGIC, followed by a header
+ * with the payload length, and just the used part of msgdata: the
+ * trailing bytes not sent are zero. SWUpdate answers in the same
+ * format as the request, so old clients are not affected.
+ */
+#define IPC_FRAME_MAGIC		0x14052026
+#define IPC_FRAME_VERSION	1
+
+struct ipc_frame_hdr {
+	int magic;
+	uint16_t version;
+	uint16_t flags;		/* reserved, must be 0 */
+	int type;
+	uint32_t len;		/* bytes of msgdata following the header */
+};
+
+#define IPC_FRAME_MAX_SIZE	(sizeof(struct ipc_frame_hdr) + sizeof(msgdata))
+
+size_t ipc_frame_payload_len(const ipc_message *msg);
+ssize_t ipc_frame_size(const void *buf, size_t count);
+int ipc_frame_decode(const void *buf, size_t count, ipc_message *msg);
+size_t ipc_frame_encode(const ipc_message *msg, bool framed, void *buf);
+int ipc_frame_write(int fd, const ipc_message *msg, bool framed);
+int ipc_frame_read(int fd, ipc_message *msg, bool *framed);
+int ipc_frame_send_cmd(ipc_message *msg);
+
+#endif
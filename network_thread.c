@@ -17,14 +17,18 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <time.h>
 
 #include "bsdqueue.h"
 #include "util.h"
 #include "network_ipc.h"
+#include "network_ipc_frame.h"
 #include "network_interface.h"
 #include "network_utils.h"
 #include "installer.h"
@@ -38,24 +42,77 @@
 
 #define NUM_CACHED_MESSAGES 100
 #define DEFAULT_INTERNAL_TIMEOUT 60
+#define CTRL_MAX_EVENTS 16
+/* connections being read plus requests waiting for the worker */
+#define CTRL_MAX_PENDING 64
+
+/*
+ * Number of slots in the notification ring, must be a power of 2.
+ * If the delivery thread cannot keep up, new log messages are dropped
+ * instead of blocking the caller. The last NOTIFY_RING_RESERVED slots
+ * are kept for status changes and errors, which are never dropped:
+ * if the ring is full, their caller waits for the delivery thread.
+ */
+#define NOTIFY_RING_SLOTS 128
+#define NOTIFY_RING_RESERVED 16
+#define NOTIFY_MSG_SIZE sizeof(((ipc_message *)0)->data.notify.msg)
+
+/*
+ * Subscribers are written without blocking, what the socket does not
+ * take is kept per connection and sent when the delivery thread wakes
+ * up again. A client with more pending bytes than this is too slow
+ * and it is disconnected.
+ */
+#define NOTIFY_CONN_MAX_PENDING ((NUM_CACHED_MESSAGES + NOTIFY_RING_SLOTS) * IPC_FRAME_MAX_SIZE)
+#define NOTIFY_FLUSH_INTERVAL_MS 100
 
 struct msg_elem {
 	RECOVERY_STATUS status;
 	int error;
 	int level;
-	char *msg;
-	SIMPLEQ_ENTRY(msg_elem) next;
+	char msg[NOTIFY_MSG_SIZE];
 };
 
-SIMPLEQ_HEAD(msglist, msg_elem);
-static struct msglist notifymsgs;
+/*
+ * History of the last notifications, kept for GET_STATUS
+ * and for clients that connect later with NOTIFY_STREAM.
+ * It is a fixed array used as circular buffer.
+ */
+static struct msg_elem notifymsgs[NUM_CACHED_MESSAGES];
+static unsigned long firstmsg = 0;
 static unsigned long nrmsgs = 0;
 
 static pthread_mutex_t msglock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Lock-free multi-producer / single-consumer ring between
+ * network_notifier() and the delivery thread. Each slot carries
+ * a sequence number: a producer owns the slot when seq == pos,
+ * the consumer when seq == pos + 1.
+ */
+struct notify_slot {
+	unsigned long seq;
+	struct msg_elem elem;
+};
+
+static struct {
+	struct notify_slot slots[NOTIFY_RING_SLOTS];
+	unsigned long head;
+	unsigned long tail;
+	unsigned long dropped;
+	sem_t avail;
+	unsigned int waiters;
+	pthread_mutex_t wait_lock;
+	pthread_cond_t space;
+} notify_ring;
+
+static pthread_t notify_delivery_thread_id;
+static __thread bool in_delivery_thread;
+
 struct subprocess_msg_elem {
 	ipc_message message;
 	int client;
+	bool framed;
 	SIMPLEQ_ENTRY(subprocess_msg_elem) next;
 };
 
@@ -69,9 +126,17 @@ static pthread_cond_t subprocess_wkup = PTHREAD_COND_INITIALIZER;
 struct notify_conn {
 	SIMPLEQ_ENTRY(notify_conn) next;
 	int sockfd;
+	bool framed;
+	char *pending;
+	size_t npending;
 };
 
 SIMPLEQ_HEAD(connections, notify_conn);
+/*
+ * New subscribers are queued under msglock, the delivery thread
+ * moves them into notify_conns, that only it accesses.
+ */
+static struct connections notify_new_conns;
 static struct connections notify_conns;
 
 static bool is_selection_allowed(const char *software_set, char *running_mode,
@@ -111,122 +176,408 @@ static bool is_selection_allowed(const char *software_set, char *running_mode,
 	return allowed;
 }
 
-static void clean_msg(char *msg, char drop)
+/*
+ * Copy a message replacing tabs and line breaks with blanks,
+ * the notification is sent as a single line.
+ */
+static void copy_clean_msg(char *dst, const char *src, size_t size)
 {
-	char *lfpos;
-	lfpos = strchr(msg, drop);
-	while (lfpos) {
-		*lfpos = ' ';
-		lfpos = strchr(msg, drop);
+	size_t i;
+
+	for (i = 0; i < size - 1 && src[i]; i++) {
+		switch (src[i]) {
+		case '\t':
+		case '\n':
+		case '\r':
+			dst[i] = ' ';
+			break;
+		default:
+			dst[i] = src[i];
+		}
 	}
+	dst[i] = '\0';
 }
 
-static int write_notify_msg(ipc_message *msg, int sockfd)
+static void notify_conn_free(struct notify_conn *conn)
+{
+	close(conn->sockfd);
+	free(conn->pending);
+	free(conn);
+}
+
+/*
+ * Send as much of the pending bytes as the socket takes
+ * without blocking. Returns -1 if the client is gone.
+ */
+static int notify_conn_flush(struct notify_conn *conn)
 {
-	void *buf;
-	size_t count;
 	ssize_t n;
-	int ret = 0;
 
-	buf = msg;
-	count = sizeof(*msg);
-	while (count > 0) {
-		n = send(sockfd, buf, count, MSG_NOSIGNAL);
-		if (n <= 0) {
-			/*
-			 * We can't use the notify methods for error logging here as it will cause a deadlock.
-			 */
-			if (n == 0) {
-				fprintf(stderr, "Error: A status client is not responding, removing it.\n");
-			}
-			ret = -1;
-			break;
+	while (conn->npending) {
+		n = send(conn->sockfd, conn->pending, conn->npending,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
 		}
-		count -= (size_t)n;
-		buf = (char*)buf + n;
+		conn->npending -= n;
+		memmove(conn->pending, conn->pending + n, conn->npending);
+	}
+
+	return 0;
+}
+
+static int notify_conn_queue(struct notify_conn *conn, const char *data, size_t len)
+{
+	char *tmp;
+
+	if (conn->npending + len > NOTIFY_CONN_MAX_PENDING) {
+		fprintf(stderr, "Error: A status client is too slow, removing it.\n");
+		return -1;
 	}
-	return ret;
+	tmp = realloc(conn->pending, conn->npending + len);
+	if (!tmp)
+		return -1;
+	conn->pending = tmp;
+	memcpy(conn->pending + conn->npending, data, len);
+	conn->npending += len;
+
+	return 0;
+}
+
+static int notify_conn_queue_msg(struct notify_conn *conn, ipc_message *msg)
+{
+	char buf[IPC_FRAME_MAX_SIZE];
+
+	return notify_conn_queue(conn, buf, ipc_frame_encode(msg, conn->framed, buf));
 }
 
 /*
- * This must be called after acquiring the mutex
- * for the msglock structure
+ * Send a message to a subscriber, what the socket does not take
+ * is queued. Must be called only by the delivery thread.
+ */
+static int notify_conn_send(struct notify_conn *conn, ipc_message *msg)
+{
+	char buf[IPC_FRAME_MAX_SIZE];
+	size_t len = ipc_frame_encode(msg, conn->framed, buf);
+	ssize_t n = 0;
+
+	if (conn->npending) {
+		if (notify_conn_queue(conn, buf, len) < 0)
+			return -1;
+		return notify_conn_flush(conn);
+	}
+
+	do {
+		n = send(conn->sockfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		n = 0;
+	}
+	if ((size_t)n == len)
+		return 0;
+
+	return notify_conn_queue(conn, buf + n, len - n);
+}
+
+/*
+ * Called by the delivery thread without holding msglock:
+ * a subscriber that does not read cannot stall the others.
  */
 static void send_notify_msg(ipc_message *msg)
 {
 	struct notify_conn *conn, *tmp;
-	int ret;
 
 	SIMPLEQ_FOREACH_SAFE(conn, &notify_conns, next, tmp) {
-		ret = write_notify_msg(msg, conn->sockfd);
-		if (ret < 0) {
-			close(conn->sockfd);
+		if (notify_conn_send(conn, msg) < 0) {
 			SIMPLEQ_REMOVE(&notify_conns, conn,
 						   notify_conn, next);
-			free(conn);
+			notify_conn_free(conn);
 		}
 	}
 }
 
-static void network_notifier(RECOVERY_STATUS status, int error, int level, const char *msg)
+/* retry the subscribers the socket did not take everything from */
+static bool notify_conns_flush(void)
 {
-	int len = msg ? strlen(msg) : 0;
-	struct msg_elem *newmsg = (struct msg_elem *)calloc(1, sizeof(*newmsg) + len + 1);
-	struct msg_elem *oldmsg;
-	ipc_message ipcmsg;
+	struct notify_conn *conn, *tmp;
+	bool pending = false;
 
-	if (!newmsg)
-		return;
+	SIMPLEQ_FOREACH_SAFE(conn, &notify_conns, next, tmp) {
+		if (notify_conn_flush(conn) < 0) {
+			SIMPLEQ_REMOVE(&notify_conns, conn,
+						   notify_conn, next);
+			notify_conn_free(conn);
+			continue;
+		}
+		if (conn->npending)
+			pending = true;
+	}
 
-	pthread_mutex_lock(&msglock);
-	nrmsgs++;
-	if (nrmsgs > NUM_CACHED_MESSAGES) {
-		oldmsg = SIMPLEQ_FIRST(&notifymsgs);
-		SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-		free(oldmsg);
-		nrmsgs--;
+	return pending;
+}
+
+/*
+ * Take over the new subscribers, must be called holding msglock:
+ * they got the history up to here, the next messages are sent
+ * by the delivery thread.
+ */
+static void notify_conns_adopt(void)
+{
+	struct notify_conn *conn;
+
+	while (!SIMPLEQ_EMPTY(&notify_new_conns)) {
+		conn = SIMPLEQ_FIRST(&notify_new_conns);
+		SIMPLEQ_REMOVE_HEAD(&notify_new_conns, next);
+		SIMPLEQ_INSERT_TAIL(&notify_conns, conn, next);
 	}
-	newmsg->msg = (char *)newmsg + sizeof(struct msg_elem);
+}
 
-	newmsg->status = status;
-	newmsg->error = error;
-	newmsg->level = level;
+static void notify_ring_init(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < NOTIFY_RING_SLOTS; i++)
+		notify_ring.slots[i].seq = i;
+	notify_ring.head = 0;
+	notify_ring.tail = 0;
+	notify_ring.dropped = 0;
+	notify_ring.waiters = 0;
+	sem_init(&notify_ring.avail, 0, 0);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&notify_ring.space, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&notify_ring.wait_lock, NULL);
+}
+
+static inline bool notify_is_important(RECOVERY_STATUS status, int level)
+{
+	return status != RUN || level == ERRORLEVEL;
+}
+
+/*
+ * Wait until the delivery thread frees a slot. The timeout only
+ * guards against a missed wakeup, the ring is checked again anyway.
+ */
+static void notify_ring_wait_space(void)
+{
+	struct timespec ts;
+	unsigned long head, tail;
+
+	pthread_mutex_lock(&notify_ring.wait_lock);
+	__atomic_add_fetch(&notify_ring.waiters, 1, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&notify_ring.head, __ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&notify_ring.tail, __ATOMIC_SEQ_CST);
+	if (head - tail >= NOTIFY_RING_SLOTS) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&notify_ring.space, &notify_ring.wait_lock, &ts);
+	}
+	__atomic_sub_fetch(&notify_ring.waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&notify_ring.wait_lock);
+}
 
-	if (msg) {
-		strncpy(newmsg->msg, msg, len);
-		clean_msg(newmsg->msg, '\t');
-		clean_msg(newmsg->msg, '\n');
-		clean_msg(newmsg->msg, '\r');
+/*
+ * Producer side: it can be called concurrently by any thread and it
+ * does not allocate. It blocks only for status changes and errors
+ * when the ring is completely full.
+ */
+static bool notify_ring_push(RECOVERY_STATUS status, int error, int level, const char *msg)
+{
+	struct notify_slot *slot;
+	unsigned long pos, seq;
+	long diff;
+	bool important = notify_is_important(status, level);
+
+	pos = __atomic_load_n(&notify_ring.head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &notify_ring.slots[pos & (NOTIFY_RING_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			/* keep the reserved slots for important messages */
+			if (!important &&
+			    pos - __atomic_load_n(&notify_ring.tail, __ATOMIC_ACQUIRE) >=
+			    NOTIFY_RING_SLOTS - NOTIFY_RING_RESERVED) {
+				__atomic_add_fetch(&notify_ring.dropped, 1, __ATOMIC_RELAXED);
+				return false;
+			}
+			if (__atomic_compare_exchange_n(&notify_ring.head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/*
+			 * Ring is full, the delivery thread is behind. It
+			 * cannot wait for itself, what it logs is dropped.
+			 */
+			if (!important || in_delivery_thread) {
+				__atomic_add_fetch(&notify_ring.dropped, 1, __ATOMIC_RELAXED);
+				return false;
+			}
+			notify_ring_wait_space();
+			pos = __atomic_load_n(&notify_ring.head, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&notify_ring.head, __ATOMIC_RELAXED);
 	}
 
+	slot->elem.status = status;
+	slot->elem.error = error;
+	slot->elem.level = level;
+	if (msg)
+		copy_clean_msg(slot->elem.msg, msg, sizeof(slot->elem.msg));
+	else
+		slot->elem.msg[0] = '\0';
 
-	SIMPLEQ_INSERT_TAIL(&notifymsgs, newmsg, next);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&notify_ring.avail);
 
-	ipcmsg.magic = IPC_MAGIC;
-	ipcmsg.type = NOTIFY_STREAM;
-	memset(&ipcmsg.data, 0, sizeof(ipcmsg.data));
+	return true;
+}
 
-	strncpy(ipcmsg.data.notify.msg, newmsg->msg,
-			sizeof(ipcmsg.data.notify.msg) - 1);
-	ipcmsg.data.notify.status = newmsg->status;
-	ipcmsg.data.notify.error = newmsg->error;
-	ipcmsg.data.notify.level = newmsg->level;
-	send_notify_msg(&ipcmsg);
+/*
+ * Consumer side: only the delivery thread calls it
+ */
+static bool notify_ring_pop(struct msg_elem *elem)
+{
+	unsigned long pos = notify_ring.tail;
+	struct notify_slot *slot = &notify_ring.slots[pos & (NOTIFY_RING_SLOTS - 1)];
 
-	pthread_mutex_unlock(&msglock);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+
+	*elem = slot->elem;
+	__atomic_store_n(&slot->seq, pos + NOTIFY_RING_SLOTS, __ATOMIC_RELEASE);
+	__atomic_store_n(&notify_ring.tail, pos + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&notify_ring.waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&notify_ring.wait_lock);
+		pthread_cond_broadcast(&notify_ring.space);
+		pthread_mutex_unlock(&notify_ring.wait_lock);
+	}
+
+	return true;
 }
 
-static void cleanum_msg_list(void)
+static void network_notifier(RECOVERY_STATUS status, int error, int level, const char *msg)
 {
-	struct msg_elem *notification;
+	notify_ring_push(status, error, level, msg);
+}
 
-	pthread_mutex_lock(&msglock);
+/*
+ * History helpers, they must be called after acquiring
+ * the mutex for the msglock structure
+ */
+static void history_add(const struct msg_elem *elem)
+{
+	if (nrmsgs == NUM_CACHED_MESSAGES) {
+		firstmsg = (firstmsg + 1) % NUM_CACHED_MESSAGES;
+		nrmsgs--;
+	}
+	notifymsgs[(firstmsg + nrmsgs) % NUM_CACHED_MESSAGES] = *elem;
+	nrmsgs++;
+}
+
+static struct msg_elem *history_get(unsigned long index)
+{
+	if (index >= nrmsgs)
+		return NULL;
+	return &notifymsgs[(firstmsg + index) % NUM_CACHED_MESSAGES];
+}
+
+static void history_remove_first(void)
+{
+	if (!nrmsgs)
+		return;
+	firstmsg = (firstmsg + 1) % NUM_CACHED_MESSAGES;
+	nrmsgs--;
+}
+
+/*
+ * Delivery thread: it drains the ring, stores the messages
+ * in the history and forwards them to the subscribers.
+ * Sending to slow clients happens here and not in the
+ * context of the thread that generated the message.
+ */
+static void *notify_delivery_thread(void *data)
+{
+	struct msg_elem elem;
+	ipc_message ipcmsg;
+	unsigned long dropped;
+	struct timespec ts;
+	bool pending = false;
+
+	(void)data;
+	in_delivery_thread = true;
+	thread_ready();
+
+	for (;;) {
+		/* wake up in time to go on with slow subscribers */
+		if (pending) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += NOTIFY_FLUSH_INTERVAL_MS * 1000 * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			if (sem_timedwait(&notify_ring.avail, &ts) < 0 &&
+			    errno != ETIMEDOUT)
+				continue;
+		} else if (sem_wait(&notify_ring.avail) < 0)
+			continue;
 
-	while (!SIMPLEQ_EMPTY(&notifymsgs)) {
-		notification = SIMPLEQ_FIRST(&notifymsgs);
-		SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-		free(notification);
+		pthread_mutex_lock(&msglock);
+		notify_conns_adopt();
+		pthread_mutex_unlock(&msglock);
+
+		/* msglock is not held here, logging cannot deadlock */
+		dropped = __atomic_exchange_n(&notify_ring.dropped, 0, __ATOMIC_RELAXED);
+		if (dropped)
+			WARN("%lu notifications dropped, ring full", dropped);
+
+		/*
+		 * Producers can publish out of order, drain
+		 * everything that is ready
+		 */
+		while (notify_ring_pop(&elem)) {
+			ipcmsg.magic = IPC_MAGIC;
+			ipcmsg.type = NOTIFY_STREAM;
+			memset(&ipcmsg.data, 0, sizeof(ipcmsg.data));
+			strlcpy(ipcmsg.data.notify.msg, elem.msg,
+				sizeof(ipcmsg.data.notify.msg));
+			ipcmsg.data.notify.status = elem.status;
+			ipcmsg.data.notify.error = elem.error;
+			ipcmsg.data.notify.level = elem.level;
+
+			pthread_mutex_lock(&msglock);
+			history_add(&elem);
+			notify_conns_adopt();
+			pthread_mutex_unlock(&msglock);
+
+			send_notify_msg(&ipcmsg);
+		}
+		pending = notify_conns_flush();
 	}
+
+	return NULL;
+}
+
+static void cleanum_msg_list(void)
+{
+	pthread_mutex_lock(&msglock);
+	firstmsg = 0;
 	nrmsgs = 0;
 	pthread_mutex_unlock(&msglock);
 }
@@ -257,8 +608,8 @@ static void empty_pipe(int fd)
 static void send_subprocess_reply(
 		const struct subprocess_msg_elem *const subprocess_msg)
 {
-	if (write(subprocess_msg->client, &subprocess_msg->message,
-			sizeof(subprocess_msg->message)) < 0)
+	if (ipc_frame_write(subprocess_msg->client, &subprocess_msg->message,
+			subprocess_msg->framed) < 0)
 		ERROR("Error writing on ctrl socket: %s", strerror(errno));
 }
 
@@ -361,15 +712,84 @@ static void *subprocess_thread (void *data)
 	return NULL;
 }
 
-void *network_thread (void *data)
-{
-	struct installer *instp = (struct installer *)data;
-	int ctrllisten, ctrlconnfd;
-	socklen_t clilen;
-	struct sockaddr_un cliaddr;
+/*
+ * Control connection not yet dispatched: the request
+ * is accumulated here until it is complete, so a client
+ * sending it in several chunks (or a stalled one) does not
+ * block the other clients.
+ */
+struct ctrl_conn {
+	int fd;
+	size_t nread;
+	time_t started;
+	char buf[IPC_FRAME_MAX_SIZE];
+	LIST_ENTRY(ctrl_conn) next;
+};
+
+LIST_HEAD(ctrl_connections, ctrl_conn);
+static struct ctrl_connections ctrl_conns;
+
+/*
+ * Requests that run scripts or write to the bootloader are served
+ * by a worker, so that they cannot stall the event loop. Notify
+ * subscribers are served by the delivery thread.
+ */
+struct ctrl_work {
 	ipc_message msg;
-	int nread;
-	struct msg_elem *notification, *tmp;
+	int fd;
+	bool framed;
+	SIMPLEQ_ENTRY(ctrl_work) next;
+};
+
+SIMPLEQ_HEAD(ctrl_worklist, ctrl_work);
+static struct ctrl_worklist ctrl_works;
+static pthread_mutex_t ctrl_work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ctrl_work_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int ctrl_pending;
+
+static time_t monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static int set_blocking(int fd, bool blocking)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	if (blocking)
+		flags &= ~O_NONBLOCK;
+	else
+		flags |= O_NONBLOCK;
+
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static void ctrl_conn_free(int epollfd, struct ctrl_conn *conn, bool close_fd)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	if (close_fd)
+		close(conn->fd);
+	LIST_REMOVE(conn, next);
+	free(conn);
+	__atomic_sub_fetch(&ctrl_pending, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Process a complete request. The connection is
+ * closed here or handed over to the installer, to the
+ * subprocess thread or to the list of notify subscribers.
+ */
+static void handle_ctrl_msg(struct installer *instp, int ctrlconnfd, ipc_message *msgp,
+			    bool framed)
+{
+	ipc_message msg = *msgp;
+	struct msg_elem *notification;
+	unsigned long i;
 	struct notify_conn *conn;
 	int ret;
 	update_state_t value;
@@ -378,272 +798,513 @@ void *network_thread (void *data)
 	struct swupdate_cfg *cfg;
 	char *varvalue;
 
-	if (!instp) {
-		TRACE("Fatal error: Network thread aborting...");
-		return (void *)0;
-	}
+	should_close_socket = true;
+	if (msg.magic == IPC_MAGIC)  {
+		switch (msg.type) {
+		case POST_UPDATE:
+			if (postupdate(get_swupdate_cfg(),
+						   msg.data.procmsg.len > 0 ? msg.data.procmsg.buf : NULL) == 0) {
+				msg.type = ACK;
+				sprintf(msg.data.msg, "Post-update actions successfully executed.");
+			} else {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "Post-update actions failed.");
+			}
+			break;
+		case SWUPDATE_SUBPROCESS:
+			subprocess_msg = (struct subprocess_msg_elem*)malloc(
+					sizeof(struct subprocess_msg_elem));
+			if (subprocess_msg == NULL) {
+				ERROR("Cannot handle subprocess IPC because of OOM.");
+				msg.type = NACK;
+				break;
+			}
 
-	SIMPLEQ_INIT(&notifymsgs);
-	SIMPLEQ_INIT(&notify_conns);
-	SIMPLEQ_INIT(&subprocess_messages);
-	register_notifier(network_notifier);
+			should_close_socket = false;
+			subprocess_msg->client = ctrlconnfd;
+			subprocess_msg->framed = framed;
+			subprocess_msg->message = msg;
 
-	sigset_t sigpipe_mask;
-	sigemptyset(&sigpipe_mask);
-	sigaddset(&sigpipe_mask, SIGPIPE);
-	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, NULL);
+			pthread_mutex_lock(&subprocess_msg_lock);
+			SIMPLEQ_INSERT_TAIL(&subprocess_messages, subprocess_msg, next);
+			pthread_cond_signal(&subprocess_wkup);
+			pthread_mutex_unlock(&subprocess_msg_lock);
+			/*
+			 * ACK/NACK will be inserted by the called SUBPROCESS
+			 * It should not be touched here.
+			 * We leave the type as is and delegate the socket to a
+			 * dedicated processing thread.
+			 */
 
-	subprocess_ipc_handler_thread_id = start_thread(subprocess_thread, NULL);
+			break;
+		case REQ_INSTALL:
+			TRACE("Incoming network request: processing...");
+			pthread_mutex_lock(&stream_mutex);
+			if (instp->status == IDLE) {
+				instp->fd = ctrlconnfd;
+				instp->req = msg.data.instmsg.req;
+				if ((instp->req.apiversion == SWUPDATE_API_VERSION) &&
+				    (is_selection_allowed(instp->req.software_set,
+							  instp->req.running_mode,
+							  &instp->software->accepted_set))) {
+					/*
+					 * Prepare answer
+					 */
+					msg.type = ACK;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+					should_close_socket = false;
 
-	/* Initialize and bind to UDS */
-	ctrllisten = listener_create(get_ctrl_socket(), SOCK_STREAM);
-	if (ctrllisten < 0 ) {
-		ERROR("Error creating IPC control socket");
-		exit(2);
+					/* Drop all old notification from last run */
+					cleanum_msg_list();
+
+					/* Wake-up the installer */
+					stream_wkup = true;
+					pthread_cond_signal(&stream_cond);
+				} else {
+					msg.type = NACK;
+					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+				}
+			} else {
+				msg.type = NACK;
+				sprintf(msg.data.msg, "Installation in progress");
+			}
+			/*
+			 * Answer before releasing the mutex: the installer
+			 * must not start reading the stream before the ACK
+			 * has been sent.
+			 */
+			ret = ipc_frame_write(ctrlconnfd, &msg, framed);
+			if (ret < 0)
+				ERROR("Error write on socket ctrl: %s", strerror(errno));
+			pthread_mutex_unlock(&stream_mutex);
+			if (should_close_socket)
+				close(ctrlconnfd);
+			return;
+		case GET_STATUS:
+			msg.type = ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			pthread_mutex_lock(&stream_mutex);
+			msg.data.status.current = instp->status;
+			msg.data.status.last_result = instp->last_install;
+			msg.data.status.error = instp->last_error;
+			pthread_mutex_unlock(&stream_mutex);
+
+			/* Get first notification from the queue */
+			pthread_mutex_lock(&msglock);
+			notification = history_get(0);
+			if (notification) {
+				strncpy(msg.data.status.desc, notification->msg,
+					sizeof(msg.data.status.desc) - 1);
+				msg.data.status.current = notification->status;
+				msg.data.status.error = notification->error;
+				history_remove_first();
+			}
+			pthread_mutex_unlock(&msglock);
+
+			break;
+		case NOTIFY_STREAM:
+			msg.type = ACK;
+			memset(msg.data.msg, 0, sizeof(msg.data.msg));
+			pthread_mutex_lock(&stream_mutex);
+			msg.data.status.current = instp->status;
+			msg.data.status.last_result = instp->last_install;
+			msg.data.status.error = instp->last_error;
+			pthread_mutex_unlock(&stream_mutex);
+
+			/*
+			 * The answer and the history are queued, the delivery
+			 * thread sends them without blocking: a client that
+			 * does not read cannot stall this thread.
+			 */
+			conn = (struct notify_conn *)calloc(1, sizeof(*conn));
+			if (!conn || set_blocking(ctrlconnfd, false) < 0) {
+				free(conn);
+				ERROR("Cannot add notify client, skipping...");
+				close(ctrlconnfd);
+				msg.type = NOTIFY_STREAM;
+				break;
+			}
+			conn->sockfd = ctrlconnfd;
+			conn->framed = framed;
+			ret = notify_conn_queue_msg(conn, &msg);
+			msg.type = NOTIFY_STREAM;
+
+			pthread_mutex_lock(&msglock);
+			for (i = 0; !ret && (notification = history_get(i)) != NULL; i++) {
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
+
+				strncpy(msg.data.notify.msg, notification->msg,
+						sizeof(msg.data.notify.msg) - 1);
+				msg.data.notify.status = notification->status;
+				msg.data.notify.error = notification->error;
+				msg.data.notify.level = notification->level;
+
+				ret = notify_conn_queue_msg(conn, &msg);
+			}
+			if (ret < 0) {
+				pthread_mutex_unlock(&msglock);
+				ERROR("Error queuing notify history");
+				notify_conn_free(conn);
+				break;
+			}
+			SIMPLEQ_INSERT_TAIL(&notify_new_conns, conn, next);
+			pthread_mutex_unlock(&msglock);
+
+			/* wake up the delivery thread */
+			sem_post(&notify_ring.avail);
+
+			break;
+		case SET_AES_KEY:
+#ifndef CONFIG_PKCS11
+			msg.type = ACK;
+			if (set_aes_key(msg.data.aeskeymsg.key_ascii, msg.data.aeskeymsg.ivt_ascii))
+#endif
+				msg.type = NACK;
+			break;
+		case SET_VERSIONS_RANGE:
+			msg.type = ACK;
+			set_version_range(msg.data.versions.minimum_version,
+					  msg.data.versions.maximum_version,
+					  msg.data.versions.current_version);
+			break;
+		case GET_HW_REVISION:
+			cfg = get_swupdate_cfg();
+			if (get_hw_revision(&cfg->hw) < 0) {
+				msg.type = NACK;
+				memset(msg.data.msg, 0, sizeof(msg.data.msg));
+				break;
+			}
+			msg.type = ACK;
+			memset(msg.data.revisions.boardname, 0, sizeof(msg.data.revisions.boardname));
+			strncpy(msg.data.revisions.boardname, cfg->hw.boardname,
+				sizeof(msg.data.revisions.boardname) - 1);
+			memset(msg.data.revisions.revision, 0, sizeof(msg.data.revisions.revision));
+			strncpy(msg.data.revisions.revision, cfg->hw.revision,
+				sizeof(msg.data.revisions.revision) - 1);
+			break;
+		case SET_UPDATE_STATE:
+			value = *(update_state_t *)msg.data.msg;
+			msg.type = (is_valid_state(value) &&
+				    save_state(value) == SERVER_OK)
+				       ? ACK
+				       : NACK;
+			break;
+		case GET_UPDATE_STATE:
+			msg.data.msg[0] = get_state();
+			msg.type = ACK;
+			break;
+		case SET_SWUPDATE_VARS:
+			msg.type = swupdate_vars_set(msg.data.vars.varname,
+					  strlen(msg.data.vars.varvalue) ? msg.data.vars.varvalue : NULL,
+					  msg.data.vars.varnamespace) == 0 ? ACK : NACK;
+			break;
+		case GET_SWUPDATE_VARS:
+			varvalue = swupdate_vars_get(msg.data.vars.varname,
+					  msg.data.vars.varnamespace);
+			memset(msg.data.vars.varvalue, 0, sizeof(msg.data.vars.varvalue));
+			if (varvalue) {
+				strlcpy(msg.data.vars.varvalue, varvalue, sizeof(msg.data.vars.varvalue));
+				free(varvalue);
+				msg.type = ACK;
+			} else
+				msg.type = NACK;
+			break;
+		default:
+			msg.type = NACK;
+		}
+	} else {
+		/* Wrong request */
+		msg.type = NACK;
+		sprintf(msg.data.msg, "Wrong request: aborting");
 	}
 
-	thread_ready();
-	do {
+	if (msg.type == ACK || msg.type == NACK) {
+		ret = ipc_frame_write(ctrlconnfd, &msg, framed);
+		if (ret < 0)
+			ERROR("Error write on socket ctrl: %s", strerror(errno));
+
+		if (should_close_socket == true)
+			close(ctrlconnfd);
+	}
+}
+
+static void ctrl_accept(int epollfd, int ctrllisten)
+{
+	struct sockaddr_un cliaddr;
+	socklen_t clilen;
+	struct epoll_event ev;
+	struct ctrl_conn *conn;
+	int ctrlconnfd;
+
+	for (;;) {
 		clilen = sizeof(cliaddr);
-		if ( (ctrlconnfd = accept(ctrllisten, (struct sockaddr *) &cliaddr, &clilen)) < 0) {
+		ctrlconnfd = accept(ctrllisten, (struct sockaddr *) &cliaddr, &clilen);
+		if (ctrlconnfd < 0) {
 			if (errno == EINTR)
 				continue;
-			else {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
 				TRACE("Accept returns: %s", strerror(errno));
-				continue;
-			}
+			return;
 		}
 		if (fcntl(ctrlconnfd, F_SETFD, FD_CLOEXEC) < 0)
 			WARN("Could not set %d as cloexec: %s", ctrlconnfd, strerror(errno));
+		if (set_blocking(ctrlconnfd, false) < 0) {
+			ERROR("Could not set %d as non blocking: %s", ctrlconnfd, strerror(errno));
+			close(ctrlconnfd);
+			continue;
+		}
 
-		nread = read(ctrlconnfd, (void *)&msg, sizeof(msg));
-
-		if (nread != sizeof(msg)) {
-			TRACE("IPC message too short: fragmentation not supported (read %d bytes, expected %zu bytes)",
-				nread, sizeof(msg));
+		conn = (struct ctrl_conn *)calloc(1, sizeof(*conn));
+		if (!conn) {
+			ERROR("Out of memory, skipping...");
 			close(ctrlconnfd);
 			continue;
 		}
+		conn->fd = ctrlconnfd;
+		conn->started = monotonic_seconds();
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ctrlconnfd, &ev) < 0) {
+			ERROR("Cannot watch ctrl connection: %s", strerror(errno));
+			close(ctrlconnfd);
+			free(conn);
+			continue;
+		}
+		LIST_INSERT_HEAD(&ctrl_conns, conn, next);
+		if (__atomic_add_fetch(&ctrl_pending, 1, __ATOMIC_RELAXED) >=
+		    CTRL_MAX_PENDING)
+			return;
+	}
+}
 
-		should_close_socket = true;
-		pthread_mutex_lock(&stream_mutex);
-		if (msg.magic == IPC_MAGIC)  {
-			switch (msg.type) {
-			case POST_UPDATE:
-				if (postupdate(get_swupdate_cfg(),
-							   msg.data.procmsg.len > 0 ? msg.data.procmsg.buf : NULL) == 0) {
-					msg.type = ACK;
-					sprintf(msg.data.msg, "Post-update actions successfully executed.");
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Post-update actions failed.");
-				}
-				break;
-			case SWUPDATE_SUBPROCESS:
-				subprocess_msg = (struct subprocess_msg_elem*)malloc(
-						sizeof(struct subprocess_msg_elem));
-				if (subprocess_msg == NULL) {
-					ERROR("Cannot handle subprocess IPC because of OOM.");
-					msg.type = NACK;
-					break;
-				}
+static bool ctrl_msg_is_slow(const ipc_message *msg)
+{
+	if (msg->magic != IPC_MAGIC)
+		return false;
 
-				should_close_socket = false;
-				subprocess_msg->client = ctrlconnfd;
-				subprocess_msg->message = msg;
-
-				pthread_mutex_lock(&subprocess_msg_lock);
-				SIMPLEQ_INSERT_TAIL(&subprocess_messages, subprocess_msg, next);
-				pthread_cond_signal(&subprocess_wkup);
-				pthread_mutex_unlock(&subprocess_msg_lock);
-				/*
-				 * ACK/NACK will be inserted by the called SUBPROCESS
-				 * It should not be touched here.
-				 * We leave the type as is and delegate the socket to a
-				 * dedicated processing thread.
-				 */
+	switch (msg->type) {
+	case POST_UPDATE:
+	case REQ_INSTALL:
+	case SET_UPDATE_STATE:
+		return true;
+	default:
+		return false;
+	}
+}
 
-				break;
-			case REQ_INSTALL:
-				TRACE("Incoming network request: processing...");
-				if (instp->status == IDLE) {
-					instp->fd = ctrlconnfd;
-					instp->req = msg.data.instmsg.req;
-					if ((instp->req.apiversion == SWUPDATE_API_VERSION) &&
-					    (is_selection_allowed(instp->req.software_set,
-								  instp->req.running_mode,
-								  &instp->software->accepted_set))) {
-						/*
-						 * Prepare answer
-						 */
-						msg.type = ACK;
-						memset(msg.data.msg, 0, sizeof(msg.data.msg));
-						should_close_socket = false;
-
-						/* Drop all old notification from last run */
-						cleanum_msg_list();
-
-						/* Wake-up the installer */
-						stream_wkup = true;
-						pthread_cond_signal(&stream_cond);
-					} else {
-						msg.type = NACK;
-						memset(msg.data.msg, 0, sizeof(msg.data.msg));
-					}
-				} else {
-					msg.type = NACK;
-					sprintf(msg.data.msg, "Installation in progress");
-				}
-				break;
-			case GET_STATUS:
-				msg.type = ACK;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
-
-				/* Get first notification from the queue */
-				pthread_mutex_lock(&msglock);
-				notification = SIMPLEQ_FIRST(&notifymsgs);
-				if (notification) {
-					SIMPLEQ_REMOVE_HEAD(&notifymsgs, next);
-					nrmsgs--;
-					strncpy(msg.data.status.desc, notification->msg,
-						sizeof(msg.data.status.desc) - 1);
-					msg.data.status.current = notification->status;
-					msg.data.status.error = notification->error;
-				}
-				pthread_mutex_unlock(&msglock);
+static void *ctrl_worker_thread(void *data)
+{
+	struct installer *instp = (struct installer *)data;
+	struct ctrl_work *work;
 
-				break;
-			case NOTIFY_STREAM:
-				msg.type = ACK;
-				memset(msg.data.msg, 0, sizeof(msg.data.msg));
-				msg.data.status.current = instp->status;
-				msg.data.status.last_result = instp->last_install;
-				msg.data.status.error = instp->last_error;
+	thread_ready();
 
-				ret = write(ctrlconnfd, &msg, sizeof(msg));
-				msg.type = NOTIFY_STREAM;
-				if (ret < 0) {
-					ERROR("Error write notify ack on socket ctrl");
-					close(ctrlconnfd);
-					break;
-				}
+	pthread_mutex_lock(&ctrl_work_lock);
+	for (;;) {
+		while (SIMPLEQ_EMPTY(&ctrl_works))
+			pthread_cond_wait(&ctrl_work_cond, &ctrl_work_lock);
+		work = SIMPLEQ_FIRST(&ctrl_works);
+		SIMPLEQ_REMOVE_HEAD(&ctrl_works, next);
+		pthread_mutex_unlock(&ctrl_work_lock);
 
-				/* Send notify history */
-				pthread_mutex_lock(&msglock);
-				ret = 0;
-				SIMPLEQ_FOREACH_SAFE(notification, &notifymsgs, next, tmp) {
-					memset(msg.data.msg, 0, sizeof(msg.data.msg));
+		handle_ctrl_msg(instp, work->fd, &work->msg, work->framed);
+		free(work);
+		__atomic_sub_fetch(&ctrl_pending, 1, __ATOMIC_RELAXED);
 
-					strncpy(msg.data.notify.msg, notification->msg,
-							sizeof(msg.data.notify.msg) - 1);
-					msg.data.notify.status = notification->status;
-					msg.data.notify.error = notification->error;
-					msg.data.notify.level = notification->level;
+		pthread_mutex_lock(&ctrl_work_lock);
+	}
 
-					ret = write_notify_msg(&msg, ctrlconnfd);
-					if (ret < 0) {
-						break;
-					}
-				}
-				if (ret < 0) {
-					pthread_mutex_unlock(&msglock);
-					ERROR("Error write notify history on socket ctrl");
-					close(ctrlconnfd);
-					break;
-				}
+	return NULL;
+}
 
-				/*
-				 * Save the new connection to send notifications to
-				 */
-				conn = (struct notify_conn *)calloc(1, sizeof(*conn));
-				if (!conn) {
-					pthread_mutex_unlock(&msglock);
-					ERROR("Out of memory, skipping...");
-					close(ctrlconnfd);
-					pthread_mutex_unlock(&stream_mutex);
-					continue;
-				}
-				conn->sockfd = ctrlconnfd;
-				SIMPLEQ_INSERT_TAIL(&notify_conns, conn, next);
-				pthread_mutex_unlock(&msglock);
+/* returns false if the request must be served by the caller */
+static bool ctrl_queue_work(int fd, const ipc_message *msg, bool framed)
+{
+	struct ctrl_work *work = malloc(sizeof(*work));
 
-				break;
-			case SET_AES_KEY:
-#ifndef CONFIG_PKCS11
-				msg.type = ACK;
-				if (set_aes_key(msg.data.aeskeymsg.key_ascii, msg.data.aeskeymsg.ivt_ascii))
-#endif
-					msg.type = NACK;
-				break;
-			case SET_VERSIONS_RANGE:
-				msg.type = ACK;
-				set_version_range(msg.data.versions.minimum_version,
-						  msg.data.versions.maximum_version,
-						  msg.data.versions.current_version);
-				break;
-			case GET_HW_REVISION:
-				cfg = get_swupdate_cfg();
-				if (get_hw_revision(&cfg->hw) < 0) {
-					msg.type = NACK;
-					memset(msg.data.msg, 0, sizeof(msg.data.msg));
-					break;
-				}
-				msg.type = ACK;
-				memset(msg.data.revisions.boardname, 0, sizeof(msg.data.revisions.boardname));
-				strncpy(msg.data.revisions.boardname, cfg->hw.boardname,
-					sizeof(msg.data.revisions.boardname) - 1);
-				memset(msg.data.revisions.revision, 0, sizeof(msg.data.revisions.revision));
-				strncpy(msg.data.revisions.revision, cfg->hw.revision,
-					sizeof(msg.data.revisions.revision) - 1);
-				break;
-			case SET_UPDATE_STATE:
-				value = *(update_state_t *)msg.data.msg;
-				msg.type = (is_valid_state(value) &&
-					    save_state(value) == SERVER_OK)
-					       ? ACK
-					       : NACK;
-				break;
-			case GET_UPDATE_STATE:
-				msg.data.msg[0] = get_state();
-				msg.type = ACK;
-				break;
-			case SET_SWUPDATE_VARS:
-				msg.type = swupdate_vars_set(msg.data.vars.varname,
-						  strlen(msg.data.vars.varvalue) ? msg.data.vars.varvalue : NULL,
-						  msg.data.vars.varnamespace) == 0 ? ACK : NACK;
-				break;
-			case GET_SWUPDATE_VARS:
-				varvalue = swupdate_vars_get(msg.data.vars.varname,
-						  msg.data.vars.varnamespace);
-				memset(msg.data.vars.varvalue, 0, sizeof(msg.data.vars.varvalue));
-				if (varvalue) {
-					strlcpy(msg.data.vars.varvalue, varvalue, sizeof(msg.data.vars.varvalue));
-					free(varvalue);
-					msg.type = ACK;
-				} else
-					msg.type = NACK;
-				break;
-			default:
-				msg.type = NACK;
-			}
-		} else {
-			/* Wrong request */
-			msg.type = NACK;
-			sprintf(msg.data.msg, "Wrong request: aborting");
+	if (!work)
+		return false;
+	work->fd = fd;
+	work->msg = *msg;
+	work->framed = framed;
+
+	__atomic_add_fetch(&ctrl_pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&ctrl_work_lock);
+	SIMPLEQ_INSERT_TAIL(&ctrl_works, work, next);
+	pthread_cond_signal(&ctrl_work_cond);
+	pthread_mutex_unlock(&ctrl_work_lock);
+
+	return true;
+}
+
+static void ctrl_read(struct installer *instp, int epollfd, struct ctrl_conn *conn)
+{
+	ssize_t n, size;
+	ipc_message msg;
+	int fd, framed;
+
+	/*
+	 * Read just the bytes belonging to the request, the
+	 * size is known after the header (framed) or the magic
+	 * (legacy) is received
+	 */
+	size = ipc_frame_size(conn->buf, conn->nread);
+	if (size < 0) {
+		TRACE("IPC message with invalid frame, dropping it");
+		ctrl_conn_free(epollfd, conn, true);
+		return;
+	}
+
+	do {
+		n = read(conn->fd, conn->buf + conn->nread, size - conn->nread);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if (n <= 0) {
+		if (conn->nread)
+			TRACE("IPC message too short (read %zu bytes, expected %zd bytes)",
+				conn->nread, size);
+		ctrl_conn_free(epollfd, conn, true);
+		return;
+	}
+
+	conn->nread += (size_t)n;
+	size = ipc_frame_size(conn->buf, conn->nread);
+	if (size < 0 || conn->nread < (size_t)size)
+		return;
+
+	framed = ipc_frame_decode(conn->buf, conn->nread, &msg);
+
+	/*
+	 * Request is complete: the socket leaves the event loop
+	 * and it is switched back to blocking, because it can be
+	 * passed to the installer or to other threads.
+	 */
+	fd = conn->fd;
+	ctrl_conn_free(epollfd, conn, false);
+	if (framed < 0 || set_blocking(fd, true) < 0) {
+		ERROR("Cannot process IPC request on %d", fd);
+		close(fd);
+		return;
+	}
+
+	if (ctrl_msg_is_slow(&msg) && ctrl_queue_work(fd, &msg, framed > 0))
+		return;
+
+	handle_ctrl_msg(instp, fd, &msg, framed > 0);
+}
+
+/*
+ * Stop accepting while too many requests are pending, the clients
+ * wait in the listen backlog meanwhile.
+ */
+static void ctrl_throttle(int epollfd, int ctrllisten, bool *accepting)
+{
+	struct epoll_event ev;
+	bool accept_now = __atomic_load_n(&ctrl_pending, __ATOMIC_RELAXED) <
+			  CTRL_MAX_PENDING;
+
+	if (accept_now == *accepting)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = accept_now ? EPOLLIN : 0;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epollfd, EPOLL_CTL_MOD, ctrllisten, &ev) == 0)
+		*accepting = accept_now;
+}
+
+/*
+ * Drop connections that did not send a complete request in time
+ */
+static void ctrl_expire(int epollfd)
+{
+	struct ctrl_conn *conn, *tmp;
+	time_t now = monotonic_seconds();
+
+	LIST_FOREACH_SAFE(conn, &ctrl_conns, next, tmp) {
+		if (now - conn->started > DEFAULT_INTERNAL_TIMEOUT) {
+			TRACE("IPC client timed out, closing connection");
+			ctrl_conn_free(epollfd, conn, true);
 		}
+	}
+}
 
-		if (msg.type == ACK || msg.type == NACK) {
-			ret = write(ctrlconnfd, &msg, sizeof(msg));
-			if (ret < 0)
-				ERROR("Error write on socket ctrl: %s", strerror(errno));
+void *network_thread (void *data)
+{
+	struct installer *instp = (struct installer *)data;
+	int ctrllisten, epollfd;
+	struct epoll_event ev, events[CTRL_MAX_EVENTS];
+	int nfds, i;
+	bool accepting = true;
 
-			if (should_close_socket == true)
-				close(ctrlconnfd);
+	if (!instp) {
+		TRACE("Fatal error: Network thread aborting...");
+		return (void *)0;
+	}
+
+	SIMPLEQ_INIT(&notify_conns);
+	SIMPLEQ_INIT(&notify_new_conns);
+	SIMPLEQ_INIT(&subprocess_messages);
+	SIMPLEQ_INIT(&ctrl_works);
+	LIST_INIT(&ctrl_conns);
+
+	sigset_t sigpipe_mask;
+	sigemptyset(&sigpipe_mask);
+	sigaddset(&sigpipe_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, NULL);
+
+	notify_ring_init();
+	notify_delivery_thread_id = start_thread(notify_delivery_thread, NULL);
+	register_notifier(network_notifier);
+
+	subprocess_ipc_handler_thread_id = start_thread(subprocess_thread, NULL);
+	start_thread(ctrl_worker_thread, instp);
+
+	/* Initialize and bind to UDS */
+	ctrllisten = listener_create(get_ctrl_socket(), SOCK_STREAM);
+	if (ctrllisten < 0 ) {
+		ERROR("Error creating IPC control socket");
+		exit(2);
+	}
+
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd < 0 || set_blocking(ctrllisten, false) < 0) {
+		ERROR("Error setting up IPC event loop: %s", strerror(errno));
+		exit(2);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ctrllisten, &ev) < 0) {
+		ERROR("Error watching IPC control socket: %s", strerror(errno));
+		exit(2);
+	}
+
+	thread_ready();
+	do {
+		nfds = epoll_wait(epollfd, events, CTRL_MAX_EVENTS,
+				  LIST_EMPTY(&ctrl_conns) && accepting ? -1 : 1000);
+		if (nfds < 0) {
+			if (errno != EINTR)
+				TRACE("epoll_wait returns: %s", strerror(errno));
+			continue;
 		}
-		pthread_mutex_unlock(&stream_mutex);
+
+		for (i = 0; i < nfds; i++) {
+			if (!events[i].data.ptr)
+				ctrl_accept(epollfd, ctrllisten);
+			else
+				ctrl_read(instp, epollfd,
+					  (struct ctrl_conn *)events[i].data.ptr);
+		}
+
+		ctrl_expire(epollfd);
+		ctrl_throttle(epollfd, ctrllisten, &accepting);
 	} while (1);
 	return (void *)0;
 }
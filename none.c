@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include "bootloader.h"
+#include "bootloader_txn.h"
 #include "swupdate_dict.h"
 
 static struct dict environment;
@@ -44,6 +45,45 @@ static int do_apply_list(const char *filename)
 	return dict_parse_script(&environment, filename);
 }
 
+/*
+ * The environment lives in RAM, there is nothing to flush.
+ * A transaction keeps a copy to restore on abort.
+ */
+static struct dict saved;
+
+static void env_copy(struct dict *dst, struct dict *src)
+{
+	struct dict_entry *entry;
+
+	LIST_FOREACH(entry, src, next)
+		dict_set_value(dst, dict_entry_get_key(entry),
+			       dict_entry_get_value(entry));
+}
+
+static int do_env_begin(void)
+{
+	dict_drop_db(&saved);
+	env_copy(&saved, &environment);
+
+	return 0;
+}
+
+static int do_env_commit(void)
+{
+	dict_drop_db(&saved);
+
+	return 0;
+}
+
+static int do_env_abort(void)
+{
+	dict_drop_db(&environment);
+	env_copy(&environment, &saved);
+	dict_drop_db(&saved);
+
+	return 0;
+}
+
 static bootloader none = {
 	.env_get = &do_env_get,
 	.env_set = &do_env_set,
@@ -51,8 +91,15 @@ static bootloader none = {
 	.apply_list = &do_apply_list
 };
 
+static bootloader_txn none_txn = {
+	.begin = &do_env_begin,
+	.commit = &do_env_commit,
+	.abort = &do_env_abort
+};
+
 __attribute__((constructor))
 static void none_probe(void)
 {
-	(void)register_bootloader(BOOTLOADER_NONE, &none);
+	if (!register_bootloader(BOOTLOADER_NONE, &none))
+		(void)register_bootloader_txn(BOOTLOADER_NONE, &none_txn);
 }
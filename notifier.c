@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
@@ -18,6 +19,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "bsdqueue.h"
 #include "swupdate_status.h"
@@ -63,6 +65,30 @@ struct notify_ipc_msg {
 static struct sockaddr_un notify_client;
 static struct sockaddr_un notify_server;
 static int notifyfd = -1;
+
+/*
+ * Messages from other processes are not sent one by one,
+ * they are collected and sent together with sendmmsg().
+ * The batch is flushed when it is full, when a status change,
+ * an error or a warning is logged or after NOTIFY_BATCH_TIMEOUT_MS.
+ * Only trace and info output of a process that is killed or calls
+ * _exit() within that time can be lost.
+ */
+#define NOTIFY_BATCH_SIZE	16
+#define NOTIFY_BATCH_TIMEOUT_MS	50
+
+static struct {
+	struct notify_ipc_msg msgs[NOTIFY_BATCH_SIZE];
+	unsigned int count;
+	bool urgent;
+	bool flusher_running;
+	unsigned long dropped;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} batch = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
 static bool console_priority_prefix = false;
 static bool console_ansi_colors = false;
 
@@ -214,6 +240,176 @@ int register_notifier(notifier client)
 	return 0;
 }
 
+static size_t notify_msg_len(const struct notify_ipc_msg *msg)
+{
+	return offsetof(struct notify_ipc_msg, buf) + strlen(msg->buf) + 1;
+}
+
+/*
+ * Send all collected messages, it must be called
+ * after acquiring the batch lock. Messages are dropped
+ * instead of blocking the process if the receiver is
+ * not fast enough, but errors are never lost.
+ */
+static void notify_batch_flush(void)
+{
+	struct mmsghdr mmsg[NOTIFY_BATCH_SIZE];
+	struct iovec iov[NOTIFY_BATCH_SIZE];
+	struct notify_ipc_msg *msg;
+	unsigned int i, sent = 0;
+	int n;
+
+	if (!batch.count)
+		return;
+
+	if (batch.dropped && batch.count < NOTIFY_BATCH_SIZE) {
+		msg = &batch.msgs[batch.count++];
+		msg->status = RUN;
+		msg->error = 0;
+		msg->level = WARNLEVEL;
+		snprintf(msg->buf, sizeof(msg->buf),
+			 "%lu notifications dropped, notifier too slow", batch.dropped);
+		batch.dropped = 0;
+	}
+
+	memset(mmsg, 0, sizeof(mmsg));
+	for (i = 0; i < batch.count; i++) {
+		iov[i].iov_base = &batch.msgs[i];
+		iov[i].iov_len = notify_msg_len(&batch.msgs[i]);
+		mmsg[i].msg_hdr.msg_name = &notify_server;
+		mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < batch.count) {
+		n = sendmmsg(notifyfd, &mmsg[sent], batch.count - sent,
+			     batch.urgent ? 0 : MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				fprintf(stderr, "notify() failed with error %d: %s\n",
+					errno, strerror(errno));
+			batch.dropped += batch.count - sent;
+			break;
+		}
+		sent += n;
+	}
+
+	batch.count = 0;
+	batch.urgent = false;
+}
+
+static void *notify_batch_thread(void __attribute__ ((__unused__)) *data)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&batch.lock);
+	for (;;) {
+		while (!batch.count)
+			pthread_cond_wait(&batch.cond, &batch.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += NOTIFY_BATCH_TIMEOUT_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (batch.count &&
+		       pthread_cond_timedwait(&batch.cond, &batch.lock, &deadline) != ETIMEDOUT)
+			;
+		notify_batch_flush();
+	}
+
+	return NULL;
+}
+
+/*
+ * A forked process must not inherit the lock held by a flusher
+ * thread that does not exist there, nor the pending messages of
+ * its parent, which would be sent twice.
+ */
+static void notify_batch_prepare(void)
+{
+	pthread_mutex_lock(&batch.lock);
+}
+
+static void notify_batch_parent(void)
+{
+	pthread_mutex_unlock(&batch.lock);
+}
+
+static void notify_batch_child(void)
+{
+	batch.count = 0;
+	batch.dropped = 0;
+	batch.urgent = false;
+	batch.flusher_running = false;
+	pthread_mutex_unlock(&batch.lock);
+}
+
+static void notify_batch_exit(void)
+{
+	pthread_mutex_lock(&batch.lock);
+	batch.urgent = true;
+	notify_batch_flush();
+	pthread_mutex_unlock(&batch.lock);
+}
+
+static void notify_batch_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&batch.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_atfork(notify_batch_prepare, notify_batch_parent,
+			   notify_batch_child) != 0)
+		fprintf(stderr, "Cannot register notifier fork handlers\n");
+	if (atexit(notify_batch_exit) != 0)
+		fprintf(stderr, "Cannot register notifier flush on exit\n");
+}
+
+static void notify_batch_add(RECOVERY_STATUS status, int error, int level, const char *msg)
+{
+	struct notify_ipc_msg *notifymsg;
+	pthread_t id;
+
+	pthread_mutex_lock(&batch.lock);
+	if (!batch.flusher_running) {
+		if (pthread_create(&id, NULL, notify_batch_thread, NULL) == 0) {
+			pthread_detach(id);
+			batch.flusher_running = true;
+		}
+	}
+
+	notifymsg = &batch.msgs[batch.count++];
+	notifymsg->status = status;
+	notifymsg->error = error;
+	notifymsg->level = level;
+	if (msg)
+		strlcpy(notifymsg->buf, msg, sizeof(notifymsg->buf) - 1);
+	else
+		notifymsg->buf[0] = '\0';
+
+	if (status != RUN || level == ERRORLEVEL || level == WARNLEVEL)
+		batch.urgent = true;
+
+	/*
+	 * Without the flusher thread, nothing is
+	 * delayed and messages are sent immediately
+	 */
+	if (batch.count == NOTIFY_BATCH_SIZE || batch.urgent ||
+	    !batch.flusher_running)
+		notify_batch_flush();
+	else if (batch.count == 1)
+		pthread_cond_signal(&batch.cond);
+	pthread_mutex_unlock(&batch.lock);
+}
+
 /*
  * Main function to send notification. It is checked
  * if it is sent by the main process, where the notifier
@@ -224,25 +420,10 @@ int register_notifier(notifier client)
 void notify(RECOVERY_STATUS status, int error, int level, const char *msg)
 {
 	struct notify_elem *elem;
-	struct notify_ipc_msg notifymsg;
 
 	if (pid == getpid()) {
-		if (notifyfd > 0) {
-			memset(&notifymsg, 0, sizeof(notifymsg));
-			notifymsg.status = status;
-			notifymsg.error = error;
-			notifymsg.level = level;
-			if (msg)
-				strlcpy(notifymsg.buf, msg, sizeof(notifymsg.buf) - 1);
-			else
-				notifymsg.buf[0] = '\0';
-			if (-1 == sendto(notifyfd, &notifymsg, sizeof(notifymsg), 0,
-					 (struct sockaddr *)&notify_server,
-					 sizeof(struct sockaddr_un))) {
-				fprintf(stderr, "notify() failed with error %d: %s\n",
-					errno, strerror(errno));
-			}
-		}
+		if (notifyfd > 0)
+			notify_batch_add(status, error, level, msg);
 	} else { /* Main process */
 		pthread_mutex_lock(&clients_mutex);
 		STAILQ_FOREACH(elem, &clients, next)
@@ -456,9 +637,12 @@ static void addr_init(struct sockaddr_un *addr, const char *path)
 static void *notifier_thread (void __attribute__ ((__unused__)) *data)
 {
 	int serverfd;
-	int len;
+	int n, i;
 	int attempt = 0;
-	struct notify_ipc_msg msg;
+	static struct notify_ipc_msg msgs[NOTIFY_BATCH_SIZE];
+	struct mmsghdr mmsg[NOTIFY_BATCH_SIZE];
+	struct iovec iov[NOTIFY_BATCH_SIZE];
+	struct notify_ipc_msg *msg;
 
 	/* Initialize and bind to UDS */
 	serverfd = socket(AF_UNIX, SOCK_DGRAM, 0);
@@ -509,14 +693,31 @@ static void *notifier_thread (void __attribute__ ((__unused__)) *data)
 
 	thread_ready();
 	do {
-		len =  recvfrom(serverfd, &msg, sizeof(msg), 0, NULL, NULL);
+		memset(mmsg, 0, sizeof(mmsg));
+		for (i = 0; i < NOTIFY_BATCH_SIZE; i++) {
+			iov[i].iov_base = &msgs[i];
+			iov[i].iov_len = sizeof(msgs[i]);
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1;
+		}
+
 		/*
-		 * Force msg.buf to be Null Terminated
+		 * Wait for the first message, then take
+		 * all the others already queued
 		 */
-		msg.buf [sizeof(msg.buf) - 1] = '\0';
-
-		if (len > 0) {
-			notify(msg.status, msg.error, msg.level, msg.buf);
+		n = recvmmsg(serverfd, mmsg, NOTIFY_BATCH_SIZE, MSG_WAITFORONE, NULL);
+		for (i = 0; i < n; i++) {
+			msg = &msgs[i];
+			if (mmsg[i].msg_len <= offsetof(struct notify_ipc_msg, buf))
+				continue;
+			/*
+			 * Force msg.buf to be Null Terminated, just
+			 * the used part of the buffer is sent
+			 */
+			((char *)msg)[mmsg[i].msg_len - 1] = '\0';
+			msg->buf[sizeof(msg->buf) - 1] = '\0';
+
+			notify(msg->status, msg->error, msg->level, msg->buf);
 		}
 
 	} while(1);
@@ -579,6 +780,7 @@ void notify_init(void)
 			close(notifyfd);
 			return;
 		}
+		pthread_once(&batch_once, notify_batch_init);
 #if defined(__FreeBSD__)
 		/*
 		 * Note: atexit(unlink_socket) "callback" is inherited from parent,
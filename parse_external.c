@@ -22,6 +22,7 @@
 #include "lualib.h"
 #include "util.h"
 #include "lua_util.h"
+#include "arena.h"
 #ifndef CONFIG_SETEXTPARSERNAME
 #define LUA_PARSER	"lua-tools/extparser.lua"
 #else
@@ -165,7 +166,7 @@ int parse_external(struct swupdate_cfg *software, const char *filename,
 
 		if (lua_type(L, -1) == LUA_TTABLE) {
 			lua_pushnil(L);
-			image = (struct img_type *)calloc(1, sizeof(struct img_type));
+			image = (struct img_type *)update_alloc(sizeof(struct img_type));
 			if (!image) {
 				ERROR( "No memory: malloc failed");
 				return -ENOMEM;
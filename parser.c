@@ -25,6 +25,9 @@
 #include "parsers.h"
 #include "swupdate_dict.h"
 #include "lua_util.h"
+#include "arena.h"
+#include "swver_index.h"
+#include "version_key.h"
 
 #define MODULE_NAME	"PARSER"
 
@@ -50,19 +53,36 @@ static bool path_append(const char **nodes, const char *field)
 	return true;
 }
 
-static void *find_node_and_path(parsertype p, void *root, const char *field,
-			struct swupdate_cfg *swcfg, const char **nodes)
+/*
+ * Roots to be searched for the current board and selection,
+ * in order of priority:
+ *	software.<board>.<set>.<mode>
+ *	software.<set>.<mode>
+ *	software.<board>
+ *	software
+ * Just the ones present in the document are stored. They are
+ * resolved once, then every section is looked up directly
+ * from them.
+ */
+#define MAX_SELECTION_ROOTS	4
+
+static struct {
+	void *doc;
+	unsigned int count;
+	const char *paths[MAX_SELECTION_ROOTS][MAX_PARSED_NODES];
+} roots;
+
+static void resolve_selection_roots(parsertype p, void *root, struct swupdate_cfg *swcfg)
 {
-	struct hw_type *hardware;
-	void *node = NULL;
+	struct hw_type *hardware = &swcfg->hw;
+	const char **nodes;
 	int i;
 
-	if (!field)
-		return NULL;
+	roots.doc = root;
+	roots.count = 0;
 
-	hardware = &swcfg->hw;
-
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < MAX_SELECTION_ROOTS; i++) {
+		nodes = roots.paths[roots.count];
 		nodes[0] = NULL;
 		switch(i) {
 		case 0:
@@ -100,59 +120,178 @@ static void *find_node_and_path(parsertype p, void *root, const char *field,
 		}
 
 		/*
-		 * If conditions are not set,
-		 * skip to the next option
+		 * If conditions are not set or the root is not
+		 * in the document, skip to the next option
 		 */
-		if (!nodes[0])
-			continue;
+		if (nodes[0] && find_root(p, root, nodes))
+			roots.count++;
+	}
+}
 
-		/*
-		 * The first find_root() search for
-		 * the root element from board, selection
-		 * The second one starts from root and follow the tree
-		 * to search for element
-		 */
-		if (find_root(p, root, nodes)) {
-			if (!path_append(nodes, field))
-				return NULL;
-			node = find_root(p, root, nodes);
+static void *find_node_and_path(parsertype p, void *root, const char *field,
+			struct swupdate_cfg *swcfg, const char **nodes)
+{
+	void *node = NULL;
+	unsigned int i, j;
 
-			if (node) {
-				return node;
-			}
+	if (!field)
+		return NULL;
+
+	if (roots.doc != root)
+		resolve_selection_roots(p, root, swcfg);
+
+	/*
+	 * Search the element starting from each root
+	 * and following the tree
+	 */
+	for (i = 0; i < roots.count; i++) {
+		for (j = 0; roots.paths[i][j]; j++)
+			nodes[j] = roots.paths[i][j];
+		nodes[j] = NULL;
+
+		if (!path_append(nodes, field))
+			return NULL;
+		node = find_root(p, root, nodes);
+
+		if (node) {
+			return node;
 		}
 	}
 
 	return NULL;
 }
 
+/*
+ * Links already resolved during this parse, indexed by
+ * the path of the element with "ref" and the ref itself.
+ * Entries and keys live in an arena released after the parse.
+ */
+#define LINK_CACHE_BUCKETS	64
+#define LINK_CACHE_CHUNK	(16 * 1024)
+
+struct link_cache_entry {
+	char *key;
+	void *link;
+	const char *nodes[MAX_PARSED_NODES];
+	LIST_ENTRY(link_cache_entry) next;
+};
+
+LIST_HEAD(link_cache_list, link_cache_entry);
+static struct link_cache_list link_cache[LINK_CACHE_BUCKETS];
+static struct arena link_arena = {
+	.chunks = NULL,
+	.chunk_size = LINK_CACHE_CHUNK,
+};
+
+static unsigned int link_cache_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h % LINK_CACHE_BUCKETS;
+}
+
+static char *link_cache_key(const char **nodes, const char *ref)
+{
+	size_t len = strlen(ref) + 2;
+	char *key;
+	int i;
+
+	for (i = 0; nodes[i]; i++)
+		len += strlen(nodes[i]) + 1;
+
+	key = (char *)arena_alloc(&link_arena, len);
+	if (!key)
+		return NULL;
+
+	key[0] = '\0';
+	for (i = 0; nodes[i]; i++) {
+		strcat(key, nodes[i]);
+		strcat(key, "/");
+	}
+	strcat(key, "#");
+	strcat(key, ref);
+
+	return key;
+}
+
+static void link_cache_drop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < LINK_CACHE_BUCKETS; i++)
+		LIST_INIT(&link_cache[i]);
+	arena_release(&link_arena);
+}
+
+static struct link_cache_entry *link_cache_lookup(parsertype p, void *cfg,
+						  const char **nodes, const char *ref,
+						  int *err)
+{
+	struct link_cache_entry *entry;
+	unsigned int bucket;
+	char *key;
+	int j;
+
+	*err = 0;
+	if (!ref) {
+		*err = -1;
+		return NULL;
+	}
+
+	key = link_cache_key(nodes, ref);
+	if (!key) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	bucket = link_cache_hash(key);
+	LIST_FOREACH(entry, &link_cache[bucket], next) {
+		if (!strcmp(entry->key, key))
+			return entry;
+	}
+
+	entry = (struct link_cache_entry *)arena_alloc(&link_arena, sizeof(*entry));
+	if (!entry) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	TRACE("Link found, following %s", ref);
+	for (j = 0; j < count_string_array(nodes); j++) {
+		entry->nodes[j] = nodes[j];
+	}
+	if (!set_find_path(entry->nodes, ref)) {
+		*err = -1;
+		return NULL;
+	}
+
+	entry->key = key;
+	entry->link = find_root(p, cfg, entry->nodes);
+	LIST_INSERT_HEAD(&link_cache[bucket], entry, next);
+
+	return entry;
+}
+
 static int parser_follow_link(parsertype p, void *cfg, void *elem,
 				const char **nodes, struct swupdate_cfg *swcfg,
 				parse_element fn, lua_State *L)
 {
-	const char *ref;
-	void *link;
-	const char **linknodes;
+	struct link_cache_entry *entry;
 	int result = 0;
 
-	ref = get_field_string(p, elem, "ref");
-	linknodes = (const char **)calloc(MAX_PARSED_NODES, sizeof(*nodes));
-	if (!linknodes)
-		return -ENOMEM;
-	TRACE("Link found, following %s", ref);
-	for (int j = 0; j < count_string_array(nodes); j++) {
-		linknodes[j] = nodes[j];
-	}
-	if (!set_find_path(linknodes, ref)) {
-		free(linknodes);
-		return -1;
-	}
+	entry = link_cache_lookup(p, cfg, nodes, get_field_string(p, elem, "ref"),
+				  &result);
+	if (!entry)
+		return result;
 
-	link = find_root(p, cfg, linknodes);
-	if (link) {
-		result = fn(p, cfg, link, linknodes, swcfg, L);
+	if (entry->link) {
+		result = fn(p, cfg, entry->link, entry->nodes, swcfg, L);
 	}
-	free(linknodes);
 	return result;
 }
 
@@ -175,6 +314,8 @@ static bool get_common_fields(parsertype p, void *cfg, struct swupdate_cfg *swcf
 
 	void *setting;
 
+	resolve_selection_roots(p, cfg, swcfg);
+
 	if((setting = find_node(p, cfg, "version", swcfg)) == NULL) {
 		ERROR("Missing version in configuration file");
 		return false;
@@ -248,7 +389,7 @@ static void add_properties_cb(const char *name, const char *value, void *data)
 		return;
 
 	TRACE("\t\tProperty %s: %s", name, value);
-	if (dict_insert_value(&image->properties, (char *)name, (char *)value))
+	if (update_dict_insert_value(&image->properties, name, value))
 		ERROR("Property not stored, skipping...");
 }
 
@@ -294,7 +435,7 @@ static int parse_hw_compatibility(parsertype p, void *cfg, struct swupdate_cfg *
 		if (!strlen(s))
 			continue;
 
-		hwrev = (struct hw_type *)calloc(1, sizeof(struct hw_type));
+		hwrev = (struct hw_type *)update_alloc(sizeof(struct hw_type));
 		if (!hwrev) {
 			ERROR("No memory: malloc failed");
 			return -1;
@@ -320,6 +461,7 @@ static int is_image_installed(struct swver *sw_ver_list,
                               struct img_type *img)
 {
     struct sw_version *swver;
+    struct version_key imgkey;
 
     if (!sw_ver_list)
         return false;
@@ -328,12 +470,13 @@ static int is_image_installed(struct swver *sw_ver_list,
         !img->id.install_if_different)
         return false;
 
-    LIST_FOREACH(swver, sw_ver_list, next) {
+    version_key_parse(img->id.version, &imgkey);
+    for (swver = swver_find(sw_ver_list, img->id.name); swver;
+         swver = swver_find_next(sw_ver_list, swver)) {
         /*
-         * Check if name and version are identical
+         * Check if version is identical
          */
-        if (!strncmp(img->id.name, swver->name, sizeof(img->id.name)) &&
-            !compare_versions(img->id.version, swver->version)) {
+        if (!compare_version_keys(&imgkey, swver_key(swver))) {
             TRACE("%s(%s) already installed, skipping...",
                   img->id.name,
                   img->id.version);
@@ -349,6 +492,7 @@ static int is_image_higher(struct swver *sw_ver_list,
                            struct img_type *img)
 {
     struct sw_version *swver;
+    struct version_key proposed;
 
     if (!sw_ver_list)
         return false;
@@ -357,16 +501,13 @@ static int is_image_higher(struct swver *sw_ver_list,
         !img->id.install_if_higher)
         return false;
 
-    LIST_FOREACH(swver, sw_ver_list, next) {
-        const char* current_version = swver->version;
-        const char* proposed_version = img->id.version;
-
+    version_key_parse(img->id.version, &proposed);
+    for (swver = swver_find(sw_ver_list, img->id.name); swver;
+         swver = swver_find_next(sw_ver_list, swver)) {
         /*
-         * Check if name are identical and the new version is lower
-         * or equal.
+         * Check if the new version is lower or equal.
          */
-        if (!strncmp(img->id.name, swver->name, sizeof(img->id.name)) &&
-            (compare_versions(proposed_version, current_version) <= 0)) {
+        if (compare_version_keys(&proposed, swver_key(swver)) <= 0) {
             TRACE("%s(%s) has a higher or same version installed, skipping...",
                   img->id.name,
                   img->id.version);
@@ -497,7 +638,7 @@ static int _parse_partitions(parsertype p, void *cfg, void *setting, const char
 			continue;
 		}
 
-		partition = (struct img_type *)calloc(1, sizeof(struct img_type));
+		partition = (struct img_type *)update_alloc(sizeof(struct img_type));
 		if (!partition) {
 			ERROR("No memory: malloc failed");
 			return -ENOMEM;
@@ -590,7 +731,7 @@ static int _parse_scripts(parsertype p, void *cfg, void *setting, const char **n
 		if(!(exist_field_string(p, elem, "filename")))
 			TRACE("Script entry without filename field.");
 
-		script = (struct img_type *)calloc(1, sizeof(struct img_type));
+		script = (struct img_type *)update_alloc(sizeof(struct img_type));
 		if (!script) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -690,7 +831,7 @@ static int _parse_bootloader(parsertype p, void *cfg, void *setting, const char
 			return -1;
 		}
 		if (!skip) {
-			dict_set_value(&swcfg->bootloader, dummy.id.name, dummy.id.version);
+			update_dict_set_value(&swcfg->bootloader, dummy.id.name, dummy.id.version);
 			TRACE("Bootloader var: %s = %s",
 				dummy.id.name,
 				dict_get_value(&swcfg->bootloader, dummy.id.name));
@@ -769,7 +910,7 @@ static int _parse_vars(parsertype p, void *cfg, void *setting, const char **node
 		/*
 		 * Store the variable in dictionary
 		 */
-		dict_set_value(&swcfg->vars, dummy.id.name, dummy.id.version);
+		update_dict_set_value(&swcfg->vars, dummy.id.name, dummy.id.version);
 
 		TRACE("SWUpdate var: %s = %s",
 		       dummy.id.name,
@@ -823,7 +964,7 @@ static int _parse_images(parsertype p, void *cfg, void *setting, const char **no
 			continue;
 		}
 
-		image = (struct img_type *)calloc(1, sizeof(struct img_type));
+		image = (struct img_type *)update_alloc(sizeof(struct img_type));
 		if (!image) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -923,7 +1064,7 @@ static int _parse_files(parsertype p, void *cfg, void *setting, const char **nod
 			continue;
 		}
 
-		file = (struct img_type *)calloc(1, sizeof(struct img_type));
+		file = (struct img_type *)update_alloc(sizeof(struct img_type));
 		if (!file) {
 			ERROR( "No memory: malloc failed");
 			return -ENOMEM;
@@ -1018,6 +1159,9 @@ static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 		TRACE("Hardware compatibility not found");
 	}
 
+	/* board name can be known now, roots must be checked again */
+	resolve_selection_roots(p, cfg, swcfg);
+
 	/* Now parse the single elements */
 	ret = parse_hw_compatibility(p, cfg, swcfg) ||
 		parse_files(p, cfg, swcfg, L) ||
@@ -1032,6 +1176,9 @@ static int parser(parsertype p, void *cfg, struct swupdate_cfg *swcfg)
 	 */
 	parse_partitions(p, cfg, swcfg, L);
 
+	link_cache_drop();
+	roots.doc = NULL;
+
 	if (LIST_EMPTY(&swcfg->images) &&
 	    LIST_EMPTY(&swcfg->scripts) &&
 	    LIST_EMPTY(&swcfg->bootloader)) {
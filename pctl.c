@@ -11,6 +11,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
@@ -41,6 +44,24 @@ typedef struct {
 static struct swupdate_task procs[MAX_PROCESSES];
 static int    nprocs = 0;
 
+/*
+ * Subprocesses are watched through a pidfd by the supervisor thread,
+ * sigchld_handler only serves the ones that could not be watched.
+ */
+static int supervisor_epfd = -1;
+static int pidfds[MAX_PROCESSES];
+static volatile sig_atomic_t supervised[MAX_PROCESSES];
+
+/* output of a background command is read in large chunks */
+#define CMD_OUTPUT_BUF_SIZE	(16 * 1024)
+
+struct cmd_output {
+	int fd;
+	LOGLEVEL level;
+	size_t len;
+	char buf[CMD_OUTPUT_BUF_SIZE];
+};
+
 /*
  * The global pid is used to identify if context is
  * the main process (SWUpdate, pid=0) or it is
@@ -119,6 +140,16 @@ void wait_threads_ready(void)
 	pthread_mutex_unlock(&threads_towait_lock);
 }
 
+static int pidfd_open_fd(pid_t process_id)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, process_id, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 /*
  * spawn_process forks and start a new process
  * under a new user
@@ -207,6 +238,105 @@ static int spawn_process(struct swupdate_task *task,
 	}
 }
 
+/*
+ * A subprocess has died: report it, stop all other subprocesses
+ * and let SWUpdate exit.
+ */
+static void *supervisor_thread(void __attribute__ ((__unused__)) *data)
+{
+	struct epoll_event events[MAX_PROCESSES];
+	int n, i, j, k, status;
+	pid_t childpid;
+
+	for (;;) {
+		n = epoll_wait(supervisor_epfd, events, MAX_PROCESSES, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("Supervisor awakened because of: %s", strerror(errno));
+			return NULL;
+		}
+
+		for (j = 0; j < n; j++) {
+			i = events[j].data.u32;
+			epoll_ctl(supervisor_epfd, EPOLL_CTL_DEL, pidfds[i], NULL);
+
+			childpid = waitpid(procs[i].pid, &status, 0);
+			if (childpid != procs[i].pid)
+				continue;
+
+			if (WIFEXITED(status)) {
+				exit_code = WEXITSTATUS(status);
+				ERROR("Child %d(%s) exited, status=%d", childpid,
+				      procs[i].name, exit_code);
+			} else {
+				exit_code = EXIT_FAILURE;
+				ERROR("Child %d(%s) killed by signal %d", childpid,
+				      procs[i].name, WTERMSIG(status));
+			}
+
+			for (k = 0; k < nprocs; k++) {
+				if (procs[k].pid != childpid)
+					kill(procs[k].pid, SIGTERM);
+			}
+			kill(getpid(), SIGTERM);
+			return NULL;
+		}
+	}
+}
+
+static int supervisor_start(void)
+{
+	pthread_t id;
+	pthread_attr_t attr;
+
+	supervisor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (supervisor_epfd < 0)
+		return -1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&id, &attr, supervisor_thread, NULL)) {
+		close(supervisor_epfd);
+		supervisor_epfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Watch a subprocess through its pidfd. On kernels without pidfd
+ * the SIGCHLD handler installed at startup is used instead.
+ */
+static void supervise_process(int i)
+{
+	struct epoll_event ev;
+
+	if (supervisor_epfd < 0 && supervisor_start() < 0)
+		return;
+
+	pidfds[i] = pidfd_open_fd(procs[i].pid);
+	if (pidfds[i] < 0) {
+		DEBUG("Cannot watch %s through a pidfd: %s", procs[i].name,
+		      strerror(errno));
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(supervisor_epfd, EPOLL_CTL_ADD, pidfds[i], &ev) < 0) {
+		close(pidfds[i]);
+		return;
+	}
+	/*
+	 * The SIGCHLD handler stays installed, it skips the watched
+	 * subprocesses and still serves the unwatched ones.
+	 */
+	supervised[i] = 1;
+}
+
 static void start_swupdate_subprocess(sourcetype type, const char *name,
 			uid_t run_as_userid, gid_t run_as_groupid,
 			const char* cfgfile,
@@ -222,6 +352,7 @@ static void start_swupdate_subprocess(sourcetype type, const char *name,
 	}
 
 	TRACE("Started %s with pid %d and fd %d", name, procs[nprocs].pid, procs[nprocs].pipe);
+	supervise_process(nprocs);
 	nprocs++;
 }
 
@@ -245,6 +376,70 @@ void start_subprocess(sourcetype type, const char *name,
 	start_swupdate_subprocess(type, name, run_as_userid, run_as_groupid, cfgfile, argc, argv, start, NULL);
 }
 
+/* overlong lines are split, a notification cannot hold more */
+static void cmd_output_notify(LOGLEVEL level, const char *line, size_t len)
+{
+	RECOVERY_STATUS status = level == ERRORLEVEL ? FAILURE : RUN;
+	int chunk;
+
+	do {
+		chunk = len < NOTIFY_BUF_SIZE - 1 ? len : NOTIFY_BUF_SIZE - 1;
+		swupdate_notify(status, "%.*s", level, chunk, line);
+		line += chunk;
+		len -= chunk;
+	} while (len);
+}
+
+/*
+ * Forward all complete lines in the buffer in one pass. A partial
+ * line is kept for the next read, unless the buffer is full or the
+ * stream is flushed.
+ */
+static void cmd_output_lines(struct cmd_output *out, bool flush)
+{
+	char *p = out->buf, *end = out->buf + out->len, *nl;
+
+	while ((nl = memchr(p, '\n', end - p))) {
+		if (nl > p)
+			cmd_output_notify(out->level, p, nl - p);
+		p = nl + 1;
+	}
+
+	if (p == out->buf && out->len == sizeof(out->buf) - 1)
+		flush = true;
+	if (flush && p < end) {
+		cmd_output_notify(out->level, p, end - p);
+		p = end;
+	}
+
+	out->len = end - p;
+	if (out->len && p != out->buf)
+		memmove(out->buf, p, out->len);
+}
+
+/*
+ * Read what is available from a (non blocking) stream.
+ * Returns the number of bytes read, 0 at EOF, -1 if there was nothing.
+ */
+static ssize_t cmd_output_read(struct cmd_output *out)
+{
+	ssize_t n;
+
+	n = read(out->fd, out->buf + out->len, sizeof(out->buf) - 1 - out->len);
+	if (n <= 0)
+		return (n == 0 || (errno != EAGAIN && errno != EINTR)) ? 0 : -1;
+
+	/* replace zeroes with @ signs */
+	for (ssize_t i = 0; i < n; i++) {
+		if (!out->buf[out->len + i])
+			out->buf[out->len + i] = '@';
+	}
+	out->len += n;
+	cmd_output_lines(out, false);
+
+	return n;
+}
+
 /*
  * run_cmd executes a shell script or an internal function in background
  * in a separate process and intercepts stdout and stderr, writing then to
@@ -268,6 +463,7 @@ static int __run_cmd(const char *cmd, bgtask *fn, int *fdin)
 	int const PIPE_WRITE = 1;
 	int wstatus, i;
 	bool execute_function = !(cmd && strnlen(cmd, SWUPDATE_GENERAL_STRING_SIZE)) && fn;
+	struct cmd_output *out;
 
 	/*
 	 * There are two cases:
@@ -296,6 +492,12 @@ static int __run_cmd(const char *cmd, bgtask *fn, int *fdin)
 		}
 	}
 
+	out = calloc(npipes, sizeof(*out));
+	if (!out) {
+		ERROR("Could not allocate buffers for subprocess, exiting...");
+		return -ENOMEM;
+	}
+
 	/*
 	 * Creates pipes to intercept stdout and stderr of the
 	 * child process
@@ -307,11 +509,11 @@ static int __run_cmd(const char *cmd, bgtask *fn, int *fdin)
 		}
 	}
 	if (i < npipes) {
-		while (i >= 0) {
+		while (--i >= 0) {
 			close(pipes[i][0]);
 			close(pipes[i][1]);
-			i--;
 		}
+		free(out);
 		return -EFAULT;
 	}
 
@@ -334,10 +536,15 @@ static int __run_cmd(const char *cmd, bgtask *fn, int *fdin)
 			exit(errno);
 		setenv("SWUPDATE_WARN_FD", "4", 1);
 
-		/* close all pipes, not used anymore */
+		/*
+		 * close all pipes, not used anymore. Ends that were
+		 * numbered 3 or 4 are already replaced by the dups above.
+		 */
 		for (i = 0; i < npipes; i++) {
-			close(pipes[i][PIPE_READ]);
-			close(pipes[i][PIPE_WRITE]);
+			if (pipes[i][PIPE_READ] > 4)
+				close(pipes[i][PIPE_READ]);
+			if (pipes[i][PIPE_WRITE] > 4)
+				close(pipes[i][PIPE_WRITE]);
 		}
 		/*
 		 * close the write part of the pipe
@@ -356,90 +563,94 @@ static int __run_cmd(const char *cmd, bgtask *fn, int *fdin)
 			exit(ret);
 		}
 	} else {
-		int fds[npipes];
-		int fdmax = 0;
+		struct epoll_event ev, events[npipes + 1];
+		int epollfd, pidfd, n;
+		bool exited = false;
 		pid_t w;
+
 		/*
-		 * Use buffers (for stdout and stdin) to collect data from
-		 * the cmd. Data can contain multiple lines or just a part
-		 * of a line and must be parsed
+		 * Forward data from stdout as TRACE and from stderr (of the
+		 * child process) as ERROR. The pipes and a pidfd of the child
+		 * are watched together, without a pidfd the child is polled
+		 * every second.
 		 */
-		char buf[npipes][SWUPDATE_GENERAL_STRING_SIZE];
-		int cindex[npipes];
+		epollfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollfd < 0) {
+			ERROR("Could not watch subprocess: %s", strerror(errno));
+			kill(process_id, SIGKILL);
+			waitpid(process_id, NULL, 0);
+			for (i = 0; i < npipes; i++) {
+				close(pipes[i][PIPE_READ]);
+				close(pipes[i][PIPE_WRITE]);
+			}
+			free(out);
+			return -EFAULT;
+		}
 
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
 		for (i = 0; i < npipes; i++) {
 			close(pipes[i][PIPE_WRITE]);
-			fds[i] = pipes[i][PIPE_READ];
-			memset(buf[i], 0, sizeof(buf[i]));
-			cindex[i] = 0;
-			if (fds[i] > fdmax) fdmax = fds[i];
+			out[i].fd = pipes[i][PIPE_READ];
+			out[i].level = levels[i];
+			fcntl(out[i].fd, F_SETFL, fcntl(out[i].fd, F_GETFL) | O_NONBLOCK);
+			ev.data.u32 = i;
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, out[i].fd, &ev);
+		}
+		pidfd = pidfd_open_fd(process_id);
+		if (pidfd >= 0) {
+			ev.data.u32 = npipes;
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, pidfd, &ev);
 		}
 
-		/*
-		 * Now waits until the child process exits and checks
-		 * for the output. Forward data from stdout as TRACE
-		 * and from stderr (of the child process) as ERROR
-		 */
-		do {
-			int n1 = 0;
-			struct timeval tv;
-			fd_set readfds;
-			int n;
+		while (!exited) {
+			bool check = pidfd < 0;
+
+			n = epoll_wait(epollfd, events, npipes + 1,
+				       pidfd < 0 ? 1000 : -1);
+			if (n < 0 && errno != EINTR) {
+				ERROR("Error from epoll_wait(): %s", strerror(errno));
+				check = true;
+			}
+			for (i = 0; i < n; i++) {
+				int idx = events[i].data.u32;
+
+				if (idx == npipes) {
+					check = true;
+					continue;
+				}
+				/* EOF, the fd is closed at the end */
+				if (cmd_output_read(&out[idx]) == 0)
+					epoll_ctl(epollfd, EPOLL_CTL_DEL,
+						  out[idx].fd, NULL);
+			}
+			if (!check)
+				continue;
 
 			w = waitpid(process_id, &wstatus, WNOHANG);
 			if (w == -1) {
 				ERROR("Error from waitpid() !!");
-				close(pipes[0][PIPE_READ]);
-				close(pipes[1][PIPE_READ]);
-				return -EFAULT;
+				ret = -EFAULT;
+				break;
 			}
+			exited = (w == process_id);
+		}
 
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-
-			/* Check if the child has sent something */
-			do {
-				FD_ZERO(&readfds);
-				for (i = 0; i < npipes; i++)
-					FD_SET(fds[i], &readfds);
-
-				n1 = 0;
-				ret = select(fdmax + 1, &readfds, NULL, NULL, &tv);
-				if (ret <= 0)
-					break;
-
-				for (i = 0; i < npipes ; i++) {
-					char *pbuf = buf[i];
-					int *c = &cindex[i];
-					LOGLEVEL level = levels[i];
-
-					if (FD_ISSET(fds[i], &readfds)) {
-						n = read_lines_notify(fds[i], pbuf, SWUPDATE_GENERAL_STRING_SIZE,
-								      c, level);
-						if (n < 0)
-							continue;
-						n1 += n;
-					}
-				}
-			} while (ret > 0 && n1 > 0);
-		} while (w != process_id);
-
-		/* print any unfinished line */
+		/* collect what is left and print any unfinished line */
 		for (i = 0; i < npipes; i++) {
-			if (cindex[i]) {
-				switch(i) {
-				case 0:
-					TRACE("%s", buf[i]);
-					break;
-				case 1:
-					ERROR("%s", buf[i]);
-					break;
-				}
-			}
-			close(pipes[i][PIPE_READ]);
+			if (exited)
+				while (cmd_output_read(&out[i]) > 0);
+			cmd_output_lines(&out[i], true);
+			close(out[i].fd);
 		}
+		if (pidfd >= 0)
+			close(pidfd);
 
-		if (WIFEXITED(wstatus)) {
+		close(epollfd);
+
+		if (!exited) {
+			/* waitpid() failed, ret is already set */
+		} else if (WIFEXITED(wstatus)) {
 			ret = WEXITSTATUS(wstatus);
 			TRACE("%s command returned %d", cmd ? cmd : "", ret);
 		} else if (WIFSIGNALED(wstatus)) {
@@ -451,6 +662,8 @@ static int __run_cmd(const char *cmd, bgtask *fn, int *fdin)
 		}
 	}
 
+	free(out);
+
 	return ret;
 }
 
@@ -473,8 +686,9 @@ int run_function_background(void *fn, int argc, char **argv) {
 }
 /*
  * The handler supervises the subprocesses
- * (Downloader, Webserver, Suricatta)
- * if one of them dies, SWUpdate exits
+ * (Downloader, Webserver, Suricatta) that are not watched
+ * by the supervisor thread.
+ * If one of them dies, SWUpdate exits
  * and sends a SIGTERM signal to all other subprocesses
  */
 void sigchld_handler (int __attribute__ ((__unused__)) signum)
@@ -489,6 +703,8 @@ void sigchld_handler (int __attribute__ ((__unused__)) signum)
 	 * One process stops, find who is
 	 */
 	for (i = 0; i < nprocs; i++) {
+		if (supervised[i])
+			continue;
 		childpid = waitpid (procs[i].pid, &status, WNOHANG);
 		if (childpid < 0) {
 			perror ("waitpid, no child");
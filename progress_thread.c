@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -35,9 +36,28 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+/*
+ * Number of messages that can be queued for each listener.
+ * If a listener does not consume them in time, the oldest
+ * ones are dropped.
+ */
+#define PROGRESS_QUEUE_LEN 16
+
+/*
+ * Steps can run concurrently when images are installed in parallel:
+ * each thread owns a slot and the percentage sent to the listeners
+ * is the average of the running steps.
+ */
+#define PROGRESS_MAX_RUNNING 8
+
 struct progress_conn {
 	SIMPLEQ_ENTRY(progress_conn) next;
 	int sockfd;
+	struct progress_msg queue[PROGRESS_QUEUE_LEN];
+	unsigned int first;
+	unsigned int count;
+	size_t offset;		/* bytes of the first message already sent */
+	unsigned long dropped;
 };
 
 SIMPLEQ_HEAD(connections, progress_conn);
@@ -53,59 +73,218 @@ struct swupdate_progress {
 	struct connections conns;
 	pthread_mutex_t lock;
 	bool step_running;
+	unsigned int running;
+	bool slot_used[PROGRESS_MAX_RUNNING];
+	unsigned int slot_percent[PROGRESS_MAX_RUNNING];
+	int wakeup[2];
 };
 static struct swupdate_progress progress;
+static __thread int progress_slot = -1;
+
+static void progress_reset_slots(struct swupdate_progress *pprog)
+{
+	pprog->running = 0;
+	memset(pprog->slot_used, 0, sizeof(pprog->slot_used));
+	progress_slot = -1;
+}
+
+static unsigned int progress_aggregate(struct swupdate_progress *pprog,
+				       unsigned int perc)
+{
+	unsigned int i, n = 0, sum = 0;
+
+	if (pprog->running < 2 || progress_slot < 0)
+		return perc;
+
+	pprog->slot_percent[progress_slot] = perc;
+	for (i = 0; i < PROGRESS_MAX_RUNNING; i++) {
+		if (pprog->slot_used[i]) {
+			sum += pprog->slot_percent[i];
+			n++;
+		}
+	}
+
+	return n ? sum / n : perc;
+}
+
+static struct progress_msg *conn_msg(struct progress_conn *conn, unsigned int index)
+{
+	return &conn->queue[(conn->first + index) % PROGRESS_QUEUE_LEN];
+}
+
+static void conn_drop_first(struct progress_conn *conn)
+{
+	conn->first = (conn->first + 1) % PROGRESS_QUEUE_LEN;
+	conn->count--;
+	conn->offset = 0;
+}
+
+/*
+ * A pending PROGRESS or DOWNLOAD message is superseded by a newer one
+ * for the same step: there is no need to send both, just the latest.
+ * Messages carrying info are events and are never merged.
+ */
+static bool can_coalesce(const struct progress_msg *old, const struct progress_msg *msg)
+{
+	return (msg->status == PROGRESS || msg->status == DOWNLOAD) &&
+		old->status == msg->status &&
+		old->cur_step == msg->cur_step &&
+		!old->infolen && !msg->infolen;
+}
+
+static void conn_enqueue(struct progress_conn *conn, const struct progress_msg *msg)
+{
+	struct progress_msg *last;
+
+	if (conn->count) {
+		last = conn_msg(conn, conn->count - 1);
+		/* the first message cannot be changed if it is partially sent */
+		if ((conn->count > 1 || !conn->offset) && can_coalesce(last, msg)) {
+			*last = *msg;
+			return;
+		}
+	}
+
+	if (conn->count == PROGRESS_QUEUE_LEN) {
+		/*
+		 * Drop the oldest message, but keep the first one
+		 * if it was partially sent to not break the stream
+		 */
+		if (conn->offset) {
+			*conn_msg(conn, 1) = *conn_msg(conn, 0);
+			conn->first = (conn->first + 1) % PROGRESS_QUEUE_LEN;
+			conn->count--;
+		} else
+			conn_drop_first(conn);
+		conn->dropped++;
+	}
+
+	*conn_msg(conn, conn->count) = *msg;
+	conn->count++;
+}
 
 /*
  * This must be called after acquiring the mutex
- * for the progress structure
- * It is assumed that the listeners are reading
- * the events and consume the messages. To avoid deadlocks,
- * SWUpdate will try to send the message without blocking,
- * and if send() returns EWOULDBLOCk, tries some times again
- * with a 1 second delay.
- * This is because SWUpdate could send a lot of events,
- * and listeners cannot be scheduled at time. The delay just
- * slow down the update when happens. If the message cannot be
- * sent after retries, SWUpdate will consider the listener
- * dead and removes it from the list.
+ * for the progress structure.
+ * The message is just queued for each listener and the
+ * sender thread is woken up: SWUpdate is never blocked
+ * by a listener that is not reading the events. A slow
+ * listener loses the oldest messages, and consecutive
+ * progress updates are merged into the latest one.
  */
 static void send_progress_msg(void)
 {
-	struct progress_conn *conn, *tmp;
+	struct progress_conn *conn;
 	struct swupdate_progress *pprog = &progress;
-	void *buf;
-	size_t count;
-	ssize_t n;
-	bool tryagain;
-	const int maxAttempts = 5;
+	char c = 0;
 
 	pprog->msg.apiversion = PROGRESS_API_VERSION;
-	SIMPLEQ_FOREACH_SAFE(conn, &pprog->conns, next, tmp) {
-		buf = &pprog->msg;
-		count = sizeof(pprog->msg);
-		errno = 0;
-		pprog->msg.source = get_install_source();
-		while (count > 0) {
-			int attempt = 0;
-			do {
-				n = send(conn->sockfd, buf, count, MSG_NOSIGNAL | MSG_DONTWAIT);
-				attempt++;
-				tryagain = n <= 0 && (errno == EWOULDBLOCK || errno == EAGAIN);
-				if (tryagain)
-					sleep(1);
-			} while (tryagain && attempt < maxAttempts);
-			if (n <= 0) {
+	pprog->msg.source = get_install_source();
+	SIMPLEQ_FOREACH(conn, &pprog->conns, next)
+		conn_enqueue(conn, &pprog->msg);
+
+	if (!SIMPLEQ_EMPTY(&pprog->conns) &&
+	    write(pprog->wakeup[1], &c, 1) < 0 && errno != EAGAIN)
+		TRACE("Cannot wake up progress sender: %s", strerror(errno));
+}
+
+/*
+ * Try to send the queued messages without blocking.
+ * Returns -1 if the connection is broken, 1 if messages
+ * are still pending, 0 if the queue is empty.
+ * Must be called after acquiring the mutex.
+ */
+static int conn_flush(struct progress_conn *conn)
+{
+	ssize_t n;
+
+	if (conn->dropped) {
+		TRACE("Progress listener too slow, %lu messages dropped", conn->dropped);
+		conn->dropped = 0;
+	}
+
+	while (conn->count) {
+		n = send(conn->sockfd, (char *)conn_msg(conn, 0) + conn->offset,
+			 sizeof(struct progress_msg) - conn->offset,
+			 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		conn->offset += (size_t)n;
+		if (conn->offset == sizeof(struct progress_msg))
+			conn_drop_first(conn);
+	}
+
+	return 0;
+}
+
+/*
+ * Sender thread: it drains the per-listener queues and
+ * waits for the listeners that cannot accept more data.
+ */
+static void *progress_sender_thread(void __attribute__ ((__unused__)) *data)
+{
+	struct swupdate_progress *pprog = &progress;
+	struct progress_conn *conn, *tmp;
+	struct pollfd *fds = NULL, *newfds;
+	unsigned int nfds, maxfds = 0, i;
+	char buf[64];
+	int ret;
+
+	thread_ready();
+
+	for (;;) {
+		pthread_mutex_lock(&pprog->lock);
+		nfds = 1;
+		SIMPLEQ_FOREACH_SAFE(conn, &pprog->conns, next, tmp) {
+			ret = conn_flush(conn);
+			if (ret < 0) {
 				close(conn->sockfd);
 				SIMPLEQ_REMOVE(&pprog->conns, conn,
-					       	progress_conn, next);
+					       progress_conn, next);
 				free(conn);
-				break;
+			} else if (ret > 0)
+				nfds++;
+		}
+
+		if (nfds > maxfds) {
+			newfds = realloc(fds, nfds * sizeof(*fds));
+			if (!newfds) {
+				pthread_mutex_unlock(&pprog->lock);
+				sleep(1);
+				continue;
+			}
+			fds = newfds;
+			maxfds = nfds;
+		}
+
+		fds[0].fd = pprog->wakeup[0];
+		fds[0].events = POLLIN;
+		i = 1;
+		SIMPLEQ_FOREACH(conn, &pprog->conns, next) {
+			if (conn->count && i < nfds) {
+				fds[i].fd = conn->sockfd;
+				fds[i].events = POLLOUT;
+				i++;
 			}
-			count -= (size_t)n;
-			buf = (char*)buf + n;
 		}
+		pthread_mutex_unlock(&pprog->lock);
+
+		if (poll(fds, i, -1) < 0 && errno != EINTR)
+			TRACE("Progress sender poll returns: %s", strerror(errno));
+
+		if (fds[0].revents & POLLIN)
+			while (read(pprog->wakeup[0], buf, sizeof(buf)) > 0)
+				;
 	}
+
+	return NULL;
 }
 
 static void _swupdate_download_update(unsigned int perc, unsigned long long totalbytes)
@@ -154,6 +333,7 @@ void swupdate_progress_update(unsigned int perc)
 {
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
+	perc = progress_aggregate(pprog, perc);
 	if (perc != pprog->msg.cur_percent && pprog->step_running) {
 		pprog->msg.status = PROGRESS;
 		pprog->msg.cur_percent = perc;
@@ -188,11 +368,23 @@ void swupdate_download_update(unsigned int perc, unsigned long long totalbytes)
 void swupdate_progress_inc_step(const char *image, const char *handler_name)
 {
 	struct swupdate_progress *pprog = &progress;
+	int i;
+
 	pthread_mutex_lock(&pprog->lock);
 	pprog->msg.cur_step++;
-	pprog->msg.cur_percent = 0;
 	strlcpy(pprog->msg.cur_image, image, sizeof(pprog->msg.cur_image));
 	strlcpy(pprog->msg.hnd_name, handler_name, sizeof(pprog->msg.hnd_name));
+	progress_slot = -1;
+	for (i = 0; i < PROGRESS_MAX_RUNNING; i++) {
+		if (!pprog->slot_used[i]) {
+			pprog->slot_used[i] = true;
+			pprog->slot_percent[i] = 0;
+			progress_slot = i;
+			break;
+		}
+	}
+	pprog->running++;
+	pprog->msg.cur_percent = progress_aggregate(pprog, 0);
 	pprog->step_running = true;
 	pprog->msg.status = RUN;
 	send_progress_msg();
@@ -203,8 +395,16 @@ void swupdate_progress_step_completed(void)
 {
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
-	pprog->step_running = false;
-	pprog->msg.status = IDLE;
+	if (progress_slot >= 0)
+		pprog->slot_used[progress_slot] = false;
+	progress_slot = -1;
+	if (pprog->running)
+		pprog->running--;
+	/* other steps running in parallel are still reporting */
+	if (!pprog->running) {
+		pprog->step_running = false;
+		pprog->msg.status = IDLE;
+	}
 	pthread_mutex_unlock(&pprog->lock);
 }
 
@@ -213,6 +413,7 @@ void swupdate_progress_end(RECOVERY_STATUS status)
 	struct swupdate_progress *pprog = &progress;
 	pthread_mutex_lock(&pprog->lock);
 	pprog->step_running = false;
+	progress_reset_slots(pprog);
 	pprog->msg.status = status;
 	send_progress_msg();
 	pprog->msg.nsteps = 0;
@@ -247,6 +448,7 @@ void swupdate_progress_done(const char *info)
 		pprog->msg.infolen = strlen(pprog->msg.info);
 	}
 	pprog->step_running = false;
+	progress_reset_slots(pprog);
 	pprog->msg.status = DONE;
 	send_progress_msg();
 	pprog->msg.infolen = 0;
@@ -305,6 +507,12 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 	pthread_mutex_init(&pprog->lock, NULL);
 	SIMPLEQ_INIT(&pprog->conns);
 
+	if (pipe2(pprog->wakeup, O_NONBLOCK | O_CLOEXEC) < 0) {
+		ERROR("Cannot create progress wakeup pipe, exiting.");
+		exit(2);
+	}
+	start_thread(progress_sender_thread, NULL);
+
 	/* Initialize and bind to UDS */
 	listen = listener_create(get_prog_socket(), SOCK_STREAM);
 	if (listen < 0 ) {
@@ -336,16 +544,16 @@ void *progress_bar_thread (void __attribute__ ((__unused__)) *data)
 			continue;
 		}
 		conn->sockfd = connfd;
-		pthread_mutex_lock(&pprog->lock);
 		/* Send an ACK to the client to indicate that it is duly registered */
 		err = progress_send_connect_ack(connfd);
 		if (err) {
 			ERROR("progress_bar_thread: Could not send progress ACK");
 			close(conn->sockfd);
 			free(conn);
-		} else {
-			SIMPLEQ_INSERT_TAIL(&pprog->conns, conn, next);
+			continue;
 		}
+		pthread_mutex_lock(&pprog->lock);
+		SIMPLEQ_INSERT_TAIL(&pprog->conns, conn, next);
 		pthread_mutex_unlock(&pprog->lock);
 	} while(1);
 }
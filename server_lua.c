@@ -30,6 +30,7 @@
 #include <parselib.h>
 #include <state.h>
 #include <bootloader.h>
+#include "bootloader_txn.h"
 #include <swupdate_settings.h>
 #include <swupdate_dict.h>
 #include "server_utils.h"
@@ -128,18 +129,17 @@ static const char **ipc_journal = NULL;
  * @see progress_offloader_thread()
  * @see progress_collector_thread()
  * */
-struct msgq_data_t {
-	struct progress_msg entry;
-	STAILQ_ENTRY(msgq_data_t) entries;
-};
-STAILQ_HEAD(messageq_head_t, msgq_data_t);
+#define PROGRESS_MSGQ_SIZE 64
 typedef struct {
 	lua_State *L;
 	pthread_mutex_t *lua_lock;
 	pthread_t *thread_collector;
 	pthread_t *thread_offloader;
-	struct messageq_head_t progress_msgq;
+	struct progress_msg *progress_msgq;	/* ring of PROGRESS_MSGQ_SIZE */
+	unsigned int progress_msgq_head;
+	unsigned int progress_msgq_count;
 	pthread_mutex_t *progress_msgq_lock;
+	pthread_cond_t *progress_msgq_cond;
 	bool drain_progress_msgq;
 	int lua_check_cancel_func;
 	int fdout;
@@ -408,6 +408,12 @@ static bool push_registered_lua_func(lua_State *L, function_t func)
 }
 
 
+/*
+ * Bootloader environment transactions opened by Lua and not yet ended,
+ * call_lua_func() commits the ones a function leaves open.
+ */
+static unsigned int lua_env_txn;
+
 /**
  * @brief Wrapper to call a registered Lua function.
  *
@@ -444,7 +450,17 @@ static int call_lua_func(lua_State *L, function_t func, int numargs)
 	lua_insert(L, -(numargs + 1));
 
 	int top = lua_gettop(L) - numargs - 1;
-	if (lua_pcall(L, numargs, LUA_MULTRET, 0) != LUA_OK) {
+	unsigned int txn = lua_env_txn;
+	int ret = lua_pcall(L, numargs, LUA_MULTRET, 0);
+
+	/* the environment must not stay locked after the function */
+	if (lua_env_txn > txn) {
+		WARN("Lua function %s left a bootloader environment "
+		     "transaction open, committing it.", function_names[func]);
+		for (; lua_env_txn > txn; lua_env_txn--)
+			(void)bootloader_env_commit();
+	}
+	if (ret != LUA_OK) {
 		ERROR("Error executing Lua function %s: %s", function_names[func],
 		      lua_tostring(L, -1));
 		lua_pop(L, 1);
@@ -881,6 +897,41 @@ static int ipc_wait_for_complete_cb(ipc_message *msg)
 }
 
 
+/**
+ * @brief Cleanup handler unlocking the progress message queue mutex.
+ *
+ * @param lock  Pointer to the progress message queue mutex.
+ */
+static void progress_msgq_unlock(void *lock)
+{
+	(void)pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+
+
+/**
+ * @brief Check whether a progress message only updates the percentages.
+ *
+ * Such a message can replace a queued one for the same step which
+ * has not yet been reported, so that a slow progress callback sees
+ * the latest state instead of lagging behind.
+ *
+ * @param  queued   The last queued message.
+ * @param  message  The new message.
+ * @return True if message can replace queued.
+ */
+static bool progress_msg_coalesce(struct progress_msg *queued,
+				  struct progress_msg *message)
+{
+	return queued->infolen == 0 && message->infolen == 0 &&
+	       queued->status == message->status &&
+	       queued->source == message->source &&
+	       queued->nsteps == message->nsteps &&
+	       queued->cur_step == message->cur_step &&
+	       strcmp((char *)queued->cur_image, (char *)message->cur_image) == 0 &&
+	       strcmp((char *)queued->hnd_name, (char *)message->hnd_name) == 0;
+}
+
+
 /**
  * @brief Thread offloading collected progress messages to the server.
  *
@@ -896,55 +947,58 @@ static int ipc_wait_for_complete_cb(ipc_message *msg)
 static void *progress_offloader_thread(void *data)
 {
 	callback_data_t *thread_data = (callback_data_t *)data;
+	struct progress_msg msg, *message = &msg;
 
 	while (true) {
 		(void)pthread_mutex_lock(thread_data->progress_msgq_lock);
-		if (STAILQ_EMPTY(&thread_data->progress_msgq)) {
-			(void)pthread_mutex_unlock(thread_data->progress_msgq_lock);
-			/* Accept cancellation on empty progress message queue. */
-			(void)pthread_testcancel();
-		} else {
-			(void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-			struct msgq_data_t *qitem = STAILQ_FIRST(
-			    &thread_data->progress_msgq);
-			struct progress_msg *message = &qitem->entry;
-
-			(void)pthread_mutex_lock(thread_data->lua_lock);
-			lua_newtable(thread_data->L);
-			push_to_table(thread_data->L, "apiversion",  message->apiversion);
-			push_to_table(thread_data->L, "status",      message->status);
-			push_to_table(thread_data->L, "dwl_percent", message->dwl_percent);
-			push_to_table(thread_data->L, "nsteps",      message->nsteps);
-			push_to_table(thread_data->L, "cur_step",    message->cur_step);
-			push_to_table(thread_data->L, "cur_percent", message->cur_percent);
-			push_to_table(thread_data->L, "cur_image",   (char*)message->cur_image);
-			push_to_table(thread_data->L, "hnd_name",    (char*)message->hnd_name);
-			push_to_table(thread_data->L, "source",      message->source);
-			push_to_table(thread_data->L, "info",        (char*)message->info);
-			if (message->infolen > 0) {
-				lua_pushstring(thread_data->L, "jsoninfo");
-				struct json_object *json_root = json_tokener_parse(
-				    message->info);
-				if (!json_root ||
-				    !json_to_table(thread_data->L, json_root)) {
-					lua_pushnil(thread_data->L);
-				}
-				if (json_root && json_object_put(json_root) != 1) {
-					ERROR("Progress JSON object should be freed but was not.");
-				}
-				lua_settable(thread_data->L, -3);
+		pthread_cleanup_push(progress_msgq_unlock, thread_data->progress_msgq_lock);
+		/* Accept cancellation while waiting on an empty progress message queue. */
+		while (thread_data->progress_msgq_count == 0) {
+			(void)pthread_cond_wait(thread_data->progress_msgq_cond,
+						thread_data->progress_msgq_lock);
+		}
+		(void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		(void)memcpy(message,
+			     &thread_data->progress_msgq[thread_data->progress_msgq_head],
+			     sizeof(*message));
+		thread_data->progress_msgq_head =
+		    (thread_data->progress_msgq_head + 1) % PROGRESS_MSGQ_SIZE;
+		thread_data->progress_msgq_count--;
+		(void)pthread_cond_broadcast(thread_data->progress_msgq_cond);
+		pthread_cleanup_pop(1);
+
+		(void)pthread_mutex_lock(thread_data->lua_lock);
+		lua_newtable(thread_data->L);
+		push_to_table(thread_data->L, "apiversion",  message->apiversion);
+		push_to_table(thread_data->L, "status",      message->status);
+		push_to_table(thread_data->L, "dwl_percent", message->dwl_percent);
+		push_to_table(thread_data->L, "nsteps",      message->nsteps);
+		push_to_table(thread_data->L, "cur_step",    message->cur_step);
+		push_to_table(thread_data->L, "cur_percent", message->cur_percent);
+		push_to_table(thread_data->L, "cur_image",   (char*)message->cur_image);
+		push_to_table(thread_data->L, "hnd_name",    (char*)message->hnd_name);
+		push_to_table(thread_data->L, "source",      message->source);
+		push_to_table(thread_data->L, "info",        (char*)message->info);
+		if (message->infolen > 0) {
+			lua_pushstring(thread_data->L, "jsoninfo");
+			struct json_object *json_root = json_tokener_parse(
+			    message->info);
+			if (!json_root ||
+			    !json_to_table(thread_data->L, json_root)) {
+				lua_pushnil(thread_data->L);
 			}
-			STAILQ_REMOVE_HEAD(&thread_data->progress_msgq, entries);
-			free(qitem);
-			(void)pthread_mutex_unlock(thread_data->progress_msgq_lock);
-			(void)call_lua_func(thread_data->L, SURICATTA_FUNC_CALLBACK_PROGRESS, 1);
-			(void)pthread_mutex_unlock(thread_data->lua_lock);
-			(void)pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-
-			if (thread_data->drain_progress_msgq == false) {
-				/* Accept cancellation if messages mustn't be flushed completely. */
-				(void)pthread_testcancel();
+			if (json_root && json_object_put(json_root) != 1) {
+				ERROR("Progress JSON object should be freed but was not.");
 			}
+			lua_settable(thread_data->L, -3);
+		}
+		(void)call_lua_func(thread_data->L, SURICATTA_FUNC_CALLBACK_PROGRESS, 1);
+		(void)pthread_mutex_unlock(thread_data->lua_lock);
+		(void)pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		if (thread_data->drain_progress_msgq == false) {
+			/* Accept cancellation if messages mustn't be flushed completely. */
+			(void)pthread_testcancel();
 		}
 	}
 	return NULL;
@@ -1002,11 +1056,31 @@ static void *progress_collector_thread(void *data)
 		message.hnd_name[sizeof(message.hnd_name) - 1] = '\0';
 		message.cur_image[sizeof(message.cur_image) - 1] = '\0';
 
-		struct msgq_data_t *qentry = malloc(sizeof(struct msgq_data_t));
-		(void)memcpy(&qentry->entry, &message, sizeof(struct progress_msg));
 		(void)pthread_mutex_lock(thread_data->progress_msgq_lock);
-		STAILQ_INSERT_TAIL(&thread_data->progress_msgq, qentry, entries);
-		(void)pthread_mutex_unlock(thread_data->progress_msgq_lock);
+		pthread_cleanup_push(progress_msgq_unlock, thread_data->progress_msgq_lock);
+		struct progress_msg *tail = NULL;
+		if (thread_data->progress_msgq_count > 0) {
+			tail = &thread_data->progress_msgq[
+			    (thread_data->progress_msgq_head +
+			     thread_data->progress_msgq_count - 1) % PROGRESS_MSGQ_SIZE];
+			if (!progress_msg_coalesce(tail, &message)) {
+				tail = NULL;
+			}
+		}
+		if (!tail) {
+			/* Wait for the offloader to make room in a full queue. */
+			while (thread_data->progress_msgq_count == PROGRESS_MSGQ_SIZE) {
+				(void)pthread_cond_wait(thread_data->progress_msgq_cond,
+							thread_data->progress_msgq_lock);
+			}
+			tail = &thread_data->progress_msgq[
+			    (thread_data->progress_msgq_head +
+			     thread_data->progress_msgq_count) % PROGRESS_MSGQ_SIZE];
+			thread_data->progress_msgq_count++;
+		}
+		(void)memcpy(tail, &message, sizeof(struct progress_msg));
+		(void)pthread_cond_broadcast(thread_data->progress_msgq_cond);
+		pthread_cleanup_pop(1);
 	}
 
 	pthread_cleanup_pop(1);
@@ -1099,21 +1173,34 @@ static void do_install(lua_State *L, int fdout)
 
 	/* Setup progress message handling threads and Lua callback function. */
 	pthread_mutex_t _progress_msgq_lock;
+	pthread_cond_t _progress_msgq_cond;
 	pthread_t _thread_progress_collector;
 	pthread_t _thread_progress_offloader;
 	if (push_registered_lua_func(L, SURICATTA_FUNC_CALLBACK_PROGRESS)) {
 		lua_pop(L, 1);
 
-		/* Initialize progress messages (tail) queue. */
-		STAILQ_INIT(&callback_data.progress_msgq);
+		/* Initialize progress messages ring queue. */
+		callback_data.progress_msgq = calloc(PROGRESS_MSGQ_SIZE,
+						     sizeof(struct progress_msg));
+		if (!callback_data.progress_msgq) {
+			ERROR("Error allocating progress message queue.");
+			lua_pop(L, 1);
+			goto error;
+		}
 
-		/* Initialize progress messages (tail) queue synchronization mutex. */
+		/* Initialize progress messages queue synchronization. */
 		if (pthread_mutex_init(&_progress_msgq_lock, NULL)) {
 			ERROR("Error creating progress message queue mutex.");
 			lua_pop(L, 1);
 			goto error;
 		}
 		callback_data.progress_msgq_lock = &_progress_msgq_lock;
+		if (pthread_cond_init(&_progress_msgq_cond, NULL)) {
+			ERROR("Error creating progress message queue condition.");
+			lua_pop(L, 1);
+			goto error;
+		}
+		callback_data.progress_msgq_cond = &_progress_msgq_cond;
 
 		/* Spawn threads handling progress notification to server. */
 		if ((pthread_create(&_thread_progress_collector, NULL,
@@ -1140,13 +1227,6 @@ static void do_install(lua_State *L, int fdout)
 	if (callback_data.thread_collector && callback_data.thread_offloader) {
 		join_progress_threads(callback_data.thread_offloader, "progress_offloader");
 		join_progress_threads(callback_data.thread_collector, "progress_collector");
-
-		while (!STAILQ_EMPTY(&callback_data.progress_msgq)) {
-			struct msgq_data_t *entry = STAILQ_FIRST(
-			    &callback_data.progress_msgq);
-			STAILQ_REMOVE_HEAD(&callback_data.progress_msgq, entries);
-			free(entry);
-		}
 	}
 
 	if (result == SERVER_OK) {
@@ -1172,6 +1252,12 @@ error:
 	lua_pushinteger(L, SERVER_EINIT);
 	lua_newtable(L);
 done:
+	free(callback_data.progress_msgq);
+	if (callback_data.progress_msgq_cond) {
+		if (pthread_cond_destroy(callback_data.progress_msgq_cond) != 0) {
+			ERROR("Condition deallocation for progress message queue failed!");
+		}
+	}
 	if (callback_data.progress_msgq_lock) {
 		if (pthread_mutex_destroy(callback_data.progress_msgq_lock) != 0) {
 			ERROR("Mutex deallocation for progress message queue failed!");
@@ -1460,6 +1546,63 @@ static int lua_bootloader_env_apply(lua_State *L)
 	return 1;
 }
 
+/**
+ * @brief Start grouping bootloader environment changes.
+ *
+ * Changes up to the matching commit() are stored with a single write
+ * if the bootloader supports it. A transaction left open is committed
+ * when the Suricatta Lua function returns.
+ *
+ * @return [Lua] True, or, in case of error, nil.
+ */
+static int lua_bootloader_env_begin(lua_State *L)
+{
+	int ret = bootloader_env_begin();
+
+	if (ret == 0)
+		lua_env_txn++;
+	ret == 0
+		? lua_pushboolean(L, true)
+		: lua_pushnil(L);
+	return 1;
+}
+
+/**
+ * @brief Store bootloader environment changes grouped by begin().
+ *
+ * @return [Lua] True, or, in case of error, nil.
+ */
+static int lua_bootloader_env_commit(lua_State *L)
+{
+	if (!lua_env_txn) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_env_txn--;
+	bootloader_env_commit() == 0
+		? lua_pushboolean(L, true)
+		: lua_pushnil(L);
+	return 1;
+}
+
+/**
+ * @brief Drop bootloader environment changes grouped by begin().
+ *
+ * @return [Lua] True, or, in case of error, nil.
+ */
+static int lua_bootloader_env_abort(lua_State *L)
+{
+	if (!lua_env_txn) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_env_txn--;
+	bootloader_env_abort() == 0
+		? lua_pushboolean(L, true)
+		: lua_pushnil(L);
+	return 1;
+}
+
 /**
  * @brief Get update state from persistent storage (bootloader).
  *
@@ -1553,6 +1696,9 @@ static int suricatta_lua_module(lua_State *L)
 		{ "set",   lua_bootloader_env_set   },
 		{ "unset", lua_bootloader_env_unset },
 		{ "apply", lua_bootloader_env_apply },
+		{ "begin", lua_bootloader_env_begin },
+		{ "commit", lua_bootloader_env_commit },
+		{ "abort", lua_bootloader_env_abort },
 		{ NULL, NULL }
 	};
 	lua_pushstring(L, "bootloader");
@@ -33,6 +33,7 @@
 #include "handler.h"
 #ifdef CONFIG_MTD
 #include "flash.h"
+#include "mtd_topology.h"
 #endif
 #include "parsers.h"
 #include "network_ipc.h"
@@ -44,7 +45,10 @@
 #include "pctl.h"
 #include "state.h"
 #include "bootloader.h"
+#include "bootloader_txn.h"
 #include "hw-compatibility.h"
+#include "img_index.h"
+#include "swu_map.h"
 
 #define BUFF_SIZE	 4096
 #define PERCENT_LB_INDEX	4
@@ -73,6 +77,38 @@ pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
 
 static struct installer inst;
 
+/*
+ * Lookup tables for images and scripts, built after
+ * sw-description is parsed
+ */
+static struct img_index *image_index[2];
+
+static void drop_image_index(void)
+{
+	for (unsigned int i = 0; i < ARRAY_SIZE(image_index); i++) {
+		img_index_free(image_index[i]);
+		image_index[i] = NULL;
+	}
+}
+
+static int build_image_index(struct swupdate_cfg *software)
+{
+	struct imglist *list[] = {&software->images,
+				  &software->scripts};
+
+	drop_image_index();
+	for (unsigned int i = 0; i < ARRAY_SIZE(list); i++) {
+		image_index[i] = img_index_build(list[i]);
+		if (!image_index[i]) {
+			ERROR("OOM building image index");
+			drop_image_index();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 			       bool encrypted, int max_size)
 {
@@ -132,22 +168,32 @@ static int extract_file_to_tmp(int fd, const char *fname, unsigned long *poffs,
 
 static bool update_transaction_state(struct swupdate_cfg *software, update_state_t newstate)
 {
-	if (!software->parms.dry_run && software->bootloader_transaction_marker) {
+	bool ret = true;
+
+	if (software->parms.dry_run)
+		return true;
+
+	/* marker and state reach the bootloader environment in one write */
+	bootloader_env_begin();
+	if (software->bootloader_transaction_marker) {
 		if (newstate == STATE_INSTALLED)
 			bootloader_env_unset(BOOTVAR_TRANSACTION);
 		else
 			bootloader_env_set(BOOTVAR_TRANSACTION, get_state_string(newstate));
 	}
-	if (!software->parms.dry_run
-	    && software->bootloader_state_marker
+	if (software->bootloader_state_marker
 	    && save_state(newstate) != SERVER_OK) {
 		WARN("Cannot persistently store %s update state.", get_state_string(newstate));
-		return false;
+		ret = false;
+	}
+	if (bootloader_env_commit() && software->bootloader_state_marker) {
+		WARN("Cannot persistently store %s update state.", get_state_string(newstate));
+		ret = false;
 	}
-	return true;
+	return ret;
 }
 
-static int extract_files(int fd, struct swupdate_cfg *software)
+static int do_extract_files(int fd, struct swupdate_cfg *software)
 {
 	int status = STREAM_WAIT_DESCRIPTION;
 	unsigned long offset;
@@ -160,6 +206,9 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 	const char* TMPDIR = get_tmpdir();
 	bool installed_directly = false;
 	bool encrypted_sw_desc = false;
+	unsigned int list;
+	off_t datastart;
+	unsigned char *data;
 
 #ifdef CONFIG_ENCRYPTED_SW_DESCRIPTION
 	encrypted_sw_desc = true;
@@ -205,6 +254,8 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 			if (preupdatecmd(software)) {
 				return -1;
 			}
+			if (build_image_index(software))
+				return -1;
 			status = STREAM_DATA;
 			break;
 
@@ -224,11 +275,8 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				break;
 			}
 
-			struct imglist *list[] = {&software->images,
-						  &software->scripts};
-
-			for (unsigned int i = 0; i < ARRAY_SIZE(list); i++) {
-				skip = check_if_required(list[i], &fdh,
+			for (list = 0; list < ARRAY_SIZE(image_index); list++) {
+				skip = check_if_required_indexed(image_index[list], &fdh,
 						get_tmpdir(),
 						&img);
 
@@ -236,6 +284,21 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 					break;
 			}
 
+			/*
+			 * If the SWU is mapped, files are checked in place:
+			 * images are then installed from the mapping and
+			 * just scripts are copied into TMPDIR.
+			 */
+			data = NULL;
+			if (swu_map_active() && skip != INSTALL_FROM_STREAM) {
+				datastart = lseek(fd, 0, SEEK_CUR);
+				if (datastart >= 0)
+					data = swu_map_data(datastart, fdh.size);
+				if (data && skip == COPY_FILE &&
+				    (list != 0 || !strcmp(img->path, img->extract_file)))
+					data = NULL;
+			}
+
 			TRACE("Found file");
 			TRACE("\tfilename %s", fdh.filename);
 			TRACE("\tsize %u %s", (unsigned int)fdh.size,
@@ -251,6 +314,25 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 				.offs = &offset,
 				.checksum = &checksum,
 			};
+			if (data) {
+				copy.inbuf = data;
+				copy.skip_file = 1;
+				if (skip == COPY_FILE)
+					copy.hash = img->sha256;
+				if (copyfile(&copy) < 0)
+					return -1;
+				if (!swupdate_verify_chksum(checksum, &fdh))
+					return -1;
+				if (skip == COPY_FILE &&
+				    swu_map_add_image(img, datastart) < 0)
+					return -1;
+				datastart += fdh.size;
+				if (lseek(fd, datastart + NPAD_BYTES(datastart),
+					  SEEK_SET) < 0)
+					return -1;
+				break;
+			}
+
 			/*
 			 * If images are not streamed directly into the target
 			 * copy them into TMPDIR to check if it is all ok
@@ -326,7 +408,6 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 			break;
 
 		case STREAM_END:
-
 			/*
 			 * Check if all required files were provided
 			 * Update of a single file is not possible.
@@ -350,6 +431,16 @@ static int extract_files(int fd, struct swupdate_cfg *software)
 	}
 }
 
+static int extract_files(int fd, struct swupdate_cfg *software)
+{
+	int ret = do_extract_files(fd, software);
+
+	/* the index points into the image lists, never keep it */
+	drop_image_index();
+
+	return ret;
+}
+
 static int cpfiles(int fdin, int fdout, size_t max)
 {
 	char *buf;
@@ -525,11 +616,12 @@ static int save_stream(int fdin, struct swupdate_cfg *software)
 	 * Try to create directory if file cannot be opened
 	 */
 	if (fdout < 0) {
+		ret = -1;
 		if (mkpath(software->output, 0755))
-			return -1;
+			goto no_copy_output;
 		fdout = openfileoutput(software->output);
 		if (fdout < 0)
-			return -1;
+			goto no_copy_output;
 	}
 
 	ret = cpfiles(tmpfd, fdout, 0);
@@ -648,13 +740,13 @@ void *network_initializer(void *data)
 
 		if (!ret) {
 #ifdef CONFIG_MTD
-			mtd_cleanup();
-			scan_mtd_devices();
+			mtd_topology_refresh();
 #endif
 			/*
 		 	 * extract the meta data and relevant parts
 		 	 * (flash images) from the install image
 		 	 */
+			swu_map_open(inst.fd);
 			ret = extract_files(inst.fd, software);
 		}
 		if (!(inst.fd < 0))
@@ -761,6 +853,7 @@ void *network_initializer(void *data)
 
 		/* release temp files we may have created */
 		cleanup_files(software);
+		swu_map_close();
 
 #ifndef CONFIG_NOCLEANUP
 		swupdate_remove_directory(SCRIPTS_DIR_SUFFIX);
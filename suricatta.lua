@@ -120,6 +120,29 @@ suricatta.bootloader.env.unset = function(variable) end
 --- @return boolean | nil     # True on success, nil on error
 suricatta.bootloader.env.apply = function(filename) end
 
+--- Start grouping bootloader environment changes.
+--
+--- Changes up to the matching `commit()` are stored with a single
+--- write if the bootloader supports it. Calls may be nested.
+--- A transaction left open is committed when the function called
+--- by SWUpdate returns.
+--
+--- @return boolean | nil     # True on success, nil on error
+suricatta.bootloader.env.begin = function() end
+
+--- Store the bootloader environment changes grouped by `begin()`.
+--
+--- @return boolean | nil     # True on success, nil on error
+suricatta.bootloader.env.commit = function() end
+
+--- Drop the bootloader environment changes grouped by `begin()`.
+--
+--- Within nested transactions, the changes are dropped when the
+--- outermost one ends, its `commit()` then fails.
+--
+--- @return boolean | nil     # True on success, nil on error
+suricatta.bootloader.env.abort = function() end
+
 
 --- SWUpdate's persistent state IDs as in `include/state.h` and reverse-lookup.
 --
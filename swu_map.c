@@ -0,0 +1,284 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "sslapi.h"
+#include "swu_map.h"
+
+#define SWU_FEED_CHUNK	(64 * 1024)
+
+struct swu_map_entry {
+	struct img_type *img;
+	off_t offs;
+};
+
+static struct {
+	unsigned char *base;
+	size_t size;
+	struct swu_map_entry *entries;
+	unsigned int nentries;
+	/* threads still reading from the mapping */
+	unsigned int feeders;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+} swu = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Map the SWU if fd refers to a regular file, a stream
+ * (socket, pipe) is not mapped and returns -ENODEV.
+ */
+int swu_map_open(int fd)
+{
+	struct stat st;
+	void *base;
+
+	swu_map_close();
+
+	if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return -ENODEV;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		WARN("SWU cannot be mapped, images are copied: %s", strerror(errno));
+		return -errno;
+	}
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	swu.base = (unsigned char *)base;
+	swu.size = st.st_size;
+	TRACE("SWU mapped, %zu bytes", swu.size);
+
+	return 0;
+}
+
+void swu_map_close(void)
+{
+	pthread_mutex_lock(&swu.lock);
+	while (swu.feeders)
+		pthread_cond_wait(&swu.idle, &swu.lock);
+	pthread_mutex_unlock(&swu.lock);
+
+	if (swu.base)
+		munmap(swu.base, swu.size);
+	free(swu.entries);
+	swu.base = NULL;
+	swu.size = 0;
+	swu.entries = NULL;
+	swu.nentries = 0;
+}
+
+bool swu_map_active(void)
+{
+	return swu.base != NULL;
+}
+
+unsigned char *swu_map_data(off_t offs, size_t len)
+{
+	if (!swu.base || offs < 0 || (size_t)offs > swu.size ||
+	    len > swu.size - offs)
+		return NULL;
+
+	return swu.base + offs;
+}
+
+int swu_map_add_image(struct img_type *img, off_t offs)
+{
+	struct swu_map_entry *entries;
+
+	if (!swu_map_data(offs, img->size))
+		return -EINVAL;
+
+	entries = realloc(swu.entries, (swu.nentries + 1) * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+	entries[swu.nentries].img = img;
+	entries[swu.nentries].offs = offs;
+	swu.entries = entries;
+	swu.nentries++;
+
+	return 0;
+}
+
+static struct swu_map_entry *swu_map_find(struct img_type *img)
+{
+	for (unsigned int i = 0; i < swu.nentries; i++) {
+		if (swu.entries[i].img == img)
+			return &swu.entries[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the image data if the image was not copied in TMPDIR
+ */
+unsigned char *swu_map_image_data(struct img_type *img)
+{
+	struct swu_map_entry *entry = swu_map_find(img);
+
+	return entry ? swu.base + entry->offs : NULL;
+}
+
+struct swu_feed {
+	int fd;
+	const unsigned char *data;
+	size_t size;
+	unsigned char hash[SHA256_HASH_LENGTH];
+	bool check;
+};
+
+static int swu_feed_write(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int swu_feed_image(struct swu_feed *feed)
+{
+	struct swupdate_digest *dgst = NULL;
+	unsigned char md_value[64];
+	unsigned int md_len = 0;
+	size_t pos = 0, len;
+	int ret;
+
+	if (feed->check) {
+		dgst = swupdate_HASH_init(SHA_DEFAULT);
+		if (!dgst)
+			return -ENOMEM;
+	}
+
+	/*
+	 * The last chunk is held back until the hash of the whole
+	 * image was checked: if it does not match, the reader gets
+	 * a truncated image and fails.
+	 */
+	do {
+		len = min(feed->size - pos, (size_t)SWU_FEED_CHUNK);
+		if (dgst && swupdate_HASH_update(dgst, feed->data + pos, len) < 0) {
+			ret = -EFAULT;
+			goto out;
+		}
+		if (pos + len == feed->size && dgst) {
+			if (swupdate_HASH_final(dgst, md_value, &md_len) < 0 ||
+			    md_len != SHA256_HASH_LENGTH ||
+			    swupdate_HASH_compare(feed->hash, md_value)) {
+				ERROR("HASH mismatch in mapped image, SWU changed after check");
+				ret = -EFAULT;
+				goto out;
+			}
+		}
+		ret = swu_feed_write(feed->fd, feed->data + pos, len);
+		pos += len;
+	} while (!ret && pos < feed->size);
+
+out:
+	if (dgst)
+		swupdate_HASH_cleanup(dgst);
+
+	return ret;
+}
+
+static void *swu_feed_thread(void *data)
+{
+	struct swu_feed *feed = (struct swu_feed *)data;
+	sigset_t sigpipe_mask;
+
+	/* a reader that stops early must not kill the process */
+	sigemptyset(&sigpipe_mask);
+	sigaddset(&sigpipe_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe_mask, NULL);
+
+	swu_feed_image(feed);
+	close(feed->fd);
+	free(feed);
+
+	/* the mapping can be released now */
+	pthread_mutex_lock(&swu.lock);
+	swu.feeders--;
+	pthread_cond_broadcast(&swu.idle);
+	pthread_mutex_unlock(&swu.lock);
+
+	return NULL;
+}
+
+/*
+ * Handlers reading from img->fdin get a pipe that delivers
+ * exactly img->size bytes of the image and reports EOF after it.
+ * The hash is checked again while feeding because the SWU file
+ * can be changed after the images were verified.
+ */
+int swu_map_image_fd(struct img_type *img)
+{
+	struct swu_map_entry *entry = swu_map_find(img);
+	struct swu_feed *feed;
+	pthread_attr_t attr;
+	pthread_t id;
+	int pipefd[2];
+	int ret;
+
+	if (!entry)
+		return -ENOENT;
+
+	feed = calloc(1, sizeof(*feed));
+	if (!feed)
+		return -ENOMEM;
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		ret = -errno;
+		ERROR("Cannot create pipe for %s: %s", img->fname, strerror(errno));
+		free(feed);
+		return ret;
+	}
+	feed->fd = pipefd[1];
+	feed->data = swu.base + entry->offs;
+	feed->size = img->size;
+	feed->check = IsValidHash(img->sha256);
+	if (feed->check)
+		memcpy(feed->hash, img->sha256, sizeof(feed->hash));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&swu.lock);
+	ret = pthread_create(&id, &attr, swu_feed_thread, feed);
+	if (!ret)
+		swu.feeders++;
+	pthread_mutex_unlock(&swu.lock);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		ERROR("Cannot start feeder for %s", img->fname);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(feed);
+		return -ret;
+	}
+
+	return pipefd[0];
+}
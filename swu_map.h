@@ -0,0 +1,31 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWU_MAP_H
+#define _SWU_MAP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "swupdate_image.h"
+
+/*
+ * When the SWU is a regular file, it is mapped into memory and the
+ * images are read from the mapping instead of being copied in TMPDIR.
+ * Scripts are still copied, but the images are not: a script must not
+ * expect to find an image in TMPDIR when the SWU was mapped.
+ * swu_map_image_fd() returns a pipe for handlers reading img->fdin,
+ * it cannot be seeked and ends after img->size bytes.
+ */
+int swu_map_open(int fd);
+void swu_map_close(void);
+bool swu_map_active(void);
+unsigned char *swu_map_data(off_t offs, size_t len);
+
+int swu_map_add_image(struct img_type *img, off_t offs);
+unsigned char *swu_map_image_data(struct img_type *img);
+int swu_map_image_fd(struct img_type *img);
+
+#endif
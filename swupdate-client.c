@@ -32,6 +32,7 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include "network_ipc.h"
+#include "network_ipc_frame.h"
 
 static void usage(void) {
 	fprintf(stdout, "client [OPTIONS] <image .swu to be installed>...\n");
@@ -110,8 +111,9 @@ static int end(RECOVERY_STATUS status)
 	if (status == SUCCESS && run_postupdate) {
 		fprintf(stdout, "Executing post-update actions.\n");
 		ipc_message msg;
-		msg.data.procmsg.len = 0;
-		if (ipc_postupdate(&msg) != 0 || msg.type != ACK) {
+		memset(&msg, 0, sizeof(msg));
+		msg.type = POST_UPDATE;
+		if (ipc_frame_send_cmd(&msg) != 0 || msg.type != ACK) {
 			fprintf(stderr, "Running post-update failed!\n");
 			end_status = EXIT_FAILURE;
 		}
@@ -33,6 +33,7 @@
 #include <json-c/json.h>
 
 #include "network_ipc.h"
+#include "network_ipc_frame.h"
 #include <progress_ipc.h>
 
 struct cmd_t;
@@ -132,7 +133,7 @@ static void send_msg(ipc_message *msg)
 	int rc;
 
 	fprintf(stdout, "Sending: '%s'", msg->data.procmsg.buf);
-	rc = ipc_send_cmd(msg);
+	rc = ipc_frame_send_cmd(msg);
 
 	fprintf(stdout, " returned %d\n", rc);
 	if (rc == 0) {
@@ -367,6 +368,7 @@ static int gethawkbitstatus(cmd_t  __attribute__((__unused__)) *cmd,
 	struct json_object *status;
 	struct json_object *time;
 
+	memset(&msg, 0, sizeof(msg));
 	msg.type = SWUPDATE_SUBPROCESS;
 	msg.data.procmsg.source = SOURCE_SURICATTA;
 	msg.data.procmsg.cmd = CMD_GET_STATUS;
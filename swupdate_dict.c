@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -21,18 +22,160 @@
 #include "bsdqueue.h"
 #include "util.h"
 #include "swupdate_dict.h"
+#include "arena.h"
 
-static int insert_list_elem(struct dict_list *list, const char *value)
+/*
+ * Entries and values are allocated in one block together with
+ * their string, and entries cache the hash of the key so that
+ * a lookup just compares the keys with the same hash.
+ *
+ * struct dict is a plain list head that callers iterate, so the
+ * hash index of a dictionary is carried by its first entry and
+ * handed over when the head changes. Without an index (allocation
+ * failed), lookups scan the list.
+ *
+ * Entries and values of parsed images can be taken from the update
+ * arena: they are not freed one by one, the arena releases them.
+ */
+#define DICT_INDEX_MIN_BUCKETS	8
+
+struct dict_entry_blk;
+
+struct dict_index {
+	unsigned int count;
+	unsigned int nbuckets;
+	struct dict_entry_blk **buckets;
+};
+
+struct dict_entry_blk {
+	struct dict_entry entry;
+	unsigned int hash;
+	struct dict_entry_blk *bucket_next;
+	/* only set on the head of the list */
+	struct dict_index *index;
+	bool in_arena;
+	char key[];
+};
+
+struct dict_list_elem_blk {
+	struct dict_list_elem elem;
+	bool in_arena;
+	char value[];
+};
+
+static inline struct dict_entry_blk *entry_blk(struct dict_entry *entry)
+{
+	return (struct dict_entry_blk *)entry;
+}
+
+static struct dict_index *dict_index(struct dict *dictionary)
+{
+	struct dict_entry *head = LIST_FIRST(dictionary);
+
+	return head ? entry_blk(head)->index : NULL;
+}
+
+static void index_link(struct dict_index *index, struct dict_entry_blk *blk)
+{
+	unsigned int n = blk->hash & (index->nbuckets - 1);
+
+	blk->bucket_next = index->buckets[n];
+	index->buckets[n] = blk;
+}
+
+static void index_unlink(struct dict_index *index, struct dict_entry_blk *blk)
+{
+	struct dict_entry_blk **p = &index->buckets[blk->hash & (index->nbuckets - 1)];
+
+	while (*p && *p != blk)
+		p = &(*p)->bucket_next;
+	if (*p)
+		*p = blk->bucket_next;
+	index->count--;
+}
+
+/* keep chains short, a failed resize leaves the old table */
+static void index_grow(struct dict *dictionary, struct dict_index *index)
 {
-	struct dict_list_elem *elem = (struct dict_list_elem *)malloc(sizeof(*elem));
+	unsigned int nbuckets = index->nbuckets * 2;
+	struct dict_entry_blk **buckets;
+	struct dict_entry *entry;
+
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (!buckets)
+		return;
+	free(index->buckets);
+	index->buckets = buckets;
+	index->nbuckets = nbuckets;
+
+	LIST_FOREACH(entry, dictionary, next)
+		index_link(index, entry_blk(entry));
+}
 
-	if (!elem)
+static struct dict_index *index_create(struct dict *dictionary)
+{
+	struct dict_index *index = calloc(1, sizeof(*index));
+	struct dict_entry *entry;
+
+	if (!index)
+		return NULL;
+	index->nbuckets = DICT_INDEX_MIN_BUCKETS;
+	index->buckets = calloc(index->nbuckets, sizeof(*index->buckets));
+	if (!index->buckets) {
+		free(index);
+		return NULL;
+	}
+
+	LIST_FOREACH(entry, dictionary, next) {
+		index_link(index, entry_blk(entry));
+		index->count++;
+	}
+
+	return index;
+}
+
+static void index_free(struct dict_index *index)
+{
+	if (!index)
+		return;
+	free(index->buckets);
+	free(index);
+}
+
+/* FNV-1a */
+static unsigned int key_hash(const char *key, size_t *len)
+{
+	unsigned int h = 2166136261u;
+	const char *s = key;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	*len = s - key;
+
+	return h;
+}
+
+static int insert_list_elem(struct dict_list *list, const char *value,
+			    bool in_arena)
+{
+	size_t len = strlen(value);
+	struct dict_list_elem_blk *blk;
+
+	if (in_arena)
+		blk = update_alloc(sizeof(*blk) + len + 1);
+	else
+		blk = malloc(sizeof(*blk) + len + 1);
+	if (!blk)
 		return -ENOMEM;
 
-	memset(elem, 0, sizeof(*elem));
-	elem->value = strdup(value);
+	memset(&blk->elem, 0, sizeof(blk->elem));
+	memcpy(blk->value, value, len + 1);
+	blk->elem.value = blk->value;
+	blk->in_arena = in_arena;
 
-	LIST_INSERT_HEAD(list, elem, next);
+	LIST_INSERT_HEAD(list, &blk->elem, next);
 
 	return 0;
 }
@@ -40,8 +183,8 @@ static int insert_list_elem(struct dict_list *list, const char *value)
 static void remove_list_elem(struct dict_list_elem *elem)
 {
 	LIST_REMOVE(elem, next);
-	free(elem->value);
-	free(elem);
+	if (!((struct dict_list_elem_blk *)elem)->in_arena)
+		free(elem);
 }
 
 static void remove_list(struct dict_list *list)
@@ -54,38 +197,94 @@ static void remove_list(struct dict_list *list)
 	}
 }
 
-static struct dict_entry *insert_entry(struct dict *dictionary, const char *key)
+static struct dict_entry *insert_entry(struct dict *dictionary, const char *key,
+				      bool in_arena)
 {
-	struct dict_entry *entry = (struct dict_entry *)malloc(sizeof(*entry));
-	if (!entry)
+	size_t len;
+	unsigned int hash = key_hash(key, &len);
+	struct dict_entry *head = LIST_FIRST(dictionary);
+	struct dict_entry_blk *blk;
+	struct dict_index *index;
+
+	if (in_arena)
+		blk = update_alloc(sizeof(*blk) + len + 1);
+	else
+		blk = malloc(sizeof(*blk) + len + 1);
+	if (!blk)
 		return NULL;
 
-	memset(entry, 0, sizeof(*entry));
-	entry->key = strdup(key);
+	memset(blk, 0, sizeof(*blk));
+	memcpy(blk->key, key, len + 1);
+	blk->hash = hash;
+	blk->entry.key = blk->key;
+	blk->in_arena = in_arena;
+
+	/* the new head takes over the index */
+	if (head) {
+		index = entry_blk(head)->index;
+		entry_blk(head)->index = NULL;
+	} else {
+		index = index_create(dictionary);
+	}
+
+	LIST_INSERT_HEAD(dictionary, &blk->entry, next);
+	blk->index = index;
 
-	LIST_INSERT_HEAD(dictionary, entry, next);
+	if (index) {
+		index_link(index, blk);
+		if (++index->count > 2 * index->nbuckets)
+			index_grow(dictionary, index);
+	}
 
-	return entry;
+	return &blk->entry;
 }
 
 static struct dict_entry *get_entry(struct dict *dictionary, const char *key)
 {
+	struct dict_index *index = dict_index(dictionary);
+	struct dict_entry_blk *blk;
 	struct dict_entry *entry;
+	size_t len;
+	unsigned int hash = key_hash(key, &len);
+
+	if (index) {
+		for (blk = index->buckets[hash & (index->nbuckets - 1)]; blk;
+		     blk = blk->bucket_next) {
+			if (blk->hash == hash && strcmp(key, blk->key) == 0)
+				return &blk->entry;
+		}
+		return NULL;
+	}
 
 	LIST_FOREACH(entry, dictionary, next) {
-		if (strcmp(key, entry->key) == 0)
+		if (entry_blk(entry)->hash == hash &&
+		    strcmp(key, entry->key) == 0)
 			return entry;
 	}
 
 	return NULL;
 }
 
-static void remove_entry(struct dict_entry *entry)
+static void remove_entry(struct dict *dictionary, struct dict_entry *entry)
 {
+	struct dict_index *index = dict_index(dictionary);
+	struct dict_entry *next = LIST_NEXT(entry, next);
+
+	if (index) {
+		index_unlink(index, entry_blk(entry));
+		/* only the head carries the index, hand it to the next entry */
+		if (entry == LIST_FIRST(dictionary)) {
+			if (next)
+				entry_blk(next)->index = index;
+			else
+				index_free(index);
+		}
+	}
+
 	LIST_REMOVE(entry, next);
-	free(entry->key);
 	remove_list(&entry->list);
-	free(entry);
+	if (!entry_blk(entry)->in_arena)
+		free(entry);
 }
 
 char *dict_entry_get_key(struct dict_entry *entry)
@@ -124,31 +323,55 @@ char *dict_get_value(struct dict *dictionary, const char *key)
 	return dict_entry_get_value(entry);
 }
 
-int dict_insert_value(struct dict *dictionary, const char *key, const char *value)
+static int __dict_insert_value(struct dict *dictionary, const char *key,
+			       const char *value, bool in_arena)
 {
 	struct dict_entry *entry = get_entry(dictionary, key);
 
 	if (!entry) {
-		entry = insert_entry(dictionary, key);
+		entry = insert_entry(dictionary, key, in_arena);
 		if (!entry)
 			return -ENOMEM;
 	}
 
-	return insert_list_elem(&entry->list, value);
+	return insert_list_elem(&entry->list, value, in_arena);
 }
 
-int dict_set_value(struct dict *dictionary, const char *key, const char *value)
+static int __dict_set_value(struct dict *dictionary, const char *key,
+			    const char *value, bool in_arena)
 {
 	struct dict_entry *entry = get_entry(dictionary, key);
 
 	if (entry)
-		remove_entry(entry);
+		remove_entry(dictionary, entry);
 
-	entry = insert_entry(dictionary, key);
+	entry = insert_entry(dictionary, key, in_arena);
 	if (!entry)
 		return -ENOMEM;
 
-	return insert_list_elem(&entry->list, value);
+	return insert_list_elem(&entry->list, value, in_arena);
+}
+
+int dict_insert_value(struct dict *dictionary, const char *key, const char *value)
+{
+	return __dict_insert_value(dictionary, key, value, false);
+}
+
+int dict_set_value(struct dict *dictionary, const char *key, const char *value)
+{
+	return __dict_set_value(dictionary, key, value, false);
+}
+
+int update_dict_insert_value(struct dict *dictionary, const char *key,
+			     const char *value)
+{
+	return __dict_insert_value(dictionary, key, value, true);
+}
+
+int update_dict_set_value(struct dict *dictionary, const char *key,
+			  const char *value)
+{
+	return __dict_set_value(dictionary, key, value, true);
 }
 
 void dict_remove(struct dict *dictionary, const char *key)
@@ -158,7 +381,7 @@ void dict_remove(struct dict *dictionary, const char *key)
 	if (!entry)
 		return;
 
-	remove_entry(entry);
+	remove_entry(dictionary, entry);
 }
 
 void dict_drop_db(struct dict *dictionary)
@@ -166,8 +389,13 @@ void dict_drop_db(struct dict *dictionary)
 	struct dict_entry *entry;
 	struct dict_entry *tmp;
 
+	if (!LIST_EMPTY(dictionary)) {
+		index_free(dict_index(dictionary));
+		entry_blk(LIST_FIRST(dictionary))->index = NULL;
+	}
+
 	LIST_FOREACH_SAFE(entry, dictionary, next, tmp) {
-		remove_entry(entry);
+		remove_entry(dictionary, entry);
 	}
 }
 
@@ -0,0 +1,238 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "bsdqueue.h"
+#include "util.h"
+#include "swupdate.h"
+#include "arena.h"
+#include "version_key.h"
+#include "swver_index.h"
+
+#define SWVER_INDEX_MIN_BUCKETS	64
+#define SWVER_ARENA_CHUNK	(16 * 1024)
+
+/* an installed version with its key, parsed when it is set */
+struct swver_entry {
+	struct sw_version swver;
+	struct version_key key;
+};
+
+struct swver_node {
+	struct sw_version *swver;
+	unsigned int hash;
+	struct swver_node *next;
+};
+
+static struct {
+	struct swver *list;
+	struct swver_node **buckets;
+	unsigned int nbuckets;
+	unsigned int nentries;
+} swver_idx;
+
+/*
+ * Installed versions are never removed, they live for the whole
+ * life of the process and are taken from their own arena.
+ */
+static struct arena swver_arena = {
+	.chunks = NULL,
+	.chunk_size = SWVER_ARENA_CHUNK,
+};
+
+/* FNV-1a */
+static unsigned int name_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+void swver_index_drop(void)
+{
+	struct swver_node *node, *next;
+
+	for (unsigned int i = 0; i < swver_idx.nbuckets; i++) {
+		for (node = swver_idx.buckets[i]; node; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+	free(swver_idx.buckets);
+	memset(&swver_idx, 0, sizeof(swver_idx));
+}
+
+static int swver_index_insert(struct sw_version *swver, bool tail)
+{
+	struct swver_node *node, **pnode;
+
+	node = calloc(1, sizeof(*node));
+	if (!node)
+		return -ENOMEM;
+	node->swver = swver;
+	node->hash = name_hash(swver->name);
+
+	pnode = &swver_idx.buckets[node->hash & (swver_idx.nbuckets - 1)];
+	if (tail) {
+		while (*pnode)
+			pnode = &(*pnode)->next;
+	}
+	node->next = *pnode;
+	*pnode = node;
+	swver_idx.nentries++;
+
+	return 0;
+}
+
+static int swver_index_build(struct swver *list)
+{
+	struct sw_version *swver;
+	unsigned int count = 0, nbuckets = SWVER_INDEX_MIN_BUCKETS;
+
+	swver_index_drop();
+
+	LIST_FOREACH(swver, list, next)
+		count++;
+	while (nbuckets < count)
+		nbuckets <<= 1;
+
+	swver_idx.buckets = calloc(nbuckets, sizeof(*swver_idx.buckets));
+	if (!swver_idx.buckets)
+		return -ENOMEM;
+	swver_idx.nbuckets = nbuckets;
+	swver_idx.list = list;
+
+	/* appending keeps the order of the list for the same name */
+	LIST_FOREACH(swver, list, next) {
+		if (swver_index_insert(swver, true)) {
+			swver_index_drop();
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static struct swver_node *swver_lookup(struct swver_node *node, const char *name,
+				       unsigned int hash)
+{
+	for (; node; node = node->next) {
+		if (node->hash == hash && !strcmp(node->swver->name, name))
+			return node;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fall back to scan the list if the index cannot be built
+ */
+static struct sw_version *swver_scan(struct sw_version *swver, const char *name)
+{
+	for (; swver; swver = LIST_NEXT(swver, next)) {
+		if (!strcmp(swver->name, name))
+			return swver;
+	}
+
+	return NULL;
+}
+
+struct sw_version *swver_find(struct swver *list, const char *name)
+{
+	struct swver_node *node;
+	unsigned int hash;
+
+	if (!list)
+		return NULL;
+
+	if (swver_idx.list != list && swver_index_build(list))
+		return swver_scan(LIST_FIRST(list), name);
+
+	hash = name_hash(name);
+	node = swver_lookup(swver_idx.buckets[hash & (swver_idx.nbuckets - 1)], name, hash);
+
+	return node ? node->swver : NULL;
+}
+
+struct sw_version *swver_find_next(struct swver *list, struct sw_version *swver)
+{
+	struct swver_node *node;
+	unsigned int hash;
+
+	if (!list || !swver)
+		return NULL;
+
+	if (swver_idx.list != list)
+		return swver_scan(LIST_NEXT(swver, next), swver->name);
+
+	hash = name_hash(swver->name);
+	for (node = swver_idx.buckets[hash & (swver_idx.nbuckets - 1)]; node; node = node->next) {
+		if (node->swver == swver)
+			break;
+	}
+	if (!node)
+		return swver_scan(LIST_NEXT(swver, next), swver->name);
+
+	node = swver_lookup(node->next, swver->name, hash);
+
+	return node ? node->swver : NULL;
+}
+
+static inline struct swver_entry *swver_entry(const struct sw_version *swver)
+{
+	return (struct swver_entry *)((char *)swver - offsetof(struct swver_entry, swver));
+}
+
+const struct version_key *swver_key(const struct sw_version *swver)
+{
+	return &swver_entry(swver)->key;
+}
+
+void swver_set_version(struct sw_version *swver, const char *version)
+{
+	strlcpy(swver->version, version, sizeof(swver->version));
+	version_key_parse(swver->version, &swver_entry(swver)->key);
+}
+
+struct sw_version *swver_add(struct swver *list, const char *name,
+			     const char *version)
+{
+	struct swver_entry *entry;
+	struct sw_version *swver;
+
+	entry = (struct swver_entry *)arena_alloc(&swver_arena, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	swver = &entry->swver;
+
+	strlcpy(swver->name, name, sizeof(swver->name));
+	swver_set_version(swver, version);
+	LIST_INSERT_HEAD(list, swver, next);
+
+	if (swver_idx.list != list)
+		return swver;
+
+	/* grow the table if it is getting crowded */
+	if (swver_idx.nentries >= 2 * swver_idx.nbuckets) {
+		if (swver_index_build(list))
+			return swver;
+	} else if (swver_index_insert(swver, false)) {
+		/* the index cannot be kept in sync, rebuild it on next lookup */
+		swver_index_drop();
+	}
+
+	return swver;
+}
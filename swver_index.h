@@ -0,0 +1,33 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _SWVER_INDEX_H
+#define _SWVER_INDEX_H
+
+#include "swupdate.h"
+#include "version_key.h"
+
+/*
+ * Hash index name -> installed versions. The list of installed
+ * components is the reference, the index is rebuilt if it refers
+ * to another list. Entries must be added with swver_add() to keep
+ * it in sync, entries with the same name are returned in the order
+ * of the list.
+ */
+struct sw_version *swver_find(struct swver *list, const char *name);
+struct sw_version *swver_find_next(struct swver *list, struct sw_version *swver);
+struct sw_version *swver_add(struct swver *list, const char *name,
+			     const char *version);
+
+/*
+ * The version of an entry created by swver_add() is parsed once,
+ * it must be changed with swver_set_version() to keep the key valid.
+ */
+const struct version_key *swver_key(const struct sw_version *swver);
+void swver_set_version(struct sw_version *swver, const char *version);
+void swver_index_drop(void);
+
+#endif
@@ -0,0 +1,280 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bootloader.h"
+#include "bootloader_txn.h"
+#include "swupdate_dict.h"
+
+static int setup(void **state)
+{
+	(void)state;
+	return set_bootloader(BOOTLOADER_NONE);
+}
+
+static void assert_env(const char *name, const char *value)
+{
+	char *v = bootloader_env_get(name);
+
+	if (value) {
+		assert_non_null(v);
+		assert_string_equal(v, value);
+	} else {
+		assert_null(v);
+	}
+	free(v);
+}
+
+static void test_env_write_through(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+
+	(void)state;
+	assert_int_equal(bootloader_env_set("a", "1"), 0);
+	assert_int_equal(bootloader_env_set("b", "2"), 0);
+	assert_int_equal(bootloader_env_unset("a"), 0);
+	assert_int_equal(bootloader_env_stores(), stores + 3);
+	assert_env("a", NULL);
+	assert_env("b", "2");
+}
+
+static void test_env_transaction(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+	char name[16];
+
+	(void)state;
+	assert_int_equal(bootloader_env_begin(), 0);
+	for (int i = 0; i < 10; i++) {
+		snprintf(name, sizeof(name), "var%d", i);
+		assert_int_equal(bootloader_env_set(name, "x"), 0);
+	}
+	assert_int_equal(bootloader_env_unset("var3"), 0);
+	/* changes are visible before commit */
+	assert_env("var9", "x");
+	assert_env("var3", NULL);
+	assert_int_equal(bootloader_env_stores(), stores);
+
+	assert_int_equal(bootloader_env_commit(), 0);
+	assert_int_equal(bootloader_env_stores(), stores + 1);
+	assert_env("var0", "x");
+}
+
+static void test_env_transaction_nested(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+
+	(void)state;
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("ustate", "1"), 0);
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("upgrade_available", "1"), 0);
+	assert_int_equal(bootloader_env_commit(), 0);
+	assert_int_equal(bootloader_env_stores(), stores);
+	assert_int_equal(bootloader_env_commit(), 0);
+	assert_int_equal(bootloader_env_stores(), stores + 1);
+}
+
+static void test_env_transaction_empty(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+
+	(void)state;
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_env("ustate", "1");
+	assert_int_equal(bootloader_env_commit(), 0);
+	assert_int_equal(bootloader_env_stores(), stores);
+
+	/* unbalanced commit */
+	assert_int_equal(bootloader_env_commit(), -EINVAL);
+}
+
+static void test_env_transaction_abort(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+
+	(void)state;
+	assert_int_equal(bootloader_env_set("keep", "1"), 0);
+	stores++;
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("keep", "2"), 0);
+	assert_int_equal(bootloader_env_set("drop", "1"), 0);
+	assert_int_equal(bootloader_env_abort(), 0);
+	assert_int_equal(bootloader_env_stores(), stores);
+	assert_env("keep", "1");
+	assert_env("drop", NULL);
+
+	/* the transaction is over */
+	assert_int_equal(bootloader_env_abort(), -EINVAL);
+}
+
+static void test_env_transaction_abort_nested(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+
+	(void)state;
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("outer", "1"), 0);
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("inner", "1"), 0);
+	assert_int_equal(bootloader_env_abort(), 0);
+	/* the outer commit cannot store a part of the transaction */
+	assert_int_equal(bootloader_env_commit(), -ECANCELED);
+	assert_int_equal(bootloader_env_stores(), stores);
+	assert_env("outer", NULL);
+	assert_env("inner", NULL);
+}
+
+/* a backend whose environment cannot be opened for a transaction */
+static struct dict failing_env;
+
+static int failing_env_set(const char *name, const char *value)
+{
+	return dict_set_value(&failing_env, name, value);
+}
+
+static int failing_env_unset(const char *name)
+{
+	dict_remove(&failing_env, name);
+	return 0;
+}
+
+static char *failing_env_get(const char *name)
+{
+	char *value = dict_get_value(&failing_env, name);
+
+	return value ? strdup(value) : NULL;
+}
+
+static int failing_apply_list(const char *filename)
+{
+	return dict_parse_script(&failing_env, filename);
+}
+
+static int failing_begin(void)
+{
+	return -ENODATA;
+}
+
+static int failing_commit(void)
+{
+	return -EINVAL;
+}
+
+static bootloader failing = {
+	.env_get = &failing_env_get,
+	.env_set = &failing_env_set,
+	.env_unset = &failing_env_unset,
+	.apply_list = &failing_apply_list
+};
+
+static bootloader_txn failing_txn = {
+	.begin = &failing_begin,
+	.commit = &failing_commit,
+	.abort = &failing_commit
+};
+
+static void *set_other(void *arg)
+{
+	*(int *)arg = bootloader_env_set("other", "1");
+
+	return NULL;
+}
+
+static void test_env_transaction_begin_fails(void **state)
+{
+	unsigned int stores;
+	pthread_t thread;
+	int ret = 1;
+
+	(void)state;
+	assert_int_equal(register_bootloader("failing", &failing), 0);
+	assert_int_equal(register_bootloader_txn("failing", &failing_txn), 0);
+	assert_int_equal(set_bootloader("failing"), 0);
+	stores = bootloader_env_stores();
+
+	/* the changes are stored one by one */
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("a", "1"), 0);
+	assert_int_equal(bootloader_env_stores(), stores + 1);
+	assert_int_equal(bootloader_env_commit(), 0);
+	assert_int_equal(bootloader_env_stores(), stores + 1);
+
+	/* the environment is not left locked */
+	assert_int_equal(pthread_create(&thread, NULL, set_other, &ret), 0);
+	assert_int_equal(pthread_join(thread, NULL), 0);
+	assert_int_equal(ret, 0);
+	assert_env("other", "1");
+
+	dict_drop_db(&failing_env);
+	assert_int_equal(set_bootloader(BOOTLOADER_NONE), 0);
+}
+
+static void *other_thread(void *arg)
+{
+	int *ret = arg;
+
+	/* not the owner of the transaction */
+	ret[0] = bootloader_env_commit();
+	/* waits for the transaction to end */
+	ret[1] = bootloader_env_set("other", "1");
+
+	return NULL;
+}
+
+static void test_env_transaction_owner(void **state)
+{
+	unsigned int stores = bootloader_env_stores();
+	int ret[2] = { 1, 1 };
+	pthread_t thread;
+	char *v;
+
+	(void)state;
+	assert_int_equal(bootloader_env_begin(), 0);
+	assert_int_equal(bootloader_env_set("mine", "1"), 0);
+	assert_int_equal(pthread_create(&thread, NULL, other_thread, ret), 0);
+	/* give the other thread time to block */
+	usleep(100000);
+	assert_int_equal(ret[0], -EINVAL);
+	assert_int_equal(ret[1], 1);
+	v = bootloader_env_get("other");
+	assert_null(v);
+	assert_int_equal(bootloader_env_commit(), 0);
+	assert_int_equal(pthread_join(thread, NULL), 0);
+
+	assert_int_equal(ret[1], 0);
+	assert_int_equal(bootloader_env_stores(), stores + 2);
+	assert_env("mine", "1");
+	assert_env("other", "1");
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest bootloader_txn_tests[] = {
+		cmocka_unit_test(test_env_write_through),
+		cmocka_unit_test(test_env_transaction),
+		cmocka_unit_test(test_env_transaction_nested),
+		cmocka_unit_test(test_env_transaction_empty),
+		cmocka_unit_test(test_env_transaction_abort),
+		cmocka_unit_test(test_env_transaction_abort_nested),
+		cmocka_unit_test(test_env_transaction_owner),
+		cmocka_unit_test(test_env_transaction_begin_fails),
+	};
+	error_count += cmocka_run_group_tests_name("bootloader_txn",
+						   bootloader_txn_tests,
+						   setup, NULL);
+	return error_count;
+}
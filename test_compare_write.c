@@ -0,0 +1,161 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "swupdate_dict.h"
+#include "swupdate_image.h"
+#include "swupdate_status.h"
+#include "progress.h"
+
+#define BLOCK		4096
+#define NBLOCKS		16
+#define DST_SEEK	(2 * BLOCK)
+
+static char info[PRINFOSIZE];
+
+/* copyimage() reports the written and skipped blocks as progress info */
+void __wrap_swupdate_progress_info(RECOVERY_STATUS status, int cause, const char *msg);
+void __wrap_swupdate_progress_info(RECOVERY_STATUS status, int cause, const char *msg)
+{
+	(void)status;
+	(void)cause;
+	strlcpy(info, msg, sizeof(info));
+}
+
+/* changed blocks next to each other must be written at once */
+static unsigned int pwrites;
+
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	pwrites++;
+	return __real_pwrite(fd, buf, count, offset);
+}
+
+static int tmpfile_with(const unsigned char *data, size_t len)
+{
+	char name[] = "/tmp/swupdate-compare-XXXXXX";
+	int fd = mkstemp(name);
+
+	assert_true(fd >= 0);
+	unlink(name);
+	assert_int_equal(write(fd, data, len), len);
+	assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+
+	return fd;
+}
+
+static void fill(unsigned char *buf, size_t len, unsigned char seed)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (unsigned char)(i * 31 + seed);
+}
+
+static void run_compare(int dstflags, unsigned long long *written,
+			unsigned long long *skipped)
+{
+	size_t size = NBLOCKS * BLOCK;
+	unsigned char *src = malloc(size);
+	unsigned char *dst = malloc(DST_SEEK + size);
+	unsigned char *check = malloc(DST_SEEK + size);
+	struct img_type img;
+	char path[64];
+	int fdout, fddst;
+
+	assert_non_null(src);
+	assert_non_null(dst);
+	assert_non_null(check);
+
+	/*
+	 * The destination has the image at DST_SEEK, except for
+	 * blocks 5, 6 (one run) and 9 and a short tail.
+	 */
+	fill(src, size, 1);
+	memset(dst, 0xAA, DST_SEEK);
+	memcpy(dst + DST_SEEK, src, size);
+	dst[DST_SEEK + 5 * BLOCK] ^= 1;
+	dst[DST_SEEK + 7 * BLOCK - 1] ^= 1;
+	dst[DST_SEEK + 9 * BLOCK + 100] ^= 1;
+
+	memset(&img, 0, sizeof(img));
+	LIST_INIT(&img.properties);
+	dict_set_value(&img.properties, "compare-before-write", "true");
+	img.fdin = tmpfile_with(src, size);
+	img.size = size;
+	img.seek = DST_SEEK;
+
+	fddst = tmpfile_with(dst, DST_SEEK + size - 100);
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fddst);
+	fdout = open(path, dstflags);
+	assert_true(fdout >= 0);
+
+	info[0] = '\0';
+	pwrites = 0;
+	assert_int_equal(copyimage(&fdout, &img, NULL), 0);
+	assert_true(sscanf(strstr(info, "\"written\""),
+			   "\"written\": %llu, \"skipped\": %llu",
+			   written, skipped) == 2);
+
+	/* the destination must hold the image, the data before is untouched */
+	assert_int_equal(pread(fddst, check, DST_SEEK + size, 0),
+			 (ssize_t)(DST_SEEK + size));
+	assert_memory_equal(check, dst, DST_SEEK);
+	assert_memory_equal(check + DST_SEEK, src, size);
+
+	close(fdout);
+	close(fddst);
+	close(img.fdin);
+	dict_drop_db(&img.properties);
+	free(check);
+	free(dst);
+	free(src);
+}
+
+static void test_compare_skip_merge(void **state)
+{
+	unsigned long long written, skipped;
+
+	(void)state;
+	run_compare(O_RDWR, &written, &skipped);
+	/* blocks 5, 6, 9 and the last one differ */
+	assert_int_equal(written, 4);
+	assert_int_equal(skipped, NBLOCKS - 4);
+	assert_int_equal(pwrites, 3);
+}
+
+static void test_compare_write_only(void **state)
+{
+	unsigned long long written, skipped;
+
+	(void)state;
+	/* the destination cannot be read back, everything is written */
+	run_compare(O_WRONLY, &written, &skipped);
+	assert_int_equal(written, NBLOCKS);
+	assert_int_equal(skipped, 0);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest compare_write_tests[] = {
+		cmocka_unit_test(test_compare_skip_merge),
+		cmocka_unit_test(test_compare_write_only),
+	};
+	error_count += cmocka_run_group_tests_name("compare_write",
+						   compare_write_tests,
+						   NULL, NULL);
+	return error_count;
+}
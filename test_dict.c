@@ -0,0 +1,150 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+
+#include "bsdqueue.h"
+#include "swupdate_dict.h"
+
+#define NUM_KEYS	1000
+
+static void test_dict_set_get(void **state)
+{
+	struct dict dictionary;
+	char key[32], value[32];
+
+	(void)state;
+	LIST_INIT(&dictionary);
+
+	for (int i = 0; i < NUM_KEYS; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		snprintf(value, sizeof(value), "value%d", i);
+		assert_int_equal(dict_set_value(&dictionary, key, value), 0);
+	}
+
+	for (int i = NUM_KEYS - 1; i >= 0; i--) {
+		snprintf(key, sizeof(key), "key%d", i);
+		snprintf(value, sizeof(value), "value%d", i);
+		assert_string_equal(dict_get_value(&dictionary, key), value);
+	}
+	assert_null(dict_get_value(&dictionary, "key"));
+	assert_null(dict_get_value(&dictionary, "key1000"));
+
+	assert_int_equal(dict_set_value(&dictionary, "key5", "changed"), 0);
+	assert_string_equal(dict_get_value(&dictionary, "key5"), "changed");
+
+	dict_remove(&dictionary, "key5");
+	assert_null(dict_get_value(&dictionary, "key5"));
+	assert_string_equal(dict_get_value(&dictionary, "key6"), "value6");
+
+	dict_drop_db(&dictionary);
+	assert_true(LIST_EMPTY(&dictionary));
+}
+
+/*
+ * Removing the head hands the lookup index to the next entry
+ */
+static void test_dict_remove(void **state)
+{
+	struct dict dictionary;
+	char key[32];
+
+	(void)state;
+	LIST_INIT(&dictionary);
+
+	for (int i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		assert_int_equal(dict_set_value(&dictionary, key, key), 0);
+	}
+
+	for (int i = 99; i >= 0; i -= 2) {
+		snprintf(key, sizeof(key), "key%d", i);
+		dict_remove(&dictionary, key);
+		assert_null(dict_get_value(&dictionary, key));
+	}
+	for (int i = 0; i < 100; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		if (i % 2)
+			assert_null(dict_get_value(&dictionary, key));
+		else
+			assert_string_equal(dict_get_value(&dictionary, key), key);
+	}
+
+	for (int i = 0; i < 100; i += 2) {
+		snprintf(key, sizeof(key), "key%d", i);
+		dict_remove(&dictionary, key);
+	}
+	assert_true(LIST_EMPTY(&dictionary));
+
+	/* an emptied dictionary can be used again */
+	assert_int_equal(dict_set_value(&dictionary, "a", "1"), 0);
+	assert_string_equal(dict_get_value(&dictionary, "a"), "1");
+	dict_drop_db(&dictionary);
+}
+
+/*
+ * Callers iterate the dictionary directly: entries and
+ * values are returned starting from the last inserted one.
+ */
+static void test_dict_order(void **state)
+{
+	struct dict dictionary;
+	struct dict_entry *entry;
+	struct dict_list_elem *elem;
+	const char *keys[] = { "c", "a", "b" };
+	int i;
+
+	(void)state;
+	LIST_INIT(&dictionary);
+
+	for (i = 0; i < 3; i++)
+		assert_int_equal(dict_set_value(&dictionary, keys[i], keys[i]), 0);
+
+	i = 2;
+	LIST_FOREACH(entry, &dictionary, next) {
+		assert_true(i >= 0);
+		assert_string_equal(dict_entry_get_key(entry), keys[i]);
+		assert_string_equal(dict_entry_get_value(entry), keys[i]);
+		i--;
+	}
+	assert_int_equal(i, -1);
+
+	assert_int_equal(dict_insert_value(&dictionary, "list", "first"), 0);
+	assert_int_equal(dict_insert_value(&dictionary, "list", "second"), 0);
+	assert_string_equal(dict_get_value(&dictionary, "list"), "second");
+
+	elem = LIST_FIRST(dict_get_list(&dictionary, "list"));
+	assert_non_null(elem);
+	assert_string_equal(elem->value, "second");
+	elem = LIST_NEXT(elem, next);
+	assert_non_null(elem);
+	assert_string_equal(elem->value, "first");
+	assert_null(LIST_NEXT(elem, next));
+
+	/* replacing a key moves it to the head */
+	assert_int_equal(dict_set_value(&dictionary, "c", "new"), 0);
+	entry = LIST_FIRST(&dictionary);
+	assert_string_equal(dict_entry_get_key(entry), "c");
+	assert_string_equal(dict_entry_get_value(entry), "new");
+
+	dict_drop_db(&dictionary);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest dict_tests[] = {
+		cmocka_unit_test(test_dict_set_get),
+		cmocka_unit_test(test_dict_remove),
+		cmocka_unit_test(test_dict_order)
+	};
+	error_count += cmocka_run_group_tests_name("dict", dict_tests, NULL, NULL);
+	return error_count;
+}
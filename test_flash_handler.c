@@ -1408,6 +1408,85 @@ static void test_multiple_callbacks(void **state)
 	run_flash_test(state, 0);
 }
 
+#ifdef CONFIG_CFIHAMMING1
+void flash_hamming1_ecc(const unsigned char *sector, unsigned char *code,
+			unsigned int sector_size);
+
+/*
+ * Bit by bit 1-bit Hamming code as generated by TI's GenECC: bits 0-2
+ * are the column parities, the following ones the row parities of the
+ * bytes whose offset has the bit cleared (even) or set (odd).
+ */
+static void reference_hamming1_ecc(const unsigned char *buf,
+				   unsigned char *code, unsigned int size)
+{
+	static const unsigned char even_cols[] = { 0x55, 0x33, 0x0f };
+	unsigned int even = 0, odd = 0;
+	int bits = 0;
+
+	while ((1U << bits) < size)
+		bits++;
+
+	for (unsigned int i = 0; i < size * 8; i++) {
+		unsigned int byte = i / 8, bit = i % 8;
+
+		if (!(buf[byte] & (1 << bit)))
+			continue;
+		for (int c = 0; c < 3; c++) {
+			if (even_cols[c] & (1 << bit))
+				even ^= 1 << c;
+			else
+				odd ^= 1 << c;
+		}
+		for (int r = 0; r < bits; r++) {
+			if (byte & (1U << r))
+				odd ^= 1 << (3 + r);
+			else
+				even ^= 1 << (3 + r);
+		}
+	}
+
+	code[0] = even & 0xff;
+	code[1] = odd & 0xff;
+	code[2] = ((even >> 8) | (odd >> 8) << 4) & 0xff;
+}
+
+static void test_hamming1_ecc(void UNUSED **state)
+{
+	unsigned char buf[2048];
+	unsigned char code[3], expected[3];
+
+	memset(buf, 0xff, 512);
+	flash_hamming1_ecc(buf, code, 512);
+	assert_memory_equal(code, ((unsigned char []){ 0x00, 0x00, 0x00 }), 3);
+
+	buf[0] ^= 0x01;
+	flash_hamming1_ecc(buf, code, 512);
+	assert_memory_equal(code, ((unsigned char []){ 0xff, 0x00, 0x0f }), 3);
+	buf[0] ^= 0x01;
+
+	buf[511] ^= 0x80;
+	flash_hamming1_ecc(buf, code, 512);
+	assert_memory_equal(code, ((unsigned char []){ 0x00, 0xff, 0xf0 }), 3);
+	buf[511] ^= 0x80;
+
+	buf[0x155] ^= 0x10;
+	flash_hamming1_ecc(buf, code, 512);
+	assert_memory_equal(code, ((unsigned char []){ 0x53, 0xac, 0xa5 }), 3);
+
+	srand(1);
+	for (int n = 0; n < 200; n++) {
+		unsigned int size = 256U << (n % 4);
+
+		for (unsigned int i = 0; i < size; i++)
+			buf[i] = rand();
+		flash_hamming1_ecc(buf, code, size);
+		reference_hamming1_ecc(buf, expected, size);
+		assert_memory_equal(code, expected, 3);
+	}
+}
+#endif
+
 #define TEST(name) \
 	cmocka_unit_test_setup_teardown(test_##name, test_setup, test_teardown)
 
@@ -1450,6 +1529,9 @@ int main(void)
 		TEST(mtd_write_bad_block_mark_not_supported),
 		TEST(mtd_write_bad_block_mark_failure),
 		TEST(multiple_callbacks),
+#ifdef CONFIG_CFIHAMMING1
+		cmocka_unit_test(test_hamming1_ecc),
+#endif
 	};
 	return cmocka_run_group_tests_name("flash_handler", tests, group_setup,
 	                                   group_teardown);
@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+
+#include "bsdqueue.h"
+#include "swupdate_image.h"
+#include "img_index.h"
+
+#define NUM_IMAGES	5000
+
+static struct imglist images;
+static struct img_type *imgs;
+
+static int index_setup(void **state)
+{
+	(void)state;
+	LIST_INIT(&images);
+	imgs = calloc(NUM_IMAGES, sizeof(*imgs));
+	if (!imgs)
+		return -1;
+	/*
+	 * Insert in reverse order so that the list
+	 * is ordered as the array. The last two images
+	 * share the same file.
+	 */
+	for (int i = NUM_IMAGES - 1; i >= 0; i--) {
+		snprintf(imgs[i].fname, sizeof(imgs[i].fname), "layer-%d.tar",
+			 i < NUM_IMAGES - 1 ? i : i - 1);
+		LIST_INSERT_HEAD(&images, &imgs[i], next);
+	}
+	return 0;
+}
+
+static int index_teardown(void **state)
+{
+	(void)state;
+	free(imgs);
+	return 0;
+}
+
+static void test_img_index_lookup(void **state)
+{
+	struct img_index *index;
+	struct img_index_entry *entry;
+	char fname[64];
+
+	(void)state;
+	index = img_index_build(&images);
+	assert_non_null(index);
+	assert_int_equal(index->nentries, NUM_IMAGES);
+
+	for (int i = 0; i < NUM_IMAGES - 2; i++) {
+		snprintf(fname, sizeof(fname), "layer-%d.tar", i);
+		entry = img_index_find(index, fname);
+		assert_non_null(entry);
+		assert_true(entry->img == &imgs[i]);
+		assert_null(img_index_next(index, entry));
+	}
+
+	assert_null(img_index_find(index, "missing.tar"));
+	img_index_free(index);
+}
+
+static void test_img_index_duplicates(void **state)
+{
+	struct img_index *index;
+	struct img_index_entry *entry;
+	char fname[64];
+
+	(void)state;
+	index = img_index_build(&images);
+	assert_non_null(index);
+
+	snprintf(fname, sizeof(fname), "layer-%d.tar", NUM_IMAGES - 2);
+	entry = img_index_find(index, fname);
+	assert_non_null(entry);
+	assert_true(entry->img == &imgs[NUM_IMAGES - 2]);
+	entry = img_index_next(index, entry);
+	assert_non_null(entry);
+	assert_true(entry->img == &imgs[NUM_IMAGES - 1]);
+	assert_null(img_index_next(index, entry));
+
+	img_index_free(index);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest img_index_tests[] = {
+		cmocka_unit_test(test_img_index_lookup),
+		cmocka_unit_test(test_img_index_duplicates)
+	};
+	error_count += cmocka_run_group_tests_name("img_index", img_index_tests,
+						   index_setup, index_teardown);
+	return error_count;
+}
@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "network_ipc.h"
+#include "network_ipc_frame.h"
+
+static int sockets[2];
+
+static int frame_setup(void **state)
+{
+	(void)state;
+	return socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+}
+
+static int frame_teardown(void **state)
+{
+	(void)state;
+	close(sockets[0]);
+	close(sockets[1]);
+	return 0;
+}
+
+static void test_frame_payload_len(void **state)
+{
+	ipc_message msg;
+
+	(void)state;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = ACK;
+	assert_int_equal(ipc_frame_payload_len(&msg), 0);
+
+	strcpy(msg.data.msg, "hello");
+	assert_int_equal(ipc_frame_payload_len(&msg), strlen("hello"));
+
+	msg.data.procmsg.len = 3;
+	strcpy(msg.data.procmsg.buf, "abc");
+	assert_int_equal(ipc_frame_payload_len(&msg),
+			 offsetof(msgdata, procmsg.buf) + 3);
+}
+
+static void test_frame_size(void **state)
+{
+	struct ipc_frame_hdr hdr;
+	ipc_message msg;
+
+	(void)state;
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	assert_int_equal(ipc_frame_size(&msg, 0), sizeof(int));
+	assert_int_equal(ipc_frame_size(&msg, sizeof(int)), sizeof(ipc_message));
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = IPC_FRAME_MAGIC;
+	hdr.version = IPC_FRAME_VERSION;
+	hdr.len = 10;
+	assert_int_equal(ipc_frame_size(&hdr, sizeof(int)), sizeof(hdr));
+	assert_int_equal(ipc_frame_size(&hdr, sizeof(hdr)), sizeof(hdr) + 10);
+
+	hdr.len = sizeof(msgdata) + 1;
+	assert_true(ipc_frame_size(&hdr, sizeof(hdr)) < 0);
+
+	hdr.len = 10;
+	hdr.version = IPC_FRAME_VERSION + 1;
+	assert_true(ipc_frame_size(&hdr, sizeof(hdr)) < 0);
+}
+
+static void roundtrip(bool framed)
+{
+	ipc_message msg, rcv;
+	bool rcv_framed;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = SWUPDATE_SUBPROCESS;
+	msg.data.procmsg.cmd = 3;
+	msg.data.procmsg.len = strlen("{\"polling\": 10}");
+	strcpy(msg.data.procmsg.buf, "{\"polling\": 10}");
+
+	assert_int_equal(ipc_frame_write(sockets[0], &msg, framed), 0);
+	assert_int_equal(ipc_frame_read(sockets[1], &rcv, &rcv_framed), 0);
+	assert_int_equal(rcv_framed, framed);
+	assert_memory_equal(&msg, &rcv, sizeof(msg));
+}
+
+static void test_frame_roundtrip_legacy(void **state)
+{
+	(void)state;
+	roundtrip(false);
+}
+
+static void test_frame_roundtrip_framed(void **state)
+{
+	(void)state;
+	roundtrip(true);
+}
+
+/* an encoded message is what ipc_frame_write() sends */
+static void test_frame_encode(void **state)
+{
+	char buf[IPC_FRAME_MAX_SIZE];
+	ipc_message msg, rcv;
+	size_t len;
+
+	(void)state;
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = IPC_MAGIC;
+	msg.type = NOTIFY_STREAM;
+	strcpy(msg.data.notify.msg, "Installation in progress");
+
+	len = ipc_frame_encode(&msg, true, buf);
+	assert_int_equal(len, sizeof(struct ipc_frame_hdr) + ipc_frame_payload_len(&msg));
+	assert_int_equal(ipc_frame_decode(buf, len, &rcv), 1);
+	assert_memory_equal(&msg, &rcv, sizeof(msg));
+
+	len = ipc_frame_encode(&msg, false, buf);
+	assert_int_equal(len, sizeof(msg));
+	assert_int_equal(ipc_frame_decode(buf, len, &rcv), 0);
+	assert_memory_equal(&msg, &rcv, sizeof(msg));
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest frame_tests[] = {
+		cmocka_unit_test(test_frame_payload_len),
+		cmocka_unit_test(test_frame_size),
+		cmocka_unit_test(test_frame_roundtrip_legacy),
+		cmocka_unit_test(test_frame_roundtrip_framed),
+		cmocka_unit_test(test_frame_encode)
+	};
+	error_count += cmocka_run_group_tests_name("ipc_frame", frame_tests,
+						   frame_setup, frame_teardown);
+	return error_count;
+}
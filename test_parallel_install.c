@@ -0,0 +1,183 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "swupdate.h"
+#include "swupdate_dict.h"
+#include "swupdate_image.h"
+#include "handler.h"
+#include "handler_parallel.h"
+#include "installer.h"
+
+#define NIMAGES		3
+#define INSTALL_TIME_MS	200
+
+/* progress is not under test, the progress thread is not running */
+void __wrap_swupdate_progress_inc_step(const char *image, const char *handler_name);
+void __wrap_swupdate_progress_inc_step(const char *image, const char *handler_name)
+{
+	(void)image;
+	(void)handler_name;
+}
+
+void __wrap_swupdate_progress_step_completed(void);
+void __wrap_swupdate_progress_step_completed(void)
+{
+}
+
+static const char *names[NIMAGES] = { "a.img", "b.img", "c.img" };
+static struct img_type images[NIMAGES];
+static struct timespec started[NIMAGES], ended[NIMAGES];
+
+static long long ms(const struct timespec *t)
+{
+	return (long long)t->tv_sec * 1000 + t->tv_nsec / 1000000;
+}
+
+static int image_index(struct img_type *img)
+{
+	for (int i = 0; i < NIMAGES; i++) {
+		if (!strcmp(img->fname, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+static int install_slow(struct img_type *img, void *data)
+{
+	int i = image_index(img);
+	struct timespec delay = {
+		.tv_sec = 0,
+		.tv_nsec = INSTALL_TIME_MS * 1000000L
+	};
+
+	(void)data;
+	if (i < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &started[i]);
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ended[i]);
+
+	return 0;
+}
+
+static int setup(void **state)
+{
+	(void)state;
+	if (register_handler("test-parallel", install_slow, IMAGE_HANDLER, NULL) ||
+	    register_handler_thread_safe("test-parallel"))
+		return -1;
+	return register_handler("test-serial", install_slow, IMAGE_HANDLER, NULL);
+}
+
+static void create_tmpfile(const char *name)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%s", get_tmpdir(), name);
+	fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, name, strlen(name)), strlen(name));
+	close(fd);
+}
+
+static void prepare(struct swupdate_cfg *sw, const char *type)
+{
+	memset(sw, 0, sizeof(*sw));
+	LIST_INIT(&sw->images);
+	LIST_INIT(&sw->scripts);
+	LIST_INIT(&sw->bootloader);
+	LIST_INIT(&sw->vars);
+
+	memset(images, 0, sizeof(images));
+	memset(started, 0, sizeof(started));
+	memset(ended, 0, sizeof(ended));
+	for (int i = NIMAGES - 1; i >= 0; i--) {
+		struct img_type *img = &images[i];
+
+		strlcpy(img->fname, names[i], sizeof(img->fname));
+		strlcpy(img->type, type, sizeof(img->type));
+		snprintf(img->device, sizeof(img->device), "/dev/target%d", i);
+		LIST_INIT(&img->properties);
+		dict_set_value(&img->properties, "install-parallel", "true");
+		create_tmpfile(names[i]);
+		LIST_INSERT_HEAD(&sw->images, img, next);
+	}
+	/* c.img must not start before a.img is installed */
+	dict_set_value(&images[2].properties, "install-after", "a.img");
+}
+
+static void cleanup(void)
+{
+	char path[256];
+
+	for (int i = 0; i < NIMAGES; i++) {
+		dict_drop_db(&images[i].properties);
+		snprintf(path, sizeof(path), "%s%s", get_tmpdir(), names[i]);
+		unlink(path);
+	}
+}
+
+static void test_install_parallel(void **state)
+{
+	struct swupdate_cfg sw;
+
+	(void)state;
+	prepare(&sw, "test-parallel");
+	assert_int_equal(install_images(&sw), 0);
+
+	for (int i = 0; i < NIMAGES; i++)
+		assert_true(ms(&ended[i]) > 0);
+
+	/* a.img and b.img run at the same time */
+	assert_true(ms(&started[1]) < ms(&ended[0]));
+	assert_true(ms(&started[0]) < ms(&ended[1]));
+
+	/* c.img waits for a.img */
+	assert_true(ms(&started[2]) >= ms(&ended[0]));
+
+	cleanup();
+}
+
+static void test_install_parallel_not_thread_safe(void **state)
+{
+	struct swupdate_cfg sw;
+
+	(void)state;
+	/* the flag is rejected, nothing is installed */
+	prepare(&sw, "test-serial");
+	assert_int_equal(install_images(&sw), -EINVAL);
+	for (int i = 0; i < NIMAGES; i++)
+		assert_int_equal(ms(&started[i]), 0);
+
+	cleanup();
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest parallel_install_tests[] = {
+		cmocka_unit_test(test_install_parallel),
+		cmocka_unit_test(test_install_parallel_not_thread_safe),
+	};
+	error_count += cmocka_run_group_tests_name("parallel_install",
+						   parallel_install_tests,
+						   setup, NULL);
+	return error_count;
+}
@@ -0,0 +1,125 @@
+// SPDX-FileCopyrightText: 2026 SWUpdate contributors
+//
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <string.h>
+
+#include "swupdate.h"
+#include "version_key.h"
+#include "swver_index.h"
+
+struct version_test {
+	const char *left;
+	const char *right;
+	int result;
+};
+
+static const struct version_test corpus[] = {
+	/* old-style */
+	{ "1.2.3", "1.2.3", 0 },
+	{ "1.2", "1.2.0.0", 0 },
+	{ "1.2.3.4", "1.2.3.5", -1 },
+	{ "2", "1.65535", 1 },
+	{ "1..2", "1.2", 0 },
+	{ "", "0", 0 },
+	{ "1.2.3.4.5", "1.2.3.4.9", 0 },
+	/* semantic versioning */
+	{ "1.2.3-rc.1", "1.2.3", -1 },
+	{ "1.2.3-rc.2", "1.2.3-rc.10", -1 },
+	{ "1.2.3-alpha", "1.2.3-beta", -1 },
+	{ "1.2.3-alpha", "1.2.3-alpha.1", -1 },
+	{ "1.2.3-1", "1.2.3-a", -1 },
+	{ "1.2.3+build1", "1.2.3+build2", 0 },
+	{ "1.10.0-rc", "1.9.0", 1 },
+	{ "65536.1", "65535.1", 1 },
+	{ "1.0.0-", "1.0.0-0", 0 },
+	{ "1.2.3-rc.1+b.2", "1.2.3-rc.1.0", -1 },
+	{ "1.2.3-rc-1", "1.2.3-rc-2", -1 },
+	/* mixed and lexicographic */
+	{ "1.2.3", "1.2.4-rc", -1 },
+	{ "1.2.3_a", "1.2.3_b", -1 },
+	{ "abc", "abd", -1 },
+};
+
+static int sign(int x)
+{
+	return x < 0 ? -1 : x > 0;
+}
+
+static void test_version_key_corpus(void **state)
+{
+	struct version_key left, right;
+
+	(void)state;
+	for (unsigned int i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+		version_key_parse(corpus[i].left, &left);
+		version_key_parse(corpus[i].right, &right);
+		assert_int_equal(sign(version_key_compare(&left, &right)),
+				 corpus[i].result);
+		assert_int_equal(sign(version_key_compare(&right, &left)),
+				 -corpus[i].result);
+	}
+}
+
+static void test_version_key_types(void **state)
+{
+	struct version_key key;
+
+	(void)state;
+	version_key_parse("1.2.3", &key);
+	assert_true(key.oldstyle);
+	assert_true(key.semver);
+	assert_false(key.has_prerelease);
+
+	version_key_parse("1.2.3-rc.4+git", &key);
+	assert_false(key.oldstyle);
+	assert_true(key.semver);
+	assert_int_equal(key.patch, 3);
+	assert_true(key.has_prerelease);
+	assert_int_equal(key.prerelease_len, 4);
+	assert_memory_equal(key.str + key.prerelease_off, "rc.4", 4);
+
+	version_key_parse("1.2.3_a", &key);
+	assert_false(key.oldstyle);
+	assert_false(key.semver);
+}
+
+/* installed versions carry their key, kept in sync with the string */
+static void test_version_key_installed(void **state)
+{
+	struct swver list;
+	struct sw_version *swver;
+	struct version_key key;
+
+	(void)state;
+	LIST_INIT(&list);
+	swver = swver_add(&list, "rootfs", "1.2.3-rc.1");
+	assert_non_null(swver);
+	assert_ptr_equal(swver_key(swver)->str, swver->version);
+
+	version_key_parse("1.2.3", &key);
+	assert_true(version_key_compare(&key, swver_key(swver)) > 0);
+
+	swver_set_version(swver, "1.2.4");
+	assert_string_equal(swver->version, "1.2.4");
+	assert_true(version_key_compare(&key, swver_key(swver)) < 0);
+}
+
+int main(void)
+{
+	int error_count = 0;
+	const struct CMUnitTest version_key_tests[] = {
+		cmocka_unit_test(test_version_key_corpus),
+		cmocka_unit_test(test_version_key_types),
+		cmocka_unit_test(test_version_key_installed)
+	};
+	error_count += cmocka_run_group_tests_name("version_key", version_key_tests,
+						   NULL, NULL);
+	return error_count;
+}
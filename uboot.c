@@ -19,6 +19,7 @@
 #include "util.h"
 #include "dlfcn.h"
 #include "bootloader.h"
+#include "bootloader_txn.h"
 
 #include <libuboot.h>
 #ifndef CONFIG_UBOOT_DEFAULTENV
@@ -64,11 +65,71 @@ static int bootloader_initialize(struct uboot_ctx **ctx)
 	return 0;
 }
 
+/*
+ * Context kept open by a transaction: changes are applied to it and
+ * stored once by do_env_commit().
+ */
+static struct uboot_ctx *txn_ctx;
+static bool txn_dirty;
+
+static void bootloader_release(struct uboot_ctx *ctx)
+{
+	libuboot.close(ctx);
+	libuboot.exit(ctx);
+}
+
+static int do_env_begin(void)
+{
+	int ret;
+	struct uboot_ctx *ctx = NULL;
+
+	ret = bootloader_initialize(&ctx);
+	if (ret) {
+		bootloader_release(ctx);
+		return ret;
+	}
+	txn_ctx = ctx;
+	txn_dirty = false;
+
+	return 0;
+}
+
+static int do_env_commit(void)
+{
+	int ret = 0;
+
+	if (!txn_ctx)
+		return -EINVAL;
+	if (txn_dirty)
+		ret = libuboot.env_store(txn_ctx);
+	bootloader_release(txn_ctx);
+	txn_ctx = NULL;
+
+	return ret;
+}
+
+static int do_env_abort(void)
+{
+	if (!txn_ctx)
+		return -EINVAL;
+	bootloader_release(txn_ctx);
+	txn_ctx = NULL;
+
+	return 0;
+}
+
 static int do_env_set(const char *name, const char *value)
 {
 	int ret;
 	struct uboot_ctx *ctx = NULL;
 
+	if (txn_ctx) {
+		ret = libuboot.set_env(txn_ctx, name, value);
+		if (!ret)
+			txn_dirty = true;
+		return ret;
+	}
+
 	ret = bootloader_initialize(&ctx);
 	if (!ret) {
 		libuboot.set_env(ctx, name, value);
@@ -91,6 +152,13 @@ static int do_apply_list(const char *filename)
 	int ret;
 	struct uboot_ctx *ctx = NULL;
 
+	if (txn_ctx) {
+		ret = libuboot.load_file(txn_ctx, filename);
+		if (!ret)
+			txn_dirty = true;
+		return ret;
+	}
+
 	ret = bootloader_initialize(&ctx);
 	if (!ret) {
 		libuboot.load_file(ctx, filename);
@@ -109,6 +177,9 @@ static char *do_env_get(const char *name)
 	struct uboot_ctx *ctx = NULL;
 	char *value = NULL;
 
+	if (txn_ctx)
+		return libuboot.get_env(txn_ctx, name);
+
 	ret = bootloader_initialize(&ctx);
 	if (!ret) {
 		value = libuboot.get_env(ctx, name);
@@ -126,6 +197,12 @@ static bootloader uboot = {
 	.apply_list = &do_apply_list
 };
 
+static bootloader_txn uboot_txn = {
+	.begin = &do_env_begin,
+	.commit = &do_env_commit,
+	.abort = &do_env_abort
+};
+
 /*
  * libubootenv is not only used as interface to U-Boot.
  * It is also used to save SWUpdate's persistent variables that
@@ -150,5 +227,6 @@ static bootloader* probe(void)
 __attribute__((constructor))
 static void uboot_probe(void)
 {
-	(void)register_bootloader(BOOTLOADER_UBOOT, probe());
+	if (!register_bootloader(BOOTLOADER_UBOOT, probe()))
+		(void)register_bootloader_txn(BOOTLOADER_UBOOT, &uboot_txn);
 }
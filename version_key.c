@@ -0,0 +1,221 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "version_key.h"
+
+#define OLDSTYLE_CHARS	"0123456789."
+#define SEMVER_CHARS	"0123456789" \
+			"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ" \
+			".-+"
+
+/*
+ * major.minor.revision.buildinfo, each field up to 65535,
+ * packed into 64 bit. Empty fields are ignored and fields
+ * after the fourth are not considered.
+ */
+static bool parse_oldstyle(const char *s, uint64_t *number)
+{
+	uint64_t version = 0;
+	unsigned int count = 0;
+	unsigned long fld;
+	char *end;
+
+	if (s[strspn(s, OLDSTYLE_CHARS)])
+		return false;
+
+	while (*s && count < 4) {
+		if (*s == '.') {
+			s++;
+			continue;
+		}
+		fld = strtoul(s, &end, 10);
+		if (fld > 0xffff)
+			return false;
+		version = (version << 16) | fld;
+		count++;
+		s = end;
+	}
+	if (count > 0)
+		version <<= 16 * (4 - count);
+	*number = version;
+
+	return true;
+}
+
+/*
+ * major.minor.patch[-prerelease][+buildinfo]
+ */
+static bool parse_semver(const char *s, struct version_key *key)
+{
+	char buf[VERSION_KEY_MAX_LEN + 1];
+	char *slice, *next, *endptr, *p;
+	int index = 0, value;
+	size_t len;
+
+	len = strlen(s);
+	if (len > VERSION_KEY_MAX_LEN || s[strspn(s, SEMVER_CHARS)])
+		return false;
+
+	strcpy(buf, s);
+	p = strchr(buf, '+');
+	if (p) {
+		*p = '\0';
+		len = p - buf;
+	}
+	p = strchr(buf, '-');
+	if (p) {
+		*p = '\0';
+		key->has_prerelease = true;
+		key->prerelease_off = p + 1 - buf;
+		key->prerelease_len = len - key->prerelease_off;
+	}
+
+	slice = buf;
+	while (slice != NULL && index++ < 4) {
+		next = strchr(slice, '.');
+		value = strtol(slice, &endptr, 10);
+		if (endptr != next && *endptr != '\0')
+			return false;
+
+		switch (index) {
+		case 1: key->major = value; break;
+		case 2: key->minor = value; break;
+		case 3: key->patch = value; break;
+		}
+		slice = next ? next + 1 : NULL;
+	}
+
+	return true;
+}
+
+void version_key_parse(const char *version, struct version_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->str = version;
+	key->oldstyle = parse_oldstyle(version, &key->number);
+	key->semver = parse_semver(version, key);
+}
+
+static int compare_int(long x, long y)
+{
+	if (x == y)
+		return 0;
+	return x < y ? -1 : 1;
+}
+
+/*
+ * Next dot separated identifier of the prerelease, starting at *pos.
+ * Returns its length, *pos is moved after the separator.
+ */
+static size_t prerelease_token(const char *s, size_t end, size_t *pos,
+			       bool *isnum, long *num)
+{
+	const char *tok = &s[*pos];
+	const char *dot = memchr(tok, '.', end - *pos);
+	size_t len = dot ? (size_t)(dot - tok) : end - *pos;
+	char *endptr;
+
+	*num = strtol(tok, &endptr, 10);
+	*isnum = endptr == tok + len;
+	*pos += len + 1;
+
+	return len;
+}
+
+static int compare_prerelease(const struct version_key *x,
+			      const struct version_key *y)
+{
+	const char *sx = x->str + x->prerelease_off;
+	const char *sy = y->str + y->prerelease_off;
+	size_t px = 0, py = 0, lx, ly;
+	bool nx, ny;
+	long vx, vy;
+	int res;
+
+	if (!x->has_prerelease && !y->has_prerelease)
+		return 0;
+	if (!y->has_prerelease)
+		return -1;
+	if (!x->has_prerelease)
+		return 1;
+
+	while (px <= x->prerelease_len && py <= y->prerelease_len) {
+		lx = prerelease_token(sx, x->prerelease_len, &px, &nx, &vx);
+		ly = prerelease_token(sy, y->prerelease_len, &py, &ny, &vy);
+		if (nx && !ny)
+			return -1;
+		if (!nx && ny)
+			return 1;
+		if (nx) {
+			if (vx != vy)
+				return vx < vy ? -1 : 1;
+			continue;
+		}
+		res = memcmp(&sx[px - lx - 1], &sy[py - ly - 1], min(lx, ly));
+		if (res)
+			return res < 0 ? -1 : 1;
+		if (lx != ly)
+			return lx < ly ? -1 : 1;
+	}
+
+	/* the one with more identifiers is higher */
+	return compare_int(px <= x->prerelease_len, py <= y->prerelease_len);
+}
+
+/*
+ * Same rules as compare_versions(): old-style if both are old-style,
+ * then semantic versioning, else a lexicographical comparison.
+ */
+int version_key_compare(const struct version_key *left,
+			const struct version_key *right)
+{
+	int res;
+
+	if (left->oldstyle && right->oldstyle) {
+		if (left->number == right->number)
+			return 0;
+		return left->number < right->number ? -1 : 1;
+	}
+
+	if (left->semver && right->semver) {
+		if ((res = compare_int(left->major, right->major)) ||
+		    (res = compare_int(left->minor, right->minor)) ||
+		    (res = compare_int(left->patch, right->patch)))
+			return res;
+		return compare_prerelease(left, right);
+	}
+
+	return strcmp(left->str, right->str);
+}
+
+/*
+ * version_key_compare() with the debug output of compare_versions()
+ */
+int compare_version_keys(const struct version_key *left,
+			 const struct version_key *right)
+{
+	if (left->oldstyle && right->oldstyle) {
+		DEBUG("Comparing old-style versions '%s' <-> '%s'",
+		      left->str, right->str);
+		TRACE("Parsed: '%llu' <-> '%llu'",
+		      (unsigned long long)left->number,
+		      (unsigned long long)right->number);
+	} else if (left->semver && right->semver) {
+		DEBUG("Comparing semantic versions '%s' <-> '%s'", left->str, right->str);
+		TRACE("Parsed: '%d.%d.%d' <-> '%d.%d.%d'",
+		      left->major, left->minor, left->patch,
+		      right->major, right->minor, right->patch);
+	} else {
+		DEBUG("Comparing lexicographically '%s' <-> '%s'", left->str, right->str);
+	}
+
+	return version_key_compare(left, right);
+}
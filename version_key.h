@@ -0,0 +1,42 @@
+/*
+ * (C) Copyright 2026
+ *
+ * SPDX-License-Identifier:     GPL-2.0-only
+ */
+
+#ifndef _VERSION_KEY_H
+#define _VERSION_KEY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* semver strings are limited to 255 chars */
+#define VERSION_KEY_MAX_LEN	255
+
+/*
+ * A version string parsed once into a form that can be compared
+ * without allocating. A string can be both an old-style version
+ * (major.minor.revision.buildinfo) and a semantic version, which
+ * one is used depends on the other version in the comparison.
+ * The key refers to the string, that must be kept valid: the
+ * prerelease is an offset into it and its identifiers are split
+ * when two keys are compared.
+ */
+struct version_key {
+	const char *str;
+	bool oldstyle;
+	uint64_t number;
+	bool semver;
+	int major, minor, patch;
+	bool has_prerelease;
+	unsigned char prerelease_off;
+	unsigned char prerelease_len;
+};
+
+void version_key_parse(const char *version, struct version_key *key);
+int version_key_compare(const struct version_key *left,
+			const struct version_key *right);
+int compare_version_keys(const struct version_key *left,
+			 const struct version_key *right);
+
+#endif